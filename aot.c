@@ -0,0 +1,139 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <vm.h>
+#include <inst.h>
+#include <icache.h>
+#include <cache.h>
+#include <aot.h>
+
+/* loaded once by rnv, shared by every vm whose ROM it was built from */
+static const struct aot_image *aot_image;
+static pthread_mutex_t aot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int aot_load(const char *path)
+{
+	const struct aot_image *image;
+	char local[PATH_MAX];
+	void *handle;
+
+	/* a bare name would be looked up in the library path */
+	if (!strchr(path, '/') && snprintf(local, sizeof(local), "./%s", path) < sizeof(local))
+		path = local;
+
+	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		printf("cannot load %s: %s\n", path, dlerror());
+		return -ENOENT;
+	}
+
+	image = dlsym(handle, AOT_IMAGE_SYMBOL);
+	if (!image) {
+		printf("%s has no translated code.\n", path);
+		goto err_close;
+	}
+
+	if (image->abi != AOT_ABI_VERSION || image->flat != AOT_FLAT ||
+	    image->vm_size != sizeof(struct vm)) {
+		printf("%s was translated for another build of rnv.\n", path);
+		goto err_close;
+	}
+
+	aot_image = image;
+
+	return 0;
+
+err_close:
+	dlclose(handle);
+	return -EINVAL;
+}
+
+/*
+ * Without -a, the first vm to run picks up what rnv-aot -C left in the
+ * cache directory for its ROM, if anything.
+ */
+static const struct aot_image *aot_find(struct vm *vm)
+{
+	static int looked;
+	char path[PATH_MAX];
+
+	pthread_mutex_lock(&aot_lock);
+	if (!aot_image && !looked && cache_enabled()) {
+		looked = 1;
+		if (!cache_path(path, sizeof(path), vm_rom_hash(vm), AOT_CACHE_VERSION, "so") &&
+		    !access(path, R_OK))
+			aot_load(path);
+		else
+			printf("no translated code in the cache for this binary, interpreting.\n");
+	}
+	pthread_mutex_unlock(&aot_lock);
+
+	return aot_image;
+}
+
+/* The loaded image if it was translated from the ROM of vm, checked once per vm. */
+static const struct aot_image *aot_attach(struct vm *vm)
+{
+	const struct aot_image *image;
+
+	if (vm->aot)
+		return vm->aot;
+
+	image = aot_find(vm);
+	if (!image)
+		return NULL;
+
+	if (image->rom_base != vm->rom.base_addr || image->rom_size != vm->rom.size ||
+	    image->rom_hash != vm_rom_hash(vm)) {
+		printf("translated code does not match the binary, interpreting.\n");
+		return NULL;
+	}
+
+	vm->aot = image;
+
+	return vm->aot;
+}
+
+/*
+ * Translated code runs until it reaches something it has no code for,
+ * which the interpreter steps over one instruction at a time until the
+ * PC is back in translated code.
+ */
+void vm_run_aot(struct vm *vm)
+{
+	const struct aot_image *image = aot_attach(vm);
+	uint32_t base = vm->rom.base_addr;
+	uint32_t size = vm->rom.size;
+	uint32_t pc = vm->cpu.pc;
+
+	if (!image) {
+		vm_run(vm);
+		return;
+	}
+
+	while (pc - base < size && !vm->halted) {
+		struct inst_decoded *d;
+
+		pc = image->run(vm, pc);
+		if (pc - base >= size || vm->halted)
+			break;
+
+		d = icache_lookup(vm->icache, pc);
+
+		vm->cpu.pc = pc + d->len;
+		d->handler(vm, d);
+		vm->icount++;
+
+		pc = vm->cpu.pc;
+
+		if (!d->inst)
+			break;
+	}
+
+	vm->cpu.pc = pc;
+}
@@ -0,0 +1,369 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <batch.h>
+#include <ecall.h>
+#include <icache.h>
+#include <cache.h>
+#include <pool.h>
+
+static const char *batch_status[] = {
+	[BATCH_OK] = "ok",
+	[BATCH_FAULT] = "fault",
+	[BATCH_ERROR] = "error",
+};
+
+static int batch_open_image(struct batch_image *img)
+{
+	struct stat sb;
+
+	img->fd = open(img->path, O_RDONLY);
+	if (img->fd < 0) {
+		printf("cannot open file: %s\n", img->path);
+		return -ENOENT;
+	}
+
+	if (fstat(img->fd, &sb) < 0) {
+		printf("cannot retrieve size of %s.\n", img->path);
+		return -EIO;
+	}
+
+	img->size = sb.st_size;
+	img->bin = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, img->fd, 0);
+	if (img->bin == MAP_FAILED) {
+		img->bin = NULL;
+		printf("failed to map %s in memory.\n", img->path);
+		return -EIO;
+	}
+
+	img->vm = vm_load_image(img->bin, img->size, img->fd, img->layout);
+	if (!img->vm) {
+		printf("cannot load %s.\n", img->path);
+		return -EINVAL;
+	}
+
+	/* decoded once here, or found decoded, then only ever read by the workers */
+	cache_attach(img->vm);
+	icache_prefill(img->vm->icache);
+
+	return 0;
+}
+
+static void batch_destroy_slot(struct batch_slot *slot)
+{
+	vm_snapshot_destroy(slot->snap);
+	vm_destroy(slot->vm);
+	free(slot);
+}
+
+static void batch_close_image(struct batch_image *img)
+{
+	while (img->idle) {
+		struct batch_slot *slot = img->idle;
+
+		img->idle = slot->next;
+		batch_destroy_slot(slot);
+	}
+
+	pthread_mutex_destroy(&img->lock);
+	if (img->vm)
+		vm_destroy(img->vm);
+	if (img->bin)
+		munmap(img->bin, img->size);
+	if (img->fd >= 0)
+		close(img->fd);
+	free(img->path);
+	free(img);
+}
+
+static struct batch_image *batch_get_image(struct batch *b, const char *path)
+{
+	struct batch_image *img;
+
+	for (int i = 0; i < b->nr_images; i++)
+		if (!strcmp(b->images[i]->path, path))
+			return b->images[i];
+
+	img = calloc(1, sizeof(*img));
+	if (!img)
+		return NULL;
+
+	b->images[b->nr_images++] = img;
+	img->fd = -1;
+	img->layout = b->layout;
+	img->path = strdup(path);
+	pthread_mutex_init(&img->lock, NULL);
+
+	if (batch_open_image(img) < 0)
+		return NULL;
+
+	return img;
+}
+
+/*
+ * Job list: one job per line, the path of a flat binary or ELF executable
+ * followed by up to BATCH_MAX_ARGS values for a0-a7. Empty lines and lines
+ * starting with '#' are skipped.
+ */
+static int batch_parse(struct batch *b, const char *list)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t len = 0;
+	int ret = 0;
+
+	f = fopen(list, "r");
+	if (!f) {
+		printf("cannot open job list: %s\n", list);
+		return -ENOENT;
+	}
+
+	while (getline(&line, &len, f) > 0) {
+		struct batch_job *job;
+		char *save, *tok;
+
+		line[strcspn(line, "\r\n")] = '\0';
+
+		tok = strtok_r(line, " \t", &save);
+		if (!tok || tok[0] == '#')
+			continue;
+
+		if (!(b->nr_jobs & (b->nr_jobs - 1))) {
+			int n = b->nr_jobs ? b->nr_jobs * 2 : 16;
+			struct batch_image **images;
+			struct batch_job *jobs;
+
+			/* either block stays valid for the cleanup if the other fails */
+			jobs = realloc(b->jobs, n * sizeof(*b->jobs));
+			if (jobs)
+				b->jobs = jobs;
+			images = realloc(b->images, n * sizeof(*b->images));
+			if (images)
+				b->images = images;
+			if (!jobs || !images) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+
+		job = &b->jobs[b->nr_jobs];
+		memset(job, 0, sizeof(*job));
+
+		job->image = batch_get_image(b, tok);
+		if (!job->image) {
+			ret = -EINVAL;
+			break;
+		}
+
+		while ((tok = strtok_r(NULL, " \t", &save))) {
+			if (job->nr_args == BATCH_MAX_ARGS) {
+				printf("%s: too many arguments, at most %d.\n", job->image->path,
+				       BATCH_MAX_ARGS);
+				ret = -EINVAL;
+				break;
+			}
+			job->args[job->nr_args++] = strtoul(tok, NULL, 0);
+		}
+		if (ret < 0)
+			break;
+
+		b->nr_jobs++;
+	}
+
+	free(line);
+	fclose(f);
+
+	return ret;
+}
+
+static struct batch_slot *batch_new_slot(struct batch_image *img)
+{
+	struct batch_slot *slot;
+
+	slot = calloc(1, sizeof(*slot));
+	if (!slot)
+		return NULL;
+
+	slot->vm = vm_load_image(img->bin, img->size, img->fd, img->layout);
+	if (!slot->vm)
+		goto err_free;
+
+	vm_share_code(slot->vm, img->vm);
+
+	slot->snap = vm_snapshot(slot->vm);
+	if (!slot->snap)
+		goto err_destroy;
+
+	return slot;
+
+err_destroy:
+	vm_destroy(slot->vm);
+err_free:
+	free(slot);
+	return NULL;
+}
+
+/* An idle vm of the image if there is one, else a newly loaded one. */
+static struct batch_slot *batch_job_start(struct batch_job *job)
+{
+	struct batch_image *img = job->image;
+	struct batch_slot *slot;
+
+	pthread_mutex_lock(&img->lock);
+	slot = img->idle;
+	if (slot)
+		img->idle = slot->next;
+	pthread_mutex_unlock(&img->lock);
+
+	if (!slot)
+		slot = batch_new_slot(img);
+	if (!slot) {
+		job->status = BATCH_ERROR;
+		return NULL;
+	}
+
+	for (int i = 0; i < job->nr_args; i++)
+		vm_write_register(slot->vm, 10 + i, job->args[i]);
+
+	return slot;
+}
+
+static void batch_job_finish(struct batch_job *job, struct batch_slot *slot)
+{
+	struct batch_image *img = job->image;
+	struct vm *vm = slot->vm;
+
+	job->status = vm->halted && !vm->exited ? BATCH_FAULT : BATCH_OK;
+	job->a0 = vm_read_register(vm, 10);
+	job->icount = vm->icount;
+
+	/* flushes the output and closes the files the job opened */
+	ecall_destroy(vm);
+
+	if (vm_restore(vm, slot->snap) < 0) {
+		batch_destroy_slot(slot);
+		return;
+	}
+
+	pthread_mutex_lock(&img->lock);
+	slot->next = img->idle;
+	img->idle = slot;
+	pthread_mutex_unlock(&img->lock);
+}
+
+static void batch_task(void *arg, int idx)
+{
+	struct batch *b = arg;
+	struct batch_task *task = &b->tasks[idx];
+	struct batch_job *jobs[VM_LOCKSTEP_LANES];
+	struct batch_slot *slots[VM_LOCKSTEP_LANES];
+	struct vm *vms[VM_LOCKSTEP_LANES];
+	int nr = 0;
+
+	for (int i = 0; i < task->nr; i++) {
+		struct batch_job *job = &b->jobs[task->first + i];
+
+		slots[nr] = batch_job_start(job);
+		if (!slots[nr])
+			continue;
+
+		vms[nr] = slots[nr]->vm;
+		jobs[nr++] = job;
+	}
+
+	if (b->run_many) {
+		b->run_many(vms, nr);
+	} else {
+		for (int i = 0; i < nr; i++)
+			b->run(vms[i]);
+	}
+
+	for (int i = 0; i < nr; i++)
+		batch_job_finish(jobs[i], slots[i]);
+}
+
+/*
+ * Engines running several vms at once get runs of consecutive jobs on the
+ * same image, the others one job per task.
+ */
+static int batch_split(struct batch *b)
+{
+	int max = b->run_many ? VM_LOCKSTEP_LANES : 1;
+
+	b->tasks = calloc(b->nr_jobs, sizeof(*b->tasks));
+	if (!b->tasks)
+		return -ENOMEM;
+
+	for (int i = 0; i < b->nr_jobs; i++) {
+		struct batch_task *task = &b->tasks[b->nr_tasks];
+
+		if (task->nr == max || (task->nr && b->jobs[task->first].image != b->jobs[i].image))
+			task = &b->tasks[++b->nr_tasks];
+
+		if (!task->nr)
+			task->first = i;
+		task->nr++;
+	}
+
+	if (b->nr_jobs)
+		b->nr_tasks++;
+
+	return 0;
+}
+
+int batch_run(const char *list, void (*run)(struct vm *vm),
+	      void (*run_many)(struct vm **vms, int nr), const char *engine, int nr_workers,
+	      const struct vm_layout *layout)
+{
+	struct timespec start, end;
+	struct batch b = { .run = run, .run_many = run_many, .layout = layout };
+	uint64_t icount = 0;
+	int failed = 0;
+	double secs;
+	int ret;
+
+	ret = batch_parse(&b, list);
+	if (ret < 0)
+		goto out;
+
+	ret = batch_split(&b);
+	if (ret < 0)
+		goto out;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = pool_run(b.nr_tasks, nr_workers, batch_task, &b);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret < 0)
+		goto out;
+
+	for (int i = 0; i < b.nr_jobs; i++) {
+		struct batch_job *job = &b.jobs[i];
+
+		printf("job %d: %s %s a0=0x%08x %llu instructions\n", i, job->image->path,
+		       batch_status[job->status], job->a0, (unsigned long long)job->icount);
+
+		icount += job->icount;
+		failed += job->status != BATCH_OK;
+	}
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%s: %d jobs (%d failed) on %d workers, %llu instructions in %.6f s (%.2f MIPS)\n",
+	       engine, b.nr_jobs, failed, nr_workers < b.nr_tasks ? nr_workers : b.nr_tasks,
+	       (unsigned long long)icount, secs, secs > 0 ? icount / secs / 1e6 : 0.0);
+
+out:
+	for (int i = 0; i < b.nr_images; i++)
+		batch_close_image(b.images[i]);
+	free(b.images);
+	free(b.jobs);
+	free(b.tasks);
+
+	return ret;
+}
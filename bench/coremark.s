@@ -0,0 +1,178 @@
+# CoreMark-style kernels: linked list reversal and search, and an 8x8
+# matrix multiply through a shift-and-add multiply, ROUNDS times.
+# expect: 0x610a9818
+
+	.equ LIST, 0x20000
+	.equ NODES, 256
+	.equ MATA, 0x21000
+	.equ MATB, 0x21100
+	.equ MATC, 0x21200
+	.equ ROUNDS, 500
+
+	.text
+	.globl _start
+_start:
+	li s0, LIST
+	li s1, NODES
+	li a0, 0x2545f491
+	mv t2, s0
+build:
+	slli t0, a0, 13
+	xor a0, a0, t0
+	srli t0, a0, 17
+	xor a0, a0, t0
+	slli t0, a0, 5
+	xor a0, a0, t0
+	srli t1, a0, 16
+	sw t1, 4(t2)
+	addi t3, t2, 8
+	sw t3, 0(t2)
+	mv t2, t3
+	addi s1, s1, -1
+	bnez s1, build
+	sw zero, -8(t2)
+
+	li t2, MATA
+	li s1, 128
+fill:
+	slli t0, a0, 13
+	xor a0, a0, t0
+	srli t0, a0, 17
+	xor a0, a0, t0
+	slli t0, a0, 5
+	xor a0, a0, t0
+	andi t1, a0, 0xff
+	sw t1, 0(t2)
+	addi t2, t2, 4
+	addi s1, s1, -1
+	bnez s1, fill
+
+	li s2, ROUNDS
+	li s3, 0
+	mv s4, s0
+round:
+	mv a0, s4
+	call list_reverse
+	mv s4, a0
+	andi a1, s2, 0xff
+	call list_find
+	add s3, s3, a0
+	call matmul
+
+	andi t0, s2, 63
+	slli t0, t0, 2
+	li t1, MATC
+	add t1, t1, t0
+	lw t2, 0(t1)
+	xor s3, s3, t2
+	slli t3, s3, 1
+	srli t4, s3, 31
+	or s3, t3, t4
+	li t1, MATA
+	add t1, t1, t0
+	lw t2, 0(t1)
+	addi t2, t2, 1
+	andi t2, t2, 0xff
+	sw t2, 0(t1)
+
+	addi s2, s2, -1
+	bnez s2, round
+
+	mv a0, s3
+	.word 0
+
+# a0 = head, returns the new head
+list_reverse:
+	li t0, 0
+lr_loop:
+	beqz a0, lr_done
+	lw t1, 0(a0)
+	sw t0, 0(a0)
+	mv t0, a0
+	mv a0, t1
+	j lr_loop
+lr_done:
+	mv a0, t0
+	ret
+
+# a0 = head, a1 = limit, returns how many nodes have a lower low byte
+list_find:
+	li t0, 0
+lf_loop:
+	beqz a0, lf_done
+	lw t1, 4(a0)
+	andi t1, t1, 0xff
+	bgeu t1, a1, lf_next
+	addi t0, t0, 1
+lf_next:
+	lw a0, 0(a0)
+	j lf_loop
+lf_done:
+	mv a0, t0
+	ret
+
+# a0 = a0 * a1, clobbers t0, t1 and a1
+mul32:
+	mv t0, a0
+	li a0, 0
+mul_loop:
+	andi t1, a1, 1
+	beqz t1, mul_skip
+	add a0, a0, t0
+mul_skip:
+	slli t0, t0, 1
+	srli a1, a1, 1
+	bnez a1, mul_loop
+	ret
+
+# MATC = MATA * MATB
+matmul:
+	addi sp, sp, -32
+	sw ra, 28(sp)
+	sw s0, 24(sp)
+	sw s1, 20(sp)
+	sw s2, 16(sp)
+	sw s3, 12(sp)
+	li s0, 0
+mm_i:
+	li s1, 0
+mm_j:
+	li s2, 0
+	li s3, 0
+mm_k:
+	slli t0, s0, 3
+	add t0, t0, s2
+	slli t0, t0, 2
+	li t1, MATA
+	add t0, t0, t1
+	lw a0, 0(t0)
+	slli t0, s2, 3
+	add t0, t0, s1
+	slli t0, t0, 2
+	li t1, MATB
+	add t0, t0, t1
+	lw a1, 0(t0)
+	call mul32
+	add s3, s3, a0
+	addi s2, s2, 1
+	li t0, 8
+	bne s2, t0, mm_k
+	slli t0, s0, 3
+	add t0, t0, s1
+	slli t0, t0, 2
+	li t1, MATC
+	add t0, t0, t1
+	sw s3, 0(t0)
+	addi s1, s1, 1
+	li t0, 8
+	bne s1, t0, mm_j
+	addi s0, s0, 1
+	li t0, 8
+	bne s0, t0, mm_i
+	lw ra, 28(sp)
+	lw s0, 24(sp)
+	lw s1, 20(sp)
+	lw s2, 16(sp)
+	lw s3, 12(sp)
+	addi sp, sp, 32
+	ret
@@ -0,0 +1,53 @@
+# CRC-32 (reflected, polynomial 0xedb88320), computed bit by bit over a
+# 4 KiB buffer of pseudo-random data, ROUNDS times.
+# expect: 0x1973b59c
+
+	.equ BUF, 0x20000
+	.equ LEN, 4096
+	.equ ROUNDS, 100
+
+	.text
+	.globl _start
+_start:
+	li s0, BUF
+	li s1, LEN
+	li a0, 0x12345678
+	mv t2, s0
+fill:
+	slli t0, a0, 13
+	xor a0, a0, t0
+	srli t0, a0, 17
+	xor a0, a0, t0
+	slli t0, a0, 5
+	xor a0, a0, t0
+	sw a0, 0(t2)
+	addi t2, t2, 4
+	addi s1, s1, -4
+	bnez s1, fill
+
+	li s2, ROUNDS
+	li s3, 0xedb88320
+	li a0, -1
+round:
+	mv t2, s0
+	li s1, LEN
+byte:
+	lbu t0, 0(t2)
+	xor a0, a0, t0
+	li t1, 8
+bit:
+	andi t3, a0, 1
+	srli a0, a0, 1
+	beqz t3, nopoly
+	xor a0, a0, s3
+nopoly:
+	addi t1, t1, -1
+	bnez t1, bit
+	addi t2, t2, 1
+	addi s1, s1, -1
+	bnez s1, byte
+	addi s2, s2, -1
+	bnez s2, round
+
+	not a0, a0
+	.word 0
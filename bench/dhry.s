@@ -0,0 +1,134 @@
+# Dhrystone-style mix: calls and returns, a record copy, small integer
+# arithmetic, a string compare and array updates, ITER times.
+# expect: 0x009f219a
+
+	.equ ITER, 60000
+	.equ REC1, 0x20000
+	.equ REC2, 0x20040
+	.equ ARR1, 0x20100
+	.equ ARR2, 0x20400
+
+	.text
+	.globl _start
+_start:
+	li t0, REC1
+	li t1, 12
+	li t2, 1
+init:
+	sw t2, 0(t0)
+	addi t2, t2, 3
+	addi t0, t0, 4
+	addi t1, t1, -1
+	bnez t1, init
+
+	li s0, ITER
+	li s1, 0
+main_loop:
+	call proc_copy
+	add s1, s1, a0
+	mv a0, s0
+	call proc_arith
+	add s1, s1, a0
+	la a0, str1
+	la a1, str2
+	call str_cmp
+	add s1, s1, a0
+	mv a0, s0
+	call proc_arrays
+	xor s1, s1, a0
+	addi s0, s0, -1
+	bnez s0, main_loop
+
+	mv a0, s1
+	.word 0
+
+# copy record 1 to record 2 and update a few of its fields
+proc_copy:
+	li t0, REC1
+	li t1, REC2
+	li t2, 12
+pc_loop:
+	lw t3, 0(t0)
+	sw t3, 0(t1)
+	addi t0, t0, 4
+	addi t1, t1, 4
+	addi t2, t2, -1
+	bnez t2, pc_loop
+	li t1, REC2
+	lw t3, 4(t1)
+	lw t4, 8(t1)
+	add t3, t3, t4
+	sw t3, 4(t1)
+	li t0, REC1
+	sw t3, 12(t0)
+	mv a0, t3
+	ret
+
+# a0 = n: a few rounds of 5 * a + b, then a small quotient by 7
+proc_arith:
+	andi t0, a0, 15
+	addi t1, t0, 3
+	li t2, 5
+pa_loop:
+	slli t3, t0, 2
+	add t3, t3, t0
+	add t3, t3, t1
+	sub t1, t3, t1
+	xor t0, t0, t3
+	andi t0, t0, 255
+	addi t2, t2, -1
+	bnez t2, pa_loop
+	andi t3, t3, 63
+	li t4, 0
+	li t5, 7
+pa_div:
+	bltu t3, t5, pa_done
+	sub t3, t3, t5
+	addi t4, t4, 1
+	j pa_div
+pa_done:
+	add a0, t4, t0
+	ret
+
+# a0, a1: strings, returns the difference of the first mismatching bytes
+str_cmp:
+	lbu t0, 0(a0)
+	lbu t1, 0(a1)
+	bne t0, t1, sc_diff
+	beqz t0, sc_diff
+	addi a0, a0, 1
+	addi a1, a1, 1
+	j str_cmp
+sc_diff:
+	sub a0, t0, t1
+	ret
+
+# a0 = n: index arithmetic on a vector and a 16x16 matrix
+proc_arrays:
+	andi t0, a0, 7
+	addi t0, t0, 5
+	slli t1, t0, 2
+	li t2, ARR1
+	add t1, t1, t2
+	sw a0, 0(t1)
+	sw a0, 4(t1)
+	sw t0, 120(t1)
+	slli t3, t0, 6
+	li t2, ARR2
+	add t3, t3, t2
+	slli t4, t0, 2
+	add t3, t3, t4
+	sw t0, 0(t3)
+	sw t0, 4(t3)
+	lw t5, -4(t3)
+	addi t5, t5, 1
+	sw t5, -4(t3)
+	lw t6, 0(t1)
+	sw t6, 128(t3)
+	mv a0, t5
+	ret
+
+str1:
+	.string "DHRYSTONE PROGRAM, SOME STRING"
+str2:
+	.string "DHRYSTONE PROGRAM, SOME STRINH"
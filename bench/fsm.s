@@ -0,0 +1,119 @@
+# Branchy tokenizer: a state machine dispatched through a jump table walks
+# an 8 KiB stream of pseudo-random characters, classifying numbers,
+# identifiers, operators and blanks, ROUNDS times.
+# expect: 0xcc14d5df
+
+	.equ BUF, 0x20000
+	.equ LEN, 8192
+	.equ ROUNDS, 120
+
+	.text
+	.globl _start
+_start:
+	li t2, BUF
+	li t3, LEN
+	li a0, 0xdeadbeef
+fill:
+	slli t0, a0, 13
+	xor a0, a0, t0
+	srli t0, a0, 17
+	xor a0, a0, t0
+	slli t0, a0, 5
+	xor a0, a0, t0
+	andi t1, a0, 63
+	sb t1, 0(t2)
+	addi t2, t2, 1
+	addi t3, t3, -1
+	bnez t3, fill
+
+	li s7, ROUNDS
+	li s8, 0
+	la s4, class_tab
+	la s6, state_tab
+round:
+	li s0, BUF
+	li t6, LEN
+	add s1, s0, t6
+	li s5, 0
+	li s2, 0
+	li s3, 0
+loop:
+	lbu t0, 0(s0)
+	add t1, s4, t0
+	lbu t1, 0(t1)
+	slli t2, s5, 2
+	add t2, t2, s6
+	lw t2, 0(t2)
+	jr t2
+
+st_start:
+	beqz t1, to_num
+	li t3, 1
+	beq t1, t3, to_ident
+	li t3, 3
+	beq t1, t3, op
+	j next
+to_num:
+	andi s2, t0, 7
+	li s5, 1
+	j next
+to_ident:
+	mv s2, t0
+	li s5, 2
+	j next
+op:
+	addi s3, s3, 1
+	xor s8, s8, t0
+	j next
+
+st_num:
+	bnez t1, num_end
+	slli t3, s2, 3
+	slli t4, s2, 1
+	add s2, t3, t4
+	andi t3, t0, 7
+	add s2, s2, t3
+	j next
+num_end:
+	add s8, s8, s2
+	addi s3, s3, 1
+	li s5, 0
+	j st_start
+
+st_ident:
+	li t3, 2
+	bgeu t1, t3, ident_end
+	slli t3, s2, 5
+	sub t3, t3, s2
+	add s2, t3, t0
+	j next
+ident_end:
+	xor s8, s8, s2
+	addi s3, s3, 1
+	li s5, 0
+	j st_start
+
+next:
+	addi s0, s0, 1
+	bne s0, s1, loop
+
+	add s8, s8, s3
+	slli t3, s8, 3
+	srli t4, s8, 29
+	or s8, t3, t4
+	addi s7, s7, -1
+	bnez s7, round
+
+	mv a0, s8
+	.word 0
+
+	.align 2
+state_tab:
+	.word st_start, st_num, st_ident
+
+# 0: digit, 1: letter, 2: blank, 3: operator
+class_tab:
+	.byte 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1
+	.byte 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
+	.byte 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2
+	.byte 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3
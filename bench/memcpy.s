@@ -0,0 +1,101 @@
+# memset and memcpy: word stores and copies unrolled by four over 8 KiB
+# buffers, then a 1 KiB byte copy between misaligned addresses, ROUNDS
+# times. a0 folds in a word of each destination every round.
+# expect: 0x91bbafc6
+
+	.equ SRC, 0x20000
+	.equ DST, 0x22000
+	.equ SET, 0x24000
+	.equ LEN, 8192
+	.equ ROUNDS, 1200
+
+	.text
+	.globl _start
+_start:
+	li t2, SRC
+	li t3, LEN
+	li a0, 0x9e3779b9
+fill:
+	slli t0, a0, 13
+	xor a0, a0, t0
+	srli t0, a0, 17
+	xor a0, a0, t0
+	slli t0, a0, 5
+	xor a0, a0, t0
+	sw a0, 0(t2)
+	addi t2, t2, 4
+	addi t3, t3, -4
+	bnez t3, fill
+
+	li s7, ROUNDS
+	li s8, 0
+round:
+	andi t0, s7, 0xff
+	slli t1, t0, 8
+	or t0, t0, t1
+	slli t1, t0, 16
+	or t0, t0, t1
+	li a0, SET
+	li t2, LEN
+	add a1, a0, t2
+memset:
+	sw t0, 0(a0)
+	sw t0, 4(a0)
+	sw t0, 8(a0)
+	sw t0, 12(a0)
+	addi a0, a0, 16
+	bne a0, a1, memset
+
+	li a0, SRC
+	li a2, DST
+	li t2, LEN
+	add a1, a0, t2
+memcpy:
+	lw t0, 0(a0)
+	lw t1, 4(a0)
+	lw t3, 8(a0)
+	lw t4, 12(a0)
+	sw t0, 0(a2)
+	sw t1, 4(a2)
+	sw t3, 8(a2)
+	sw t4, 12(a2)
+	addi a0, a0, 16
+	addi a2, a2, 16
+	bne a0, a1, memcpy
+
+	li a0, SRC + 1
+	andi t5, s7, 0x3ff
+	add a0, a0, t5
+	li a2, DST + 3
+	li t2, 1024
+	add a1, a0, t2
+bytecpy:
+	lbu t0, 0(a0)
+	sb t0, 0(a2)
+	addi a0, a0, 1
+	addi a2, a2, 1
+	bne a0, a1, bytecpy
+
+	andi t0, s7, 0x7fc
+	li t1, DST
+	add t1, t1, t0
+	lw t2, 0(t1)
+	add s8, s8, t2
+	li t1, SET
+	add t1, t1, t0
+	lw t2, 0(t1)
+	xor s8, s8, t2
+	slli t3, s8, 1
+	srli t4, s8, 31
+	or s8, t3, t4
+	li t1, SRC
+	add t1, t1, t0
+	lw t2, 0(t1)
+	add t2, t2, s7
+	sw t2, 0(t1)
+
+	addi s7, s7, -1
+	bnez s7, round
+
+	mv a0, s8
+	.word 0
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Run each bench/*.bin on every engine and print one JSON object per run:
+#
+#   {"bench":"crc32","engine":"jit","instructions":20489380,
+#    "seconds":0.058051,"mips":352.96,"a0":"0x1973b59c","ok":true}
+#
+# "ok" tells whether a0 matched the "# expect:" checksum in the source. The
+# exit status is non-zero if any run failed or got a wrong checksum.
+#
+# RNV, RNV_AOT and ENGINES override the binaries and the engines to run.
+# The aot engine runs each guest as translated by rnv-aot beforehand.
+
+dir=$(dirname "$0")
+RNV=${RNV:-$dir/../rnv}
+RNV_AOT=${RNV_AOT:-$dir/../rnv-aot}
+ENGINES=${ENGINES:-"interp fast jit lockstep aot"}
+status=0
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+for bin in "$dir"/*.bin; do
+	name=$(basename "$bin" .bin)
+	expect=$(sed -n 's/^# expect: *//p' "$dir/$name.s")
+
+	for engine in $ENGINES; do
+		set --
+		if [ "$engine" = aot ]; then
+			"$RNV_AOT" -o "$tmp/$name.so" "$bin" > /dev/null || status=1
+			set -- -a "$tmp/$name.so"
+		fi
+
+		out=$("$RNV" -r -e "$engine" "$@" "$bin") || status=1
+		a0=$(echo "$out" | sed -n 's/^x10 = 0x//p')
+		set -- $(echo "$out" | sed -n "s/^$engine: \([0-9]*\) instructions in \([0-9.]*\) s (\([0-9.]*\) MIPS)$/\1 \2 \3/p")
+
+		a0=$(printf '0x%08x' "0x${a0:-0}")
+		ok=true
+		if [ $# -ne 3 ] || [ "$a0" != "$expect" ]; then
+			ok=false
+			status=1
+		fi
+
+		printf '{"bench":"%s","engine":"%s","instructions":%s,"seconds":%s,"mips":%s,"a0":"%s","ok":%s}\n' \
+			"$name" "$engine" "${1:-0}" "${2:-0}" "${3:-0}" "$a0" "$ok"
+	done
+done
+
+exit $status
@@ -0,0 +1,95 @@
+# RV32M: every multiply and divide on the operands the spec singles out,
+# division by zero and INT32_MIN / -1, then on ROUNDS pairs of
+# pseudo-random operands, some of them small, zero or negative. Each
+# result is folded into a0 with an FNV-1a step.
+# march: rv32im
+# expect: 0xe03248a2
+
+	.equ ROUNDS, 200000
+	.equ FNV, 0x01000193
+
+	.macro check op, a, b
+	li t0, \a
+	li t1, \b
+	\op t2, t0, t1
+	call mix
+	.endm
+
+	.macro all a, b
+	check mul, \a, \b
+	check mulh, \a, \b
+	check mulhsu, \a, \b
+	check mulhu, \a, \b
+	check div, \a, \b
+	check divu, \a, \b
+	check rem, \a, \b
+	check remu, \a, \b
+	.endm
+
+	.text
+	.globl _start
+_start:
+	li s0, FNV
+	li a0, 0x811c9dc5
+
+	all 0, 0
+	all 7, 0
+	all -7, 0
+	all 0x80000000, 0
+	all 0x80000000, -1
+	all 0x80000000, 1
+	all 0x7fffffff, -1
+	all -1, -1
+	all 0x7fffffff, 0x7fffffff
+	all 0x80000000, 0x80000000
+	all -7, 2
+	all 7, -2
+	all -7, -2
+	all 0xffffffff, 0x7fffffff
+	all 0x12345678, 0x9abcdef0
+
+	li s1, ROUNDS
+	li s2, 0x2545f491
+round:
+	# xorshift32 for a, b is a shifted by a's own low bits
+	slli t0, s2, 13
+	xor s2, s2, t0
+	srli t0, s2, 17
+	xor s2, s2, t0
+	slli t0, s2, 5
+	xor s2, s2, t0
+	andi t0, s2, 31
+	sra s3, s2, t0
+	andi t0, s2, 0x300
+	bnez t0, operands
+	# one round in four divides by zero or -1
+	srai s3, s2, 31
+operands:
+	mv t0, s2
+	mv t1, s3
+	mul t2, t0, t1
+	call mix
+	mulh t2, t0, t1
+	call mix
+	mulhsu t2, t0, t1
+	call mix
+	mulhu t2, t0, t1
+	call mix
+	div t2, t0, t1
+	call mix
+	divu t2, t0, t1
+	call mix
+	rem t2, t0, t1
+	call mix
+	remu t2, t0, t1
+	call mix
+	addi s1, s1, -1
+	bnez s1, round
+
+	.word 0
+
+# a0 = (a0 ^ t2) * FNV
+mix:
+	xor a0, a0, t2
+	mul a0, a0, s0
+	ret
@@ -0,0 +1,90 @@
+# RVC: a loop written in compressed instructions only, ROUNDS times. It
+# spills through the sp and register-based forms, branches on pseudo-random
+# bits, calls a leaf with its own stack frame and calls through a register.
+# a0 is 0 if a spilled word came back different.
+# march: rv32imc
+# expect: 0x45009de6
+
+	.equ ROUNDS, 500000
+
+	.text
+	.globl _start
+_start:
+	# a5 = twist, the return address of a call jumping over it
+	c.jal 1f
+
+# a2 *= 5
+twist:
+	c.mv a3, a2
+	c.slli a3, 2
+	c.add a2, a3
+	c.jr ra
+
+1:	c.mv a5, ra
+	c.addi16sp sp, -64
+	c.addi4spn s0, sp, 32
+	c.li a0, -1
+	li a1, 0x1234567
+	li s1, ROUNDS
+round:
+	# xorshift32, a2 scratch
+	c.mv a2, a1
+	c.slli a2, 13
+	c.xor a1, a2
+	c.mv a2, a1
+	c.srli a2, 17
+	c.xor a1, a2
+	c.mv a2, a1
+	c.slli a2, 5
+	c.xor a1, a2
+
+	c.swsp a1, 12(sp)
+	c.sw a1, 4(s0)
+	c.lwsp a3, 12(sp)
+	c.lw a4, 4(s0)
+	c.sub a3, a4
+	c.bnez a3, bad
+
+	c.mv a2, a1
+	c.andi a2, 3
+	c.beqz a2, low
+	c.jal leaf
+	c.j join
+low:
+	c.mv a2, a1
+	c.srai a2, 3
+	c.lui a3, 31
+	c.and a2, a3
+	c.nop
+join:
+	c.jalr a5
+
+	# a0 = rotl(a0, 5) ^ a2
+	c.mv a3, a0
+	c.slli a0, 5
+	c.srli a3, 27
+	c.or a0, a3
+	c.xor a0, a2
+	c.addi s1, -1
+	c.bnez s1, round
+
+	c.addi16sp sp, 64
+	.word 0
+
+bad:
+	c.li a0, 0
+	.word 0
+
+# a2 = (a1 ^ (a1 >> 7)) + 33, through a stack frame
+leaf:
+	c.addi16sp sp, -16
+	c.swsp ra, 12(sp)
+	c.swsp a1, 8(sp)
+	c.lwsp a2, 8(sp)
+	c.srli a2, 7
+	c.xor a2, a1
+	c.addi a2, 31
+	c.addi a2, 2
+	c.lwsp ra, 12(sp)
+	c.addi16sp sp, 16
+	c.jr ra
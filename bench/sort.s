@@ -0,0 +1,100 @@
+# Recursive quicksort of 2048 pseudo-random signed words, ROUNDS times
+# with fresh data. a0 is -1 if a result was not sorted.
+# expect: 0x87c001dc
+
+	.equ ARR, 0x20000
+	.equ N, 2048
+	.equ ROUNDS, 80
+
+	.text
+	.globl _start
+_start:
+	li s7, ROUNDS
+	li s8, 0
+	li s6, 0x1234567
+round:
+	li t2, ARR
+	li t3, N
+fill:
+	slli t0, s6, 13
+	xor s6, s6, t0
+	srli t0, s6, 17
+	xor s6, s6, t0
+	slli t0, s6, 5
+	xor s6, s6, t0
+	sw s6, 0(t2)
+	addi t2, t2, 4
+	addi t3, t3, -1
+	bnez t3, fill
+
+	li a0, ARR
+	li a1, ARR + (N - 1) * 4
+	call qsort
+
+	li t2, ARR
+	li t3, N - 1
+	lw t4, 0(t2)
+check:
+	lw t5, 4(t2)
+	blt t5, t4, unsorted
+	xor s8, s8, t5
+	slli t0, s8, 1
+	srli t1, s8, 31
+	or s8, t0, t1
+	mv t4, t5
+	addi t2, t2, 4
+	addi t3, t3, -1
+	bnez t3, check
+
+	addi s7, s7, -1
+	bnez s7, round
+
+	mv a0, s8
+	.word 0
+
+unsorted:
+	li a0, -1
+	.word 0
+
+# qsort(a0 = first, a1 = last): sorts the words in [a0, a1]
+qsort:
+	bgeu a0, a1, qsort_ret
+	addi sp, sp, -16
+	sw ra, 12(sp)
+	sw s0, 8(sp)
+	sw s1, 4(sp)
+	sw s2, 0(sp)
+	mv s0, a0
+	mv s1, a1
+	lw t0, 0(s1)
+	mv t1, s0
+	mv t2, s0
+partition:
+	bgeu t2, s1, partitioned
+	lw t3, 0(t2)
+	bge t3, t0, keep
+	lw t4, 0(t1)
+	sw t3, 0(t1)
+	sw t4, 0(t2)
+	addi t1, t1, 4
+keep:
+	addi t2, t2, 4
+	j partition
+partitioned:
+	lw t4, 0(t1)
+	sw t0, 0(t1)
+	sw t4, 0(s1)
+	mv s2, t1
+	mv a0, s0
+	addi a1, s2, -4
+	call qsort
+	addi a0, s2, 4
+	mv a1, s1
+	call qsort
+	lw ra, 12(sp)
+	lw s0, 8(sp)
+	lw s1, 4(sp)
+	lw s2, 0(sp)
+	addi sp, sp, 16
+qsort_ret:
+	ret
@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <link.h>
+#include <elf.h>
+#include <sys/stat.h>
+#include <vm.h>
+#include <icache.h>
+#include <cache.h>
+
+static char cache_dir[PATH_MAX];
+
+int cache_init(const char *dir)
+{
+	struct stat sb;
+
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+		printf("cannot create cache directory %s: %s\n", dir, strerror(errno));
+		return -errno;
+	}
+
+	if (stat(dir, &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+		printf("%s is not a directory.\n", dir);
+		return -ENOTDIR;
+	}
+
+	if (snprintf(cache_dir, sizeof(cache_dir), "%s", dir) >= sizeof(cache_dir)) {
+		cache_dir[0] = '\0';
+		return -ENAMETOOLONG;
+	}
+
+	return 0;
+}
+
+int cache_enabled(void)
+{
+	return cache_dir[0] != '\0';
+}
+
+int cache_path(char *buf, size_t len, uint64_t rom_hash, uint64_t version, const char *kind)
+{
+	if (!cache_enabled())
+		return -ENOENT;
+
+	if (snprintf(buf, len, "%s/%016llx-%016llx.%s", cache_dir, (unsigned long long)rom_hash,
+		     (unsigned long long)version, kind) >= len)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+/* GNU build id of the executable, folded to 64 bits */
+static int cache_find_build_id(struct dl_phdr_info *info, size_t size, void *data)
+{
+	uint64_t *build = data;
+
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+		const uint8_t *p, *end;
+
+		if (phdr->p_type != PT_NOTE)
+			continue;
+
+		p = (const uint8_t *)(info->dlpi_addr + phdr->p_vaddr);
+		end = p + phdr->p_memsz;
+		while (p + sizeof(ElfW(Nhdr)) <= end) {
+			const ElfW(Nhdr) *note = (const ElfW(Nhdr) *)p;
+			const uint8_t *name = p + sizeof(*note);
+			const uint8_t *desc = name + ((note->n_namesz + 3) & ~3);
+
+			if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+			    !memcmp(name, "GNU", 4) && desc + note->n_descsz <= end) {
+				uint64_t hash = 0xcbf29ce484222325ull;
+
+				for (int j = 0; j < note->n_descsz; j++)
+					hash = (hash ^ desc[j]) * 0x100000001b3ull;
+				*build = hash;
+				return 1;
+			}
+			p = desc + ((note->n_descsz + 3) & ~3);
+		}
+	}
+
+	/* the executable comes first, the libraries do not matter */
+	return 1;
+}
+
+/*
+ * Decoded pages hold handler addresses and the decoder's view of every
+ * instruction, they are only reused by the very build that made them.
+ */
+static uint64_t cache_build_id(void)
+{
+	static uint64_t build;
+	static int once;
+
+	if (!once) {
+		dl_iterate_phdr(cache_find_build_id, &build);
+		if (!build)
+			printf("rnv has no build id, decoded code is not cached.\n");
+		once = 1;
+	}
+
+	return build;
+}
+
+/* Back the decode cache of vm, loaded already, with the cache directory. */
+void cache_attach(struct vm *vm)
+{
+	char path[PATH_MAX];
+	uint64_t build;
+	uint64_t hash;
+	int ret;
+
+	if (!cache_enabled())
+		return;
+
+	build = cache_build_id();
+	if (!build)
+		return;
+
+	hash = vm_rom_hash(vm);
+	ret = cache_path(path, sizeof(path), hash, build, "icache");
+	if (!ret)
+		ret = icache_load(vm->icache, path, hash, build);
+	if (ret < 0)
+		printf("cannot use %s: %s\n", path, strerror(-ret));
+}
@@ -1 +1 @@
-riscv32-unknown-elf-gcc -march=rv32i -nostdlib test_app.c -o test
+riscv32-unknown-elf-gcc -march=rv32im -nostdlib test_app.c -o test
@@ -0,0 +1,456 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <vm.h>
+#include <mm.h>
+#include <ecall.h>
+
+#define ECALL_AT_FDCWD		-100
+#define ECALL_STAT_SIZE		128
+#define ECALL_BOUNCE_SIZE	4096
+
+/* open() flags of the generic Linux ABI that RISC-V uses */
+static const struct {
+	uint32_t guest;
+	int host;
+} ecall_open_flags[] = {
+	{ 00000001, O_WRONLY },
+	{ 00000002, O_RDWR },
+	{ 00000100, O_CREAT },
+	{ 00000200, O_EXCL },
+	{ 00000400, O_NOCTTY },
+	{ 00001000, O_TRUNC },
+	{ 00002000, O_APPEND },
+	{ 00004000, O_NONBLOCK },
+	{ 00200000, O_DIRECTORY },
+	{ 00400000, O_NOFOLLOW },
+	{ 02000000, O_CLOEXEC },
+};
+
+static struct ecall *ecall_get(struct vm *vm)
+{
+	if (!vm->ecall)
+		vm->ecall = calloc(1, sizeof(*vm->ecall));
+
+	return vm->ecall;
+}
+
+/*
+ * Whether every page of [addr, addr + len) answers to access, directly or
+ * through the bus slow path (MMIO, dirty tracking), so that the syscall
+ * can return -EFAULT rather than fault the guest half way through.
+ */
+static int ecall_access_ok(struct bus *bus, uint32_t addr, uint32_t len, int access)
+{
+	uint64_t end = (uint64_t)addr + len;
+	int ok = access | BUS_MMIO | (access == BUS_WRITE ? BUS_TRACK : 0);
+
+	if (end > (1ULL << 32))
+		return 0;
+
+	for (uint64_t p = addr >> BUS_PAGE_SHIFT; p << BUS_PAGE_SHIFT < end; p++)
+		if (!(bus->pages[p] & ok))
+			return 0;
+
+	return 1;
+}
+
+static int ecall_find_file(struct ecall *ec, int fd)
+{
+	for (int i = 0; i < ec->nr_files; i++)
+		if (ec->files[i] == fd)
+			return i;
+
+	return -1;
+}
+
+static int ecall_valid_fd(struct ecall *ec, int fd)
+{
+	return (fd >= 0 && fd <= 2) || ecall_find_file(ec, fd) >= 0;
+}
+
+static int ecall_write_all(int fd, const char *buf, uint32_t len)
+{
+	uint32_t done = 0;
+
+	while (done < len) {
+		ssize_t ret = write(fd, buf + done, len - done);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += ret;
+	}
+
+	return done;
+}
+
+/* Push out the guest's buffered stdout, behind whatever rnv printed itself. */
+void ecall_flush(struct vm *vm)
+{
+	struct ecall *ec = vm->ecall;
+
+	if (!ec || !ec->out_len)
+		return;
+
+	fflush(stdout);
+	ecall_write_all(STDOUT_FILENO, ec->out, ec->out_len);
+	ec->out_len = 0;
+}
+
+void ecall_destroy(struct vm *vm)
+{
+	struct ecall *ec = vm->ecall;
+
+	if (!ec)
+		return;
+
+	ecall_flush(vm);
+
+	for (int i = 0; i < ec->nr_files; i++)
+		close(ec->files[i]);
+
+	free(ec->out);
+	free(ec);
+	vm->ecall = NULL;
+}
+
+/*
+ * Queue bytes for the guest's stdout, on behalf of write() or of a device
+ * such as the UART, so that all of it comes out in order and in big chunks.
+ */
+void ecall_stdout(struct vm *vm, const char *buf, uint32_t len)
+{
+	struct ecall *ec = ecall_get(vm);
+
+	if (ec && !ec->out)
+		ec->out = malloc(ECALL_OUT_SIZE);
+
+	if (ec && ec->out && ec->out_len + len > ECALL_OUT_SIZE)
+		ecall_flush(vm);
+
+	if (!ec || !ec->out || len >= ECALL_OUT_SIZE) {
+		fflush(stdout);
+		ecall_write_all(STDOUT_FILENO, buf, len);
+		return;
+	}
+
+	memcpy(ec->out + ec->out_len, buf, len);
+	ec->out_len += len;
+}
+
+static int32_t ecall_emit(struct vm *vm, int fd, const char *buf, uint32_t len)
+{
+	if (fd == STDOUT_FILENO) {
+		ecall_stdout(vm, buf, len);
+		return len;
+	}
+
+	return ecall_write_all(fd, buf, len);
+}
+
+static int32_t ecall_write_host(struct vm *vm, int fd, uint32_t addr, uint32_t len)
+{
+	char bounce[ECALL_BOUNCE_SIZE];
+	const char *buf;
+	uint32_t done = 0;
+	int ret;
+
+	buf = bus_host_range(&vm->bus, addr, len, BUS_READ);
+	if (buf)
+		return ecall_emit(vm, fd, buf, len);
+
+	while (done < len) {
+		uint32_t n = len - done < sizeof(bounce) ? len - done : sizeof(bounce);
+
+		for (uint32_t i = 0; i < n; i++)
+			bounce[i] = bus_read_u8(&vm->bus, addr + done + i);
+
+		ret = ecall_emit(vm, fd, bounce, n);
+		if (ret < 0)
+			return done ? done : ret;
+		done += n;
+	}
+
+	return done;
+}
+
+static int32_t ecall_write(struct vm *vm, struct ecall *ec, int fd, uint32_t addr, uint32_t len)
+{
+	if (!ecall_valid_fd(ec, fd))
+		return -EBADF;
+	if (!len)
+		return 0;
+	if (!ecall_access_ok(&vm->bus, addr, len, BUS_READ))
+		return -EFAULT;
+
+	/* keep stderr and stdout in the order the guest wrote them */
+	if (fd != STDOUT_FILENO)
+		ecall_flush(vm);
+
+	return ecall_write_host(vm, fd, addr, len);
+}
+
+static int32_t ecall_read(struct vm *vm, struct ecall *ec, int fd, uint32_t addr, uint32_t len)
+{
+	char bounce[ECALL_BOUNCE_SIZE];
+	ssize_t ret;
+	char *buf;
+
+	if (!ecall_valid_fd(ec, fd))
+		return -EBADF;
+	if (!len)
+		return 0;
+	if (!ecall_access_ok(&vm->bus, addr, len, BUS_WRITE))
+		return -EFAULT;
+
+	/* a prompt has to show before the guest waits on its answer */
+	if (fd == STDIN_FILENO)
+		ecall_flush(vm);
+
+	buf = bus_host_range(&vm->bus, addr, len, BUS_WRITE);
+	if (buf) {
+		ret = read(fd, buf, len);
+		return ret < 0 ? -errno : ret;
+	}
+
+	/* written through the bus so that dirty tracking sees it */
+	ret = read(fd, bounce, len < sizeof(bounce) ? len : sizeof(bounce));
+	if (ret < 0)
+		return -errno;
+
+	for (ssize_t i = 0; i < ret; i++)
+		bus_write_u8(&vm->bus, addr + i, bounce[i]);
+
+	return ret;
+}
+
+static int32_t ecall_openat(struct vm *vm, struct ecall *ec, int dirfd, uint32_t path_addr,
+			    uint32_t guest_flags, uint32_t mode)
+{
+	char path[PATH_MAX];
+	int flags = 0;
+	int fd;
+
+	if (dirfd != ECALL_AT_FDCWD)
+		return -ENOSYS;
+	if (ec->nr_files == ECALL_MAX_FILES)
+		return -EMFILE;
+
+	for (int i = 0; ; i++) {
+		if (i == sizeof(path))
+			return -ENAMETOOLONG;
+		if (!ecall_access_ok(&vm->bus, path_addr + i, 1, BUS_READ))
+			return -EFAULT;
+
+		path[i] = bus_read_u8(&vm->bus, path_addr + i);
+		if (!path[i])
+			break;
+	}
+
+	for (int i = 0; i < sizeof(ecall_open_flags) / sizeof(ecall_open_flags[0]); i++)
+		if (guest_flags & ecall_open_flags[i].guest)
+			flags |= ecall_open_flags[i].host;
+
+	fd = open(path, flags, mode);
+	if (fd < 0)
+		return -errno;
+
+	ec->files[ec->nr_files++] = fd;
+
+	return fd;
+}
+
+static int32_t ecall_close(struct ecall *ec, int fd)
+{
+	int i = ecall_find_file(ec, fd);
+
+	/* the standard streams are rnv's too, they stay open */
+	if (fd >= 0 && fd <= 2)
+		return 0;
+	if (i < 0)
+		return -EBADF;
+
+	ec->files[i] = ec->files[--ec->nr_files];
+
+	return close(fd) < 0 ? -errno : 0;
+}
+
+static int32_t ecall_lseek(struct vm *vm, struct ecall *ec, int fd, int32_t offset, int whence)
+{
+	off_t ret;
+
+	if (!ecall_valid_fd(ec, fd))
+		return -EBADF;
+
+	if (fd == STDOUT_FILENO)
+		ecall_flush(vm);
+
+	ret = lseek(fd, offset, whence);
+	if (ret < 0)
+		return -errno;
+
+	return ret > INT32_MAX ? -EOVERFLOW : ret;
+}
+
+static void ecall_put_u64(struct bus *bus, uint32_t addr, uint64_t value)
+{
+	bus_write_u32(bus, addr, value);
+	bus_write_u32(bus, addr + 4, value >> 32);
+}
+
+/*
+ * struct stat as newlib's libgloss and the proxy kernel lay it out on
+ * rv32: 64-bit ids and sizes, 16-byte slots for the timestamps.
+ */
+static int32_t ecall_fstat(struct vm *vm, struct ecall *ec, int fd, uint32_t addr)
+{
+	struct bus *bus = &vm->bus;
+	struct stat st;
+
+	if (!ecall_valid_fd(ec, fd))
+		return -EBADF;
+	if (!ecall_access_ok(bus, addr, ECALL_STAT_SIZE, BUS_WRITE))
+		return -EFAULT;
+	if (fstat(fd, &st) < 0)
+		return -errno;
+
+	for (int i = 0; i < ECALL_STAT_SIZE; i += 4)
+		bus_write_u32(bus, addr + i, 0);
+
+	ecall_put_u64(bus, addr + 0, st.st_dev);
+	ecall_put_u64(bus, addr + 8, st.st_ino);
+	bus_write_u32(bus, addr + 16, st.st_mode);
+	bus_write_u32(bus, addr + 20, st.st_nlink);
+	bus_write_u32(bus, addr + 24, st.st_uid);
+	bus_write_u32(bus, addr + 28, st.st_gid);
+	ecall_put_u64(bus, addr + 32, st.st_rdev);
+	ecall_put_u64(bus, addr + 48, st.st_size);
+	bus_write_u32(bus, addr + 56, st.st_blksize);
+	ecall_put_u64(bus, addr + 64, st.st_blocks);
+	ecall_put_u64(bus, addr + 72, st.st_atim.tv_sec);
+	bus_write_u32(bus, addr + 80, st.st_atim.tv_nsec);
+	ecall_put_u64(bus, addr + 88, st.st_mtim.tv_sec);
+	bus_write_u32(bus, addr + 96, st.st_mtim.tv_nsec);
+	ecall_put_u64(bus, addr + 104, st.st_ctim.tv_sec);
+	bus_write_u32(bus, addr + 112, st.st_ctim.tv_nsec);
+
+	return 0;
+}
+
+/* struct timeval and struct timespec are two rv32 longs */
+static int32_t ecall_gettimeofday(struct vm *vm, uint32_t addr)
+{
+	struct timeval tv;
+
+	/* the timezone argument is obsolete, only tv is filled in */
+	if (!addr)
+		return 0;
+	if (!ecall_access_ok(&vm->bus, addr, 8, BUS_WRITE))
+		return -EFAULT;
+
+	gettimeofday(&tv, NULL);
+	bus_write_u32(&vm->bus, addr, tv.tv_sec);
+	bus_write_u32(&vm->bus, addr + 4, tv.tv_usec);
+
+	return 0;
+}
+
+static int32_t ecall_clock_gettime(struct vm *vm, int clock, uint32_t addr)
+{
+	struct timespec ts;
+
+	if (!ecall_access_ok(&vm->bus, addr, 8, BUS_WRITE))
+		return -EFAULT;
+	if (clock_gettime(clock, &ts) < 0)
+		return -errno;
+
+	bus_write_u32(&vm->bus, addr, ts.tv_sec);
+	bus_write_u32(&vm->bus, addr + 4, ts.tv_nsec);
+
+	return 0;
+}
+
+/*
+ * The heap grows from the end of the image, or the bottom of RAM when the
+ * image is elsewhere, towards the top of RAM where the stack is. As on
+ * Linux a failed request leaves the break where it was and returns it.
+ */
+static uint32_t ecall_brk(struct vm *vm, uint32_t addr)
+{
+	uint32_t start = vm->image_end - vm->ram.base_addr < vm->ram.size ?
+			 vm->image_end : vm->ram.base_addr;
+
+	if (!vm->brk)
+		vm->brk = start;
+
+	if (addr >= start && addr - vm->ram.base_addr <= vm->ram.size)
+		vm->brk = addr;
+
+	return vm->brk;
+}
+
+void ecall_handle(struct vm *vm)
+{
+	struct registers *r = &vm->cpu.regs;
+	struct ecall *ec = ecall_get(vm);
+	int32_t ret;
+
+	if (!ec) {
+		r->a0 = -ENOMEM;
+		return;
+	}
+
+	switch (r->a7) {
+	case ECALL_EXIT:
+	case ECALL_EXIT_GROUP:
+		ecall_flush(vm);
+		vm->exit_code = r->a0;
+		vm->exited = 1;
+		vm->halted = 1;
+		return;
+	case ECALL_WRITE:
+		ret = ecall_write(vm, ec, r->a0, r->a1, r->a2);
+		break;
+	case ECALL_READ:
+		ret = ecall_read(vm, ec, r->a0, r->a1, r->a2);
+		break;
+	case ECALL_OPENAT:
+		ret = ecall_openat(vm, ec, r->a0, r->a1, r->a2, r->a3);
+		break;
+	case ECALL_CLOSE:
+		ret = ecall_close(ec, r->a0);
+		break;
+	case ECALL_LSEEK:
+		ret = ecall_lseek(vm, ec, r->a0, r->a1, r->a2);
+		break;
+	case ECALL_FSTAT:
+		ret = ecall_fstat(vm, ec, r->a0, r->a1);
+		break;
+	case ECALL_GETTIMEOFDAY:
+		ret = ecall_gettimeofday(vm, r->a0);
+		break;
+	case ECALL_CLOCK_GETTIME:
+		ret = ecall_clock_gettime(vm, r->a0, r->a1);
+		break;
+	case ECALL_BRK:
+		ret = ecall_brk(vm, r->a0);
+		break;
+	default:
+		printf("unknown syscall %u at 0x%08x\n", r->a7, vm->cpu.pc - 4);
+		ret = -ENOSYS;
+		break;
+	}
+
+	r->a0 = ret;
+}
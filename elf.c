@@ -0,0 +1,217 @@
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <elf.h>
+#include <vm.h>
+#include <icache.h>
+
+#define ELF_PAGE_MASK		((uint32_t)BUS_PAGE_SIZE - 1)
+#define ELF_PAGE_ALIGN(x)	(((x) + ELF_PAGE_MASK) & ~ELF_PAGE_MASK)
+
+int vm_is_elf(const void *image, int size)
+{
+	return size >= sizeof(Elf32_Ehdr) && !memcmp(image, ELFMAG, SELFMAG);
+}
+
+static int elf_check_header(const Elf32_Ehdr *eh, int size)
+{
+	if (eh->e_ident[EI_CLASS] != ELFCLASS32 || eh->e_ident[EI_DATA] != ELFDATA2LSB) {
+		printf("not a 32-bit little-endian ELF.\n");
+		return -EINVAL;
+	}
+
+	if (eh->e_machine != EM_RISCV || eh->e_type != ET_EXEC) {
+		printf("not a RISC-V executable.\n");
+		return -EINVAL;
+	}
+
+	if (eh->e_phentsize != sizeof(Elf32_Phdr) ||
+	    eh->e_phoff + (uint64_t)eh->e_phnum * sizeof(Elf32_Phdr) > size) {
+		printf("bad ELF program headers.\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int elf_check_segment(const Elf32_Phdr *ph, int size)
+{
+	if (ph->p_filesz > ph->p_memsz ||
+	    (uint64_t)ph->p_offset + ph->p_filesz > size ||
+	    (uint64_t)ph->p_vaddr + ph->p_memsz > (1ULL << 32) - BUS_PAGE_SIZE) {
+		printf("bad ELF segment at 0x%08x.\n", ph->p_vaddr);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Map one PT_LOAD segment. The part backed by the file is mapped
+ * MAP_PRIVATE straight from it, so code and read-only data come from the
+ * page cache and writable data is only copied once the guest writes to it.
+ * The rest of the BSS is anonymous memory, zero-filled on first touch.
+ * Nothing is read here besides the page holding the end of the file data.
+ * A flat bus gets the segment at its place in the guest space.
+ */
+static int elf_map_segment(struct bus *bus, const Elf32_Phdr *ph, const uint8_t *image, int fd,
+			   struct memory *mem)
+{
+	uint32_t start = ph->p_vaddr & ~ELF_PAGE_MASK;
+	uint32_t pad = ph->p_vaddr - start;
+	uint32_t len = ELF_PAGE_ALIGN(pad + ph->p_memsz);
+	uint32_t file_end = pad + ph->p_filesz;
+	uint32_t file_len = ph->p_filesz ? ELF_PAGE_ALIGN(file_end) : 0;
+	int prot = PROT_READ | ((ph->p_flags & PF_W) ? PROT_WRITE : 0);
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+	size_t reserve = len + BUS_PAGE_SIZE;
+	uint8_t *place = NULL;
+	uint8_t *host;
+
+	/*
+	 * Reserve one more page, the bus lets unaligned accesses run past the
+	 * end of a page into the next host page. In place, the next page is
+	 * the guest's.
+	 */
+	if (bus->base) {
+		place = mm_bus_place(bus, start, len);
+		if (!place)
+			return -EBUSY;
+		reserve = len;
+		flags |= MAP_FIXED;
+	}
+
+	host = mmap(place, reserve, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (host == MAP_FAILED)
+		return -ENOMEM;
+
+	mem->mem = host;
+	mem->base_addr = start;
+	mem->size = len;
+	mem->type = (ph->p_flags & PF_X) ? ROM : RAM;
+	mem->attr = ((ph->p_flags & PF_W) ? RW : RO) | ((ph->p_flags & PF_X) ? 0 : XN) | MAPPED |
+		    (place ? PLACED : 0);
+
+	if (file_len && (ph->p_offset & ELF_PAGE_MASK) == pad) {
+		if (mmap(host, file_len, prot, MAP_PRIVATE | MAP_FIXED, fd,
+			 ph->p_offset - pad) == MAP_FAILED)
+			goto err_unmap;
+	} else if (file_len) {
+		/* not congruent with its file offset (ld -N), copy it instead */
+		memcpy(host + pad, image + ph->p_offset, ph->p_filesz);
+	}
+
+	/* the last file page goes on with whatever follows in the file */
+	if (file_end & ELF_PAGE_MASK) {
+		uint8_t *last = host + file_len - BUS_PAGE_SIZE;
+
+		mprotect(last, BUS_PAGE_SIZE, PROT_READ | PROT_WRITE);
+		memset(host + file_end, 0, file_len - file_end);
+		mprotect(last, BUS_PAGE_SIZE, prot);
+	}
+
+	if (len > file_len)
+		mprotect(host + file_len, len - file_len, prot);
+
+	return 0;
+
+err_unmap:
+	mm_destroy_mapping(mem);
+	return -ENOMEM;
+}
+
+static int elf_overlaps(struct bus *bus, struct memory *mem)
+{
+	for (uint32_t i = 0; i < mem->size >> BUS_PAGE_SHIFT; i++)
+		if (bus->pages[(mem->base_addr >> BUS_PAGE_SHIFT) + i])
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Load an ELF32 executable mapped at image from fd. The segment holding the
+ * entry point becomes the ROM the engines run from, the others are only
+ * mapped on the bus. RAM is left to the caller, vm->image_end tells where
+ * the image stops.
+ */
+int vm_load_elf(struct vm *vm, const void *image, int size, int fd)
+{
+	const Elf32_Ehdr *eh = image;
+	const Elf32_Phdr *ph;
+	struct memory mem;
+	int found = 0;
+	int ret;
+
+	ret = elf_check_header(eh, size);
+	if (ret < 0)
+		return ret;
+
+	ph = (const Elf32_Phdr *)((const uint8_t *)image + eh->e_phoff);
+
+	for (int i = 0; i < eh->e_phnum; i++, ph++) {
+		if (ph->p_type != PT_LOAD || !ph->p_memsz)
+			continue;
+
+		ret = elf_check_segment(ph, size);
+		if (ret < 0)
+			return ret;
+
+		ret = elf_map_segment(&vm->bus, ph, image, fd, &mem);
+		if (ret == -EBUSY) {
+			printf("ELF segment at 0x%08x overlaps another one.\n", ph->p_vaddr);
+			return ret;
+		} else if (ret < 0) {
+			printf("cannot map ELF segment at 0x%08x.\n", ph->p_vaddr);
+			return ret;
+		}
+
+		if (elf_overlaps(&vm->bus, &mem)) {
+			printf("ELF segment at 0x%08x overlaps another one.\n", ph->p_vaddr);
+			mm_destroy_mapping(&mem);
+			return -EINVAL;
+		}
+
+		if (!found && (ph->p_flags & PF_X) &&
+		    eh->e_entry - mem.base_addr < mem.size) {
+			vm->rom = mem;
+			found = 1;
+		} else if (vm->nr_segments < VM_MAX_SEGMENTS) {
+			vm->segments[vm->nr_segments++] = mem;
+		} else {
+			printf("too many ELF segments.\n");
+			mm_destroy_mapping(&mem);
+			return -E2BIG;
+		}
+
+		ret = mm_bus_map(&vm->bus, &mem);
+		if (ret < 0) {
+			printf("cannot map ELF segment at 0x%08x on the bus.\n", ph->p_vaddr);
+			return ret;
+		}
+
+		if (mem.base_addr + mem.size > vm->image_end)
+			vm->image_end = mem.base_addr + mem.size;
+	}
+
+	if (!found) {
+		printf("ELF entry point 0x%08x is not in an executable segment.\n", eh->e_entry);
+		return -EINVAL;
+	}
+
+	if (vm->icache)
+		icache_destroy(vm->icache);
+	vm->icache = icache_create(&vm->bus, &vm->rom);
+	if (!vm->icache)
+		return -ENOMEM;
+
+	vm_flush_fast(vm);
+	vm_flush_jit(vm);
+
+	vm->cpu.pc = eh->e_entry;
+
+	return 0;
+}
@@ -0,0 +1,421 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <icache.h>
+
+#define ICACHE_FILE_MAGIC	0x33656863616369ull	/* "icache3" */
+
+/*
+ * Decoded pages saved by icache_save(): this header, padded to a page, then
+ * a record for each page of the memory, left as a hole if it was never
+ * decoded. A record holds the ops, without their handlers, then the bytes
+ * they were decoded from, which run into the next page by the halfword the
+ * last op may take, then a checksum of the ops. Handlers are rebuilt from
+ * the other fields on load.
+ */
+struct icache_file {
+	uint64_t magic;
+	uint64_t build;		/* of the rnv that decoded them */
+	uint64_t rom_hash;
+	uint32_t op_size;
+	uint32_t base_addr;
+	uint32_t size;
+	uint32_t nr_pages;
+	uint8_t state[];	/* ICACHE_FILE_*, per page */
+};
+
+enum {
+	ICACHE_FILE_NONE,
+	ICACHE_FILE_SAVED,
+	ICACHE_FILE_LIVE,	/* handlers rebuilt in the mapping */
+};
+
+#define ICACHE_FILE_OPS		(ICACHE_PAGE_OPS * sizeof(struct inst_decoded))
+#define ICACHE_FILE_SUM		(ICACHE_FILE_OPS + ICACHE_PAGE_SIZE + 8)
+#define ICACHE_FILE_RECORD	(ICACHE_FILE_SUM + 8)
+
+static size_t icache_file_header(struct icache *ic)
+{
+	size_t size = sizeof(struct icache_file) + ic->nr_pages;
+
+	return (size + ICACHE_PAGE_SIZE - 1) & ~(size_t)(ICACHE_PAGE_SIZE - 1);
+}
+
+static size_t icache_file_size(struct icache *ic)
+{
+	return icache_file_header(ic) + (size_t)ic->nr_pages * ICACHE_FILE_RECORD;
+}
+
+static uint8_t *icache_file_record(struct icache *ic, int index)
+{
+	return (uint8_t *)ic->file + icache_file_header(ic) + (size_t)index * ICACHE_FILE_RECORD;
+}
+
+/* bytes the ops of a page depend on */
+static uint32_t icache_page_bytes(struct icache *ic, int index)
+{
+	uint32_t left = ic->mem->size - (index << ICACHE_PAGE_SHIFT);
+
+	return left < ICACHE_PAGE_SIZE + 2 ? left : ICACHE_PAGE_SIZE + 2;
+}
+
+static int icache_in_file(struct icache *ic, struct inst_decoded *page)
+{
+	uint8_t *p = (uint8_t *)page;
+
+	return ic->file && p >= (uint8_t *)ic->file && p < (uint8_t *)ic->file + ic->file_size;
+}
+
+struct icache *icache_create(struct bus *bus, struct memory *mem)
+{
+	struct icache *ic;
+
+	ic = calloc(1, sizeof(*ic));
+	if (!ic)
+		return NULL;
+
+	ic->bus = bus;
+	ic->mem = mem;
+	ic->nr_pages = (mem->size + ICACHE_PAGE_SIZE - 1) >> ICACHE_PAGE_SHIFT;
+	ic->refcount = 1;
+
+	ic->pages = calloc(ic->nr_pages, sizeof(*ic->pages));
+	if (!ic->pages) {
+		free(ic);
+		return NULL;
+	}
+
+	return ic;
+}
+
+void icache_flush(struct icache *ic)
+{
+	for (int i = 0; i < ic->nr_pages; i++) {
+		if (!icache_in_file(ic, ic->pages[i]))
+			free(ic->pages[i]);
+		ic->pages[i] = NULL;
+	}
+}
+
+struct icache *icache_get(struct icache *ic)
+{
+	atomic_fetch_add(&ic->refcount, 1);
+
+	return ic;
+}
+
+void icache_prefill(struct icache *ic)
+{
+	for (int i = 0; i < ic->nr_pages; i++)
+		if (!ic->pages[i])
+			icache_fill(ic, ic->mem->base_addr + (i << ICACHE_PAGE_SHIFT));
+}
+
+/*
+ * Back ic with the pages saved at path for the memory with rom_hash by the
+ * rnv with build. The file is mapped now and checked a page at a time as
+ * pages are needed: a saved page is used while the memory still holds the
+ * bytes it was decoded from. Whatever gets decoded meanwhile is saved back
+ * when the last reference goes. A missing or foreign file is not an error.
+ */
+int icache_load(struct icache *ic, const char *path, uint64_t rom_hash, uint64_t build)
+{
+	struct icache_file *file;
+	struct stat sb;
+	int fd;
+
+	ic->file_path = strdup(path);
+	if (!ic->file_path)
+		return -ENOMEM;
+	ic->file_hash = rom_hash;
+	ic->file_build = build;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -errno;
+
+	if (fstat(fd, &sb) < 0 || sb.st_size != icache_file_size(ic))
+		goto out;
+
+	/* private, handlers are rebuilt in place */
+	file = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (file == MAP_FAILED)
+		goto out;
+
+	if (file->magic != ICACHE_FILE_MAGIC || file->build != build ||
+	    file->rom_hash != rom_hash || file->op_size != sizeof(struct inst_decoded) ||
+	    file->base_addr != ic->mem->base_addr || file->size != ic->mem->size ||
+	    file->nr_pages != ic->nr_pages) {
+		munmap(file, sb.st_size);
+		goto out;
+	}
+
+	ic->file = file;
+	ic->file_size = sb.st_size;
+
+out:
+	close(fd);
+	return 0;
+}
+
+/* ops of the page at index that hold instructions, the rest are padding */
+static int icache_page_count(struct icache *ic, int index)
+{
+	int count = (ic->mem->size - (index << ICACHE_PAGE_SHIFT)) / 2;
+
+	return count < ICACHE_PAGE_OPS ? count : ICACHE_PAGE_OPS;
+}
+
+/* pairs run as one op, both halves within the page */
+static void icache_fuse(struct inst_decoded *page, int count)
+{
+	for (int i = 0; i < count; i++) {
+		int next = i + (page[i].len >> 1);
+		int kind;
+
+		if (next >= count)
+			break;
+
+		kind = inst_fusion(&page[i], &page[next]);
+		if (kind)
+			inst_fuse(&page[i], kind);
+	}
+}
+
+/* FNV-1a over the ops of the page at index, as saved: without handlers */
+static uint64_t icache_file_sum(const struct inst_decoded *ops, int index)
+{
+	const uint8_t *p = (const uint8_t *)ops;
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	hash = (hash ^ index) * 0x100000001b3ull;
+	for (size_t i = 0; i < ICACHE_FILE_OPS; i += 8) {
+		uint64_t word;
+
+		memcpy(&word, p + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+/*
+ * Give the ops of a saved page their handlers back. The file is not
+ * trusted: the ops must match the checksum saved with them, and have
+ * register numbers and lengths a decoded op can have.
+ */
+static int icache_file_rebuild(struct icache *ic, struct inst_decoded *page, int index)
+{
+	uint64_t sum;
+
+	memcpy(&sum, (uint8_t *)page + ICACHE_FILE_SUM, sizeof(sum));
+	if (sum != icache_file_sum(page, index))
+		return -EINVAL;
+
+	for (int i = 0; i < ICACHE_PAGE_OPS; i++) {
+		struct inst_decoded *d = &page[i];
+
+		if (d->rd >= 32 || d->rs1 >= 32 || d->rs2 >= 32 || (d->len != 2 && d->len != 4))
+			return -EINVAL;
+
+		d->handler = inst_decoded_handler(d);
+	}
+
+	icache_fuse(page, icache_page_count(ic, index));
+
+	return 0;
+}
+
+/* The saved page at index if it still matches the memory, ready to run. */
+static struct inst_decoded *icache_file_page(struct icache *ic, int index)
+{
+	struct inst_decoded *page;
+	uint8_t *record;
+
+	if (!ic->file || ic->file->state[index] == ICACHE_FILE_NONE)
+		return NULL;
+
+	record = icache_file_record(ic, index);
+	if (memcmp(record + ICACHE_FILE_OPS, (uint8_t *)ic->mem->mem + (index << ICACHE_PAGE_SHIFT),
+		   icache_page_bytes(ic, index)))
+		return NULL;
+
+	page = (struct inst_decoded *)record;
+	if (ic->file->state[index] == ICACHE_FILE_SAVED) {
+		if (icache_file_rebuild(ic, page, index) < 0) {
+			ic->file->state[index] = ICACHE_FILE_NONE;
+			return NULL;
+		}
+		ic->file->state[index] = ICACHE_FILE_LIVE;
+	}
+
+	return page;
+}
+
+static int icache_write(int fd, const void *buf, size_t len, off_t offset)
+{
+	ssize_t ret = pwrite(fd, buf, len, offset);
+
+	if (ret < 0)
+		return -errno;
+
+	return ret == len ? 0 : -EIO;
+}
+
+/*
+ * Write every page decoded, or still saved and unused, to a new file that
+ * then takes the place of the old one, so readers only ever see a whole
+ * file.
+ */
+static int icache_save(struct icache *ic)
+{
+	size_t header = icache_file_header(ic);
+	struct inst_decoded *ops = NULL;
+	struct icache_file *file;
+	char tmp[PATH_MAX];
+	int ret = -ENOMEM;
+	uint64_t sum;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", ic->file_path) >= sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	file = calloc(1, header);
+	ops = malloc(ICACHE_FILE_OPS);
+	if (!file || !ops)
+		goto out;
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	file->magic = ICACHE_FILE_MAGIC;
+	file->build = ic->file_build;
+	file->rom_hash = ic->file_hash;
+	file->op_size = sizeof(struct inst_decoded);
+	file->base_addr = ic->mem->base_addr;
+	file->size = ic->mem->size;
+	file->nr_pages = ic->nr_pages;
+
+	for (int i = 0; i < ic->nr_pages; i++) {
+		off_t offset = header + (off_t)i * ICACHE_FILE_RECORD;
+		const struct inst_decoded *page = ic->pages[i];
+		const uint8_t *bytes = (uint8_t *)ic->mem->mem + (i << ICACHE_PAGE_SHIFT);
+
+		if (!page && ic->file && ic->file->state[i] != ICACHE_FILE_NONE) {
+			page = (struct inst_decoded *)icache_file_record(ic, i);
+			bytes = (uint8_t *)page + ICACHE_FILE_OPS;
+		}
+		if (!page)
+			continue;
+
+		memcpy(ops, page, ICACHE_FILE_OPS);
+		for (int j = 0; j < ICACHE_PAGE_OPS; j++)
+			ops[j].handler = NULL;
+		sum = icache_file_sum(ops, i);
+
+		/* a saved page nobody checked keeps its own sum, right or not */
+		if (!ic->pages[i] && ic->file->state[i] == ICACHE_FILE_SAVED)
+			memcpy(&sum, (uint8_t *)page + ICACHE_FILE_SUM, sizeof(sum));
+
+		ret = icache_write(fd, ops, ICACHE_FILE_OPS, offset);
+		if (!ret)
+			ret = icache_write(fd, bytes, icache_page_bytes(ic, i), offset + ICACHE_FILE_OPS);
+		if (!ret)
+			ret = icache_write(fd, &sum, sizeof(sum), offset + ICACHE_FILE_SUM);
+		if (ret < 0)
+			goto err_unlink;
+
+		file->state[i] = ICACHE_FILE_SAVED;
+	}
+
+	if (ftruncate(fd, icache_file_size(ic)) < 0) {
+		ret = -errno;
+		goto err_unlink;
+	}
+
+	ret = icache_write(fd, file, header, 0);
+	if (ret < 0)
+		goto err_unlink;
+
+	if (close(fd) < 0 || rename(tmp, ic->file_path) < 0) {
+		ret = -errno;
+		unlink(tmp);
+		goto out;
+	}
+
+	ret = 0;
+	goto out;
+
+err_unlink:
+	close(fd);
+	unlink(tmp);
+out:
+	free(ops);
+	free(file);
+	return ret;
+}
+
+void icache_destroy(struct icache *ic)
+{
+	if (atomic_fetch_sub(&ic->refcount, 1) > 1)
+		return;
+
+	if (ic->dirty && icache_save(ic) < 0)
+		printf("cannot save decoded code to %s\n", ic->file_path);
+
+	icache_flush(ic);
+	if (ic->file)
+		munmap(ic->file, ic->file_size);
+	free(ic->file_path);
+	free(ic->pages);
+	free(ic);
+}
+
+struct inst_decoded *icache_fill(struct icache *ic, uint32_t addr)
+{
+	uint32_t offset = addr - ic->mem->base_addr;
+	int index = offset >> ICACHE_PAGE_SHIFT;
+	uint32_t page_addr = ic->mem->base_addr + (index << ICACHE_PAGE_SHIFT);
+	struct inst_decoded *page;
+	int count = icache_page_count(ic, index);
+
+	page = icache_file_page(ic, index);
+	if (page)
+		goto out;
+
+	page = calloc(ICACHE_PAGE_OPS, sizeof(*page));
+	if (!page) {
+		printf("cannot allocate decoded page for 0x%08x\n", addr);
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < count; i++) {
+		uint32_t pc = page_addr + i * 2;
+
+		inst_decode_fetched(&page[i], bus_fetch(ic->bus, pc), pc);
+	}
+
+	for (int i = count; i < ICACHE_PAGE_OPS; i++)
+		inst_decode(&page[i], 0, page_addr + i * 2);
+
+	icache_fuse(page, count);
+
+	if (ic->file_path)
+		ic->dirty = 1;
+
+out:
+	ic->pages[index] = page;
+
+	return &page[(offset & (ICACHE_PAGE_SIZE - 1)) >> 1];
+}
@@ -0,0 +1,47 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdint.h>
+#include <vm.h>
+
+/*
+ * Ahead-of-time translated code: rnv-aot turns the code it finds in a guest
+ * binary into C, one function holding every block it found, and builds it
+ * into a shared object exporting an aot_image named AOT_IMAGE_SYMBOL. The
+ * code works on the vm like the handlers do, through the same mm.h
+ * accessors, so the object only fits the rnv build it was made with and
+ * the ROM contents it was made from.
+ */
+#define AOT_ABI_VERSION		2
+#define AOT_IMAGE_SYMBOL	"rnv_aot_image"
+
+#ifdef BUS_FLAT
+#define AOT_FLAT		1
+#else
+#define AOT_FLAT		0
+#endif
+
+/* names the objects rnv-aot -C leaves in the cache directory */
+#define AOT_CACHE_VERSION	((AOT_ABI_VERSION << 1) | AOT_FLAT)
+
+/*
+ * Run translated code from pc for as long as it can, returns where it
+ * stopped: a pc it has no code for, an instruction left to the interpreter
+ * (ecall, zero word, unknown) or anywhere once the vm halted.
+ */
+typedef uint32_t (*aot_run_t)(struct vm *vm, uint32_t pc);
+
+struct aot_image {
+	int abi;		/* AOT_ABI_VERSION */
+	int flat;		/* AOT_FLAT */
+	uint32_t vm_size;	/* sizeof(struct vm) */
+	uint32_t rom_base;
+	uint32_t rom_size;
+	uint32_t nr_blocks;
+	uint64_t rom_hash;	/* vm_rom_hash() of the ROM translated */
+	aot_run_t run;
+};
+
+int aot_load(const char *path);
+
+#endif /* AOT_H */
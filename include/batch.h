@@ -0,0 +1,71 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vm.h>
+
+#define BATCH_MAX_ARGS		8	/* a0-a7 */
+
+enum {
+	BATCH_OK,
+	BATCH_FAULT,
+	BATCH_ERROR,
+};
+
+/* A vm loaded from an image, and its state before the first job ran. */
+struct batch_slot {
+	struct vm *vm;
+	struct vm_snapshot *snap;
+	struct batch_slot *next;
+};
+
+/*
+ * One binary named in the job list. The template vm is loaded once and its
+ * code fully decoded, every job running the image shares that decoded code.
+ * Vms are reset from their snapshot after a job and kept for the next one.
+ */
+struct batch_image {
+	char *path;
+	int fd;
+	void *bin;
+	int size;
+	const struct vm_layout *layout;
+	struct vm *vm;
+	pthread_mutex_t lock;
+	struct batch_slot *idle;
+};
+
+struct batch_job {
+	struct batch_image *image;
+	uint32_t args[BATCH_MAX_ARGS];
+	int nr_args;
+
+	int status;
+	uint32_t a0;
+	uint64_t icount;
+};
+
+/* Jobs [first, first + nr) handed to one pool worker. */
+struct batch_task {
+	int first;
+	int nr;
+};
+
+struct batch {
+	struct batch_image **images;
+	int nr_images;
+	struct batch_job *jobs;
+	int nr_jobs;
+	struct batch_task *tasks;
+	int nr_tasks;
+	void (*run)(struct vm *vm);
+	void (*run_many)(struct vm **vms, int nr);
+	const struct vm_layout *layout;
+};
+
+int batch_run(const char *list, void (*run)(struct vm *vm),
+	      void (*run_many)(struct vm **vms, int nr), const char *engine, int nr_workers,
+	      const struct vm_layout *layout);
+
+#endif /* BATCH_H */
@@ -0,0 +1,24 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vm.h>
+
+/*
+ * Directory of work kept between runs of the same binary, so that short
+ * runs start warm. Entries are named after vm_rom_hash() of the code they
+ * were made from and a version of what made them:
+ *
+ *	<hash>-<rnv build id>.icache	decoded pages, see icache_load()
+ *	<hash>-<AOT_CACHE_VERSION>.so	rnv-aot -C output, see aot.h
+ *
+ * Whatever is found there is checked again before use, a stale or foreign
+ * entry is only ever ignored or replaced.
+ */
+int cache_init(const char *dir);
+int cache_enabled(void);
+int cache_path(char *buf, size_t len, uint64_t rom_hash, uint64_t version, const char *kind);
+void cache_attach(struct vm *vm);
+
+#endif /* CACHE_H */
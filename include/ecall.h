@@ -0,0 +1,44 @@
+#ifndef ECALL_H
+#define ECALL_H
+
+#include <stdint.h>
+#include <vm.h>
+
+/*
+ * Syscall numbers of the RISC-V Linux ABI, which newlib's libgloss uses
+ * as well. The number is in a7, arguments in a0-a5, the result or a
+ * negated errno goes back in a0.
+ */
+#define ECALL_OPENAT		56
+#define ECALL_CLOSE		57
+#define ECALL_LSEEK		62
+#define ECALL_READ		63
+#define ECALL_WRITE		64
+#define ECALL_FSTAT		80
+#define ECALL_EXIT		93
+#define ECALL_EXIT_GROUP	94
+#define ECALL_CLOCK_GETTIME	113
+#define ECALL_GETTIMEOFDAY	169
+#define ECALL_BRK		214
+
+#define ECALL_MAX_FILES		32	/* host files a guest can have open */
+#define ECALL_OUT_SIZE		(64 * 1024)	/* guest stdout is flushed in chunks of this */
+
+/*
+ * Per-vm syscall state, created by the first ecall. Guest file descriptors
+ * are host ones: 0-2 are shared with rnv, anything else has to have been
+ * opened by the guest.
+ */
+struct ecall {
+	int files[ECALL_MAX_FILES];
+	int nr_files;
+	char *out;		/* pending guest stdout */
+	int out_len;
+};
+
+void ecall_handle(struct vm *vm);
+void ecall_stdout(struct vm *vm, const char *buf, uint32_t len);
+void ecall_flush(struct vm *vm);
+void ecall_destroy(struct vm *vm);
+
+#endif /* ECALL_H */
@@ -0,0 +1,60 @@
+#ifndef ICACHE_H
+#define ICACHE_H
+
+#include <stdint.h>
+#include <mm.h>
+#include <inst.h>
+
+#define ICACHE_PAGE_SHIFT	12
+#define ICACHE_PAGE_SIZE	(1 << ICACHE_PAGE_SHIFT)
+#define ICACHE_PAGE_OPS		(ICACHE_PAGE_SIZE / 2)
+
+/*
+ * Decoded instruction cache: one array of pre-decoded ops per page of
+ * the backing memory, allocated and decoded on first execution. There is
+ * an op for every halfword, compressed instructions being expanded once
+ * when their page is decoded.
+ *
+ * A fully decoded cache (icache_prefill()) is never written again and can
+ * be shared between vms running the same image, each holding a reference.
+ *
+ * Pages can also come from a file left by an earlier run, see icache_load().
+ */
+struct icache_file;
+
+struct icache {
+	struct bus *bus;
+	struct memory *mem;
+	struct inst_decoded **pages;
+	int nr_pages;
+	_Atomic int refcount;
+	/* saved pages, mapped, and where to save them again */
+	struct icache_file *file;
+	size_t file_size;
+	char *file_path;
+	uint64_t file_build;
+	uint64_t file_hash;
+	int dirty;		/* pages decoded that the file lacks */
+};
+
+struct icache *icache_create(struct bus *bus, struct memory *mem);
+struct icache *icache_get(struct icache *ic);
+void icache_destroy(struct icache *ic);
+void icache_flush(struct icache *ic);
+void icache_prefill(struct icache *ic);
+int icache_load(struct icache *ic, const char *path, uint64_t rom_hash, uint64_t build);
+struct inst_decoded *icache_fill(struct icache *ic, uint32_t addr);
+
+/* addr must lie inside the memory the cache was created for */
+static inline struct inst_decoded *icache_lookup(struct icache *ic, uint32_t addr)
+{
+	uint32_t offset = addr - ic->mem->base_addr;
+	struct inst_decoded *page = ic->pages[offset >> ICACHE_PAGE_SHIFT];
+
+	if (!page)
+		return icache_fill(ic, addr);
+
+	return &page[(offset & (ICACHE_PAGE_SIZE - 1)) >> 1];
+}
+
+#endif /* ICACHE_H */
@@ -23,6 +23,10 @@
 #define RV32I_SRL_SRA      0xAC
 #define RV32I_OR           0xCC
 #define RV32I_AND          0xEC
+// funct7 = 0x20 variants
+#define RV32I_SRAI         0x1A4
+#define RV32I_SUB          0x10C
+#define RV32I_SRA          0x1AC
 // I/S/B type instructions
 #define RV32I_JALR         0x19
 #define RV32I_BEQ          0x18
@@ -48,6 +52,22 @@
 
 #define RV32I_ECALL_EBREAK 0x1C
 #define RV32I_FENCE	   0x3
+
+/*
+ * RV32M Standard Extension, funct7 = 0x01
+ */
+#define RV32M_MUL          0x20C
+#define RV32M_MULH         0x22C
+#define RV32M_MULHSU       0x24C
+#define RV32M_MULHU        0x26C
+#define RV32M_DIV          0x28C
+#define RV32M_DIVU         0x2AC
+#define RV32M_REM          0x2CC
+#define RV32M_REMU         0x2EC
+
+/* inst_opcode_index() results are below this */
+#define RV_NR_OPCODES      0x400
+
 /*
  * RV64I-only instructions
  */
@@ -116,7 +136,88 @@
 #define RV_OPCODE_MASK		0x7F
 
 
+/*
+ * Pre-decoded instruction: register indexes and sign-extended immediate
+ * are extracted once, branch/jump targets are made absolute. Compressed
+ * instructions are decoded from their 32-bit expansion.
+ */
+struct inst_decoded;
+
+typedef void (*inst_handler_t)(struct vm *vm, struct inst_decoded *d);
+/* RVC: compressed instruction to its 32-bit equivalent, 0 if reserved */
+typedef uint32_t (*inst_expand_t)(uint32_t c);
+
+struct inst_decoded {
+	inst_handler_t handler;
+	uint32_t inst;
+	int32_t imm;
+	uint32_t target;
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+	uint8_t len;		/* 2 for compressed instructions, else 4 */
+};
+
+/*
+ * RV32M semantics shared by the engines. Division never traps: dividing by
+ * zero gives all ones (the remainder is the dividend) and the one signed
+ * overflow, INT32_MIN / -1, gives the dividend back with a zero remainder.
+ */
+static inline uint32_t rv32m_mulh(uint32_t a, uint32_t b)
+{
+	return ((int64_t)(int32_t)a * (int32_t)b) >> 32;
+}
+
+static inline uint32_t rv32m_mulhsu(uint32_t a, uint32_t b)
+{
+	return ((int64_t)(int32_t)a * (int64_t)b) >> 32;
+}
+
+static inline uint32_t rv32m_mulhu(uint32_t a, uint32_t b)
+{
+	return ((uint64_t)a * b) >> 32;
+}
+
+static inline uint32_t rv32m_div(uint32_t a, uint32_t b)
+{
+	if (!b)
+		return ~0u;
+	if (a == 0x80000000 && b == ~0u)
+		return a;
+
+	return (int32_t)a / (int32_t)b;
+}
+
+static inline uint32_t rv32m_divu(uint32_t a, uint32_t b)
+{
+	return b ? a / b : ~0u;
+}
+
+static inline uint32_t rv32m_rem(uint32_t a, uint32_t b)
+{
+	if (!b)
+		return a;
+	if (a == 0x80000000 && b == ~0u)
+		return 0;
+
+	return (int32_t)a % (int32_t)b;
+}
+
+static inline uint32_t rv32m_remu(uint32_t a, uint32_t b)
+{
+	return b ? a % b : a;
+}
+
 void inst_init(struct vm *vm);
+int inst_opcode_index(uint32_t inst);
+void inst_decode(struct inst_decoded *d, uint32_t inst, uint32_t pc);
+void inst_decode_fetched(struct inst_decoded *d, uint32_t bits, uint32_t pc);
 void inst_execute(struct vm *vm, int inst);
 
+extern const char *const inst_fusion_names[VM_NR_FUSIONS];
+int inst_fusion(const struct inst_decoded *d, const struct inst_decoded *n);
+void inst_fuse(struct inst_decoded *d, int kind);
+inst_handler_t inst_single_handler(const struct inst_decoded *d);
+inst_handler_t inst_decoded_handler(const struct inst_decoded *d);
+
 #endif /* INST_H */
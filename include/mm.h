@@ -1,6 +1,7 @@
 #ifndef MM_H
 #define MM_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 enum {
@@ -12,17 +13,104 @@ enum {
 	RO = (1 << 0),
 	RW = (1 << 1),
 	XN = (1 << 2),
+	MAPPED = (1 << 3),	/* mmap()ed from a file rather than allocated */
+	HUGE = (1 << 4),	/* asked to be backed by huge pages */
+	HUGETLB = (1 << 5),	/* got them from the hugetlb pool */
+	PLACED = (1 << 6),	/* sits at its guest address in a flat bus space */
 };
 
+#define MM_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
 struct memory {
 	void *mem;
 	uint32_t base_addr;
-	int size;
+	uint32_t size;
 	int type;
 	int attr;
 };
 
-int mm_create_mapping(struct memory *mem, uint32_t base_addr, int size, int type, int attr);
+/*
+ * Guest physical bus: one entry per 4K guest page holding the host address
+ * of the page, with the access rights in the low bits. A load or store is
+ * a shift, a table lookup and a host access; an access whose right is not
+ * set (unmapped page, RO, XN or MMIO page) goes through the slow path.
+ */
+#define BUS_PAGE_SHIFT		12
+#define BUS_PAGE_SIZE		(1 << BUS_PAGE_SHIFT)
+#define BUS_NR_PAGES		(1 << (32 - BUS_PAGE_SHIFT))
+#define BUS_FLAGS_MASK		((uintptr_t)0x1F)
+
+/*
+ * On x86-64 Linux hosts the bus also reserves the whole 4G guest space as
+ * one inaccessible host region, followed by a guard page. Memories are
+ * created in place at base + guest address, with host protections that
+ * match their rights, so a load or store is a single host access with no
+ * check at all. Whatever the table would have sent to the slow path faults
+ * instead: the SIGSEGV handler in mm.c logs tracked pages, and decodes the
+ * faulting mov to run device accesses and guest faults. The accessors below
+ * pin those movs down with inline asm so that the decoder only ever has to
+ * know a handful of forms. Build with FLAT_BUS=0 to go through the table.
+ */
+#if defined(__x86_64__) && defined(__linux__) && !defined(CONFIG_NO_FLAT_BUS)
+#define BUS_FLAT		1
+#endif
+
+#define BUS_SPACE_SIZE		(1ULL << 32)
+#define BUS_GUARD_SIZE		BUS_PAGE_SIZE
+#define BUS_MAX_SPACES		4096	/* flat buses alive at once */
+
+enum {
+	BUS_READ = (1 << 0),
+	BUS_WRITE = (1 << 1),
+	BUS_EXEC = (1 << 2),
+	BUS_MMIO = (1 << 3),
+	BUS_TRACK = (1 << 4),	/* writable, but the first write is logged */
+};
+
+#define BUS_MAX_MMIO		16
+
+/*
+ * A device model: accesses to its region call read or write with the
+ * offset into it, release frees the device along with the bus. Devices
+ * with state_size keep state_size bytes of state in vm snapshots.
+ */
+struct bus_mmio_ops {
+	uint32_t (*read)(void *opaque, uint32_t offset, int size);
+	void (*write)(void *opaque, uint32_t offset, uint32_t value, int size);
+	void (*release)(void *opaque);
+	size_t state_size;
+	void (*save)(void *opaque, void *state);
+	void (*restore)(void *opaque, const void *state);
+};
+
+struct bus_mmio {
+	uint32_t base;
+	uint32_t size;
+	const struct bus_mmio_ops *ops;
+	void *opaque;
+};
+
+struct bus {
+	uintptr_t *pages;
+	uint8_t *base;		/* the flat guest space, NULL without BUS_FLAT */
+	/* device regions sorted by base, and the one accessed last */
+	struct bus_mmio mmio[BUS_MAX_MMIO];
+	int nr_mmio;
+	struct bus_mmio *last_mmio;
+	/* called for accesses nothing answers, access is the missing right */
+	void (*fault)(struct bus *bus, uint32_t addr, int access);
+	/* optional, called with a tracked page before its first write lands */
+	void (*written)(struct bus *bus, uint32_t page);
+	/* guest page numbers written since tracking was (re)armed */
+	uint32_t *dirty;
+	int nr_dirty;
+	int max_dirty;
+};
+
+int mm_create_mapping(struct memory *mem, struct bus *bus, uint32_t base_addr, uint32_t size,
+		      int type, int attr);
+void mm_destroy_mapping(struct memory *mem);
+void mm_fill(struct memory *mem, const void *data, uint32_t len);
 int mm_read(struct memory *mem, uint32_t addr);
 void mm_write(struct memory *mem, uint32_t addr, int value);
 int mm_read_u16(struct memory *mem, uint32_t addr);
@@ -33,4 +121,146 @@ void mm_write_u8(struct memory *mem, uint32_t addr, int value);
 int mm_read_s8(struct memory *mem, uint32_t addr);
 int mm_read_s16(struct memory *mem, uint32_t addr);
 int mm_read_s32(struct memory *mem, uint32_t addr);
+
+int mm_bus_init(struct bus *bus);
+void mm_bus_exit(struct bus *bus);
+int mm_bus_map(struct bus *bus, struct memory *mem);
+void *mm_bus_place(struct bus *bus, uint32_t base_addr, uint32_t size);
+int mm_bus_map_mmio(struct bus *bus, uint32_t base_addr, uint32_t size,
+		    const struct bus_mmio_ops *ops, void *opaque);
+int mm_bus_track(struct bus *bus, struct memory *mem);
+void mm_bus_clear_dirty(struct bus *bus);
+
+uint32_t bus_read_slow(struct bus *bus, uint32_t addr, int size);
+void bus_write_slow(struct bus *bus, uint32_t addr, uint32_t value, int size);
+uint32_t bus_fetch(struct bus *bus, uint32_t addr);
+void *bus_host_range(struct bus *bus, uint32_t addr, uint32_t len, int access);
+
+static inline void *bus_host(uintptr_t page, uint32_t addr)
+{
+	return (void *)((page & ~BUS_FLAGS_MASK) + (addr & (BUS_PAGE_SIZE - 1)));
+}
+
+#ifdef BUS_FLAT
+
+static inline uint32_t bus_read_u32(struct bus *bus, uint32_t addr)
+{
+	uint32_t value;
+
+	asm volatile("movl %1, %0" : "=r" (value) : "m" (*(uint32_t *)(bus->base + addr)));
+
+	return value;
+}
+
+static inline uint32_t bus_read_u16(struct bus *bus, uint32_t addr)
+{
+	uint32_t value;
+
+	asm volatile("movzwl %1, %0" : "=r" (value) : "m" (*(uint16_t *)(bus->base + addr)));
+
+	return value;
+}
+
+static inline uint32_t bus_read_u8(struct bus *bus, uint32_t addr)
+{
+	uint32_t value;
+
+	asm volatile("movzbl %1, %0" : "=r" (value) : "m" (*(uint8_t *)(bus->base + addr)));
+
+	return value;
+}
+
+static inline void bus_write_u32(struct bus *bus, uint32_t addr, uint32_t value)
+{
+	asm volatile("movl %1, %0" : "=m" (*(uint32_t *)(bus->base + addr)) : "r" (value));
+}
+
+static inline void bus_write_u16(struct bus *bus, uint32_t addr, uint32_t value)
+{
+	asm volatile("movw %w1, %0" : "=m" (*(uint16_t *)(bus->base + addr)) : "r" (value));
+}
+
+static inline void bus_write_u8(struct bus *bus, uint32_t addr, uint32_t value)
+{
+	asm volatile("movb %b1, %0" : "=m" (*(uint8_t *)(bus->base + addr)) : "q" (value));
+}
+
+#else
+
+/* the page of addr allows it, but a misaligned access may run past it */
+#define BUS_IN_PAGE(addr, size) \
+	(((addr) & (BUS_PAGE_SIZE - 1)) <= BUS_PAGE_SIZE - (size))
+
+static inline uint32_t bus_read_u32(struct bus *bus, uint32_t addr)
+{
+	uintptr_t page = bus->pages[addr >> BUS_PAGE_SHIFT];
+
+	if (__builtin_expect(!(page & BUS_READ) || !BUS_IN_PAGE(addr, 4), 0))
+		return bus_read_slow(bus, addr, 4);
+
+	return *(uint32_t *)bus_host(page, addr);
+}
+
+static inline uint32_t bus_read_u16(struct bus *bus, uint32_t addr)
+{
+	uintptr_t page = bus->pages[addr >> BUS_PAGE_SHIFT];
+
+	if (__builtin_expect(!(page & BUS_READ) || !BUS_IN_PAGE(addr, 2), 0))
+		return bus_read_slow(bus, addr, 2);
+
+	return *(uint16_t *)bus_host(page, addr);
+}
+
+static inline uint32_t bus_read_u8(struct bus *bus, uint32_t addr)
+{
+	uintptr_t page = bus->pages[addr >> BUS_PAGE_SHIFT];
+
+	if (__builtin_expect(!(page & BUS_READ), 0))
+		return bus_read_slow(bus, addr, 1);
+
+	return *(uint8_t *)bus_host(page, addr);
+}
+
+static inline void bus_write_u32(struct bus *bus, uint32_t addr, uint32_t value)
+{
+	uintptr_t page = bus->pages[addr >> BUS_PAGE_SHIFT];
+
+	if (__builtin_expect(!(page & BUS_WRITE) || !BUS_IN_PAGE(addr, 4), 0))
+		return bus_write_slow(bus, addr, value, 4);
+
+	*(uint32_t *)bus_host(page, addr) = value;
+}
+
+static inline void bus_write_u16(struct bus *bus, uint32_t addr, uint32_t value)
+{
+	uintptr_t page = bus->pages[addr >> BUS_PAGE_SHIFT];
+
+	if (__builtin_expect(!(page & BUS_WRITE) || !BUS_IN_PAGE(addr, 2), 0))
+		return bus_write_slow(bus, addr, value, 2);
+
+	*(uint16_t *)bus_host(page, addr) = value;
+}
+
+static inline void bus_write_u8(struct bus *bus, uint32_t addr, uint32_t value)
+{
+	uintptr_t page = bus->pages[addr >> BUS_PAGE_SHIFT];
+
+	if (__builtin_expect(!(page & BUS_WRITE), 0))
+		return bus_write_slow(bus, addr, value, 1);
+
+	*(uint8_t *)bus_host(page, addr) = value;
+}
+
+#endif /* BUS_FLAT */
+
+static inline int32_t bus_read_s16(struct bus *bus, uint32_t addr)
+{
+	return (int16_t)bus_read_u16(bus, addr);
+}
+
+static inline int32_t bus_read_s8(struct bus *bus, uint32_t addr)
+{
+	return (int8_t)bus_read_u8(bus, addr);
+}
+
 #endif /* MM_H */
@@ -0,0 +1,31 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+/*
+ * Work-stealing pool for a fixed set of jobs: each worker starts with a
+ * contiguous share of the job indices, takes jobs from the front of its
+ * own share and, once it runs dry, steals the back half of another
+ * worker's remaining share.
+ */
+struct pool_worker {
+	pthread_mutex_t lock;
+	int head;		/* next job to run */
+	int tail;		/* one past the last job owned */
+	int id;
+	pthread_t thread;
+	struct pool *pool;
+};
+
+struct pool {
+	struct pool_worker *workers;
+	int nr_workers;
+	void (*fn)(void *arg, int job);
+	void *arg;
+};
+
+int pool_nr_cpus(void);
+int pool_run(int nr_jobs, int nr_workers, void (*fn)(void *arg, int job), void *arg);
+
+#endif /* POOL_H */
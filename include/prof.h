@@ -0,0 +1,55 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vm.h>
+
+#define PROF_MAX_NODES		(1 << 20)
+#define PROF_HOT_BLOCKS		20
+
+/*
+ * Calling context tree node: a function (call target) reached through the
+ * chain of its parents, with the instructions executed in it directly.
+ */
+struct prof_node {
+	uint32_t func;
+	uint32_t parent;
+	uint32_t child;		/* first callee, 0 if none */
+	uint32_t sibling;	/* next callee of the parent */
+	uint64_t self;
+};
+
+struct prof_sym {
+	uint32_t addr;
+	char *name;
+};
+
+/*
+ * Exact profile of one run, filled by vm_run_prof(). The per-PC arrays are
+ * indexed by ROM halfword: executions, executions entering a basic block, and
+ * for branches how often they were taken.
+ */
+struct prof {
+	uint32_t base;
+	uint32_t size;
+	uint64_t *count;
+	uint64_t *block;
+	uint64_t *taken;
+
+	struct prof_node *nodes;
+	uint32_t nr_nodes;
+	uint32_t cur;		/* node of the running function */
+	uint64_t mark;		/* icount when cur was last charged */
+
+	struct prof_sym *syms;
+	int nr_syms;
+};
+
+struct prof *prof_create(struct vm *vm);
+void prof_destroy(struct prof *prof);
+int prof_load_symbols(struct prof *prof, const void *image, int size);
+void prof_dump(struct prof *prof, struct vm *vm, FILE *out);
+int prof_write_folded(struct prof *prof, const char *path);
+
+#endif /* PROF_H */
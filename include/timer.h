@@ -0,0 +1,29 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <vm.h>
+
+/*
+ * Machine timer laid out as the CLINT of the QEMU virt machine, counting
+ * at 10 MHz of host time. There are no interrupts: mtimecmp only sets the
+ * pending bit in the status register, for guests that poll.
+ */
+#define TIMER_BASE		0x02000000
+#define TIMER_SIZE		0x10000
+#define TIMER_FREQ		10000000
+
+#define TIMER_STATUS		0x0000	/* msip on a CLINT, bit 0 set once mtime >= mtimecmp */
+#define TIMER_MTIMECMP		0x4000
+#define TIMER_MTIMECMP_HI	0x4004
+#define TIMER_MTIME		0xBFF8
+#define TIMER_MTIME_HI		0xBFFC
+
+struct timer {
+	uint64_t offset;	/* mtime minus host time, in ticks */
+	uint64_t mtimecmp;
+};
+
+int timer_attach(struct vm *vm, uint32_t base);
+
+#endif /* TIMER_H */
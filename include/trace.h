@@ -0,0 +1,189 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <vm.h>
+#include <inst.h>
+
+enum {
+	TRACE_OFF,
+	TRACE_INST,	/* pc and instruction word */
+	TRACE_REGS,	/* + destination register value after execution */
+};
+
+#define TRACE_RING_RECORDS	(1 << 16)
+
+struct trace_record {
+	uint32_t pc;
+	uint32_t inst;
+	uint32_t value;
+};
+
+/*
+ * Trace file, as written by trace_create_stream() and read back by
+ * rnv-tracedump: a header holding the register file when the trace
+ * started, then one variable-length record per executed instruction:
+ *
+ *   u8      flags
+ *   varint  zigzag(pc - previous pc), only with TRACE_F_PC
+ *   u32     instruction word
+ *   u32     new value of rd, only with TRACE_F_RD
+ *
+ * The previous pc starts at 0 and a record without TRACE_F_PC is at
+ * previous pc + 4. All fields are little-endian.
+ */
+#define TRACE_FILE_MAGIC	0x54564e52	/* "RNVT" */
+#define TRACE_FILE_VERSION	1
+
+#define TRACE_F_PC		(1 << 0)
+#define TRACE_F_RD		(1 << 1)
+
+#define TRACE_RECORD_MAX	(1 + 5 + 4 + 4)
+
+struct trace_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t regs[32];
+};
+
+/*
+ * Single-producer ring of encoded records: the run loop appends to it and
+ * a writer thread drains it to the trace file.
+ */
+struct trace_stream {
+	uint8_t *buf;
+	uint64_t mask;
+
+	/* producer side */
+	_Alignas(64) _Atomic uint64_t head;
+	uint64_t cached_tail;
+	uint32_t prev_pc;
+	uint32_t regs[32];
+
+	/* consumer side */
+	_Alignas(64) _Atomic uint64_t tail;
+	_Atomic int done;
+	FILE *out;
+	pthread_t writer;
+};
+
+/*
+ * Flight recorder: the last TRACE_RING_RECORDS executed instructions are
+ * kept as binary records and only formatted when the trace is dumped.
+ * With a stream attached, every instruction goes to the trace file instead.
+ */
+struct trace {
+	int level;
+	uint32_t mask;
+	uint64_t head;
+	struct trace_record *ring;
+	struct trace_stream *stream;
+};
+
+struct trace *trace_create(int level, int nr_records);
+struct trace *trace_create_stream(struct vm *vm, const char *path);
+void trace_destroy(struct trace *trace);
+void trace_dump(struct trace *trace, FILE *out);
+int trace_parse_level(const char *name);
+void trace_stream_wait(struct trace_stream *s, int len);
+
+static inline uint32_t trace_zigzag(int32_t v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t trace_unzigzag(uint32_t v)
+{
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static inline int trace_put_varint(uint8_t *p, uint32_t v)
+{
+	int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+
+	return n;
+}
+
+static inline void trace_stream_write(struct trace_stream *s, const uint8_t *rec, int len)
+{
+	uint64_t head = atomic_load_explicit(&s->head, memory_order_relaxed);
+
+	if (head + len - s->cached_tail > s->mask + 1)
+		trace_stream_wait(s, len);
+
+	for (int i = 0; i < len; i++)
+		s->buf[(head + i) & s->mask] = rec[i];
+
+	atomic_store_explicit(&s->head, head + len, memory_order_release);
+}
+
+static inline void trace_stream_emit(struct trace_stream *s, struct vm *vm, uint32_t pc, struct inst_decoded *d)
+{
+	uint8_t rec[TRACE_RECORD_MAX];
+	uint8_t *p = rec + 1;
+	uint32_t value;
+
+	rec[0] = 0;
+
+	if (pc != s->prev_pc + 4) {
+		rec[0] |= TRACE_F_PC;
+		p += trace_put_varint(p, trace_zigzag(pc - s->prev_pc));
+	}
+	s->prev_pc = pc;
+
+	memcpy(p, &d->inst, sizeof(uint32_t));
+	p += sizeof(uint32_t);
+
+	/* only rd can change, and only its new value is recorded */
+	value = vm_read_register(vm, d->rd);
+	if (value != s->regs[d->rd]) {
+		rec[0] |= TRACE_F_RD;
+		s->regs[d->rd] = value;
+		memcpy(p, &value, sizeof(uint32_t));
+		p += sizeof(uint32_t);
+	}
+
+	trace_stream_write(s, rec, p - rec);
+}
+
+static inline void trace_record(struct trace *trace, struct vm *vm, uint32_t pc, struct inst_decoded *d)
+{
+	struct trace_record *r;
+
+	if (trace->stream) {
+		trace_stream_emit(trace->stream, vm, pc, d);
+		return;
+	}
+
+	r = &trace->ring[trace->head++ & trace->mask];
+	r->pc = pc;
+	r->inst = d->inst;
+
+	if (trace->level >= TRACE_REGS)
+		r->value = vm_read_register(vm, d->rd);
+}
+
+/*
+ * Only built with CONFIG_TRACE (make TRACE=1), otherwise the hooks in the
+ * run loop compile to nothing.
+ */
+#ifdef CONFIG_TRACE
+#define trace_exec(vm, pc, d)	do {						\
+					if ((vm)->trace)			\
+						trace_record((vm)->trace, vm, pc, d); \
+				} while (0)
+#else
+#define trace_exec(vm, pc, d)	do { } while (0)
+#endif
+
+#endif /* TRACE_H */
@@ -0,0 +1,37 @@
+#ifndef UART_H
+#define UART_H
+
+#include <stdint.h>
+#include <vm.h>
+
+/*
+ * The part of a 16550 that polled console code uses, at the address of
+ * the QEMU virt machine's UART: byte registers, transmit always ready,
+ * output goes with the guest's stdout, input comes from rnv's stdin.
+ */
+#define UART_BASE		0x10000000
+#define UART_SIZE		0x100
+
+#define UART_RBR		0x0	/* read: received byte */
+#define UART_THR		0x0	/* write: byte to send */
+#define UART_LSR		0x5	/* line status */
+
+enum {
+	UART_LSR_DR = (1 << 0),		/* a byte is waiting in RBR */
+	UART_LSR_THRE = (1 << 5),
+	UART_LSR_TEMT = (1 << 6),
+};
+
+/* stdin is polled once per this many LSR reads while nothing is waiting */
+#define UART_POLL_INTERVAL	1024
+
+struct uart {
+	struct vm *vm;
+	int rx;			/* byte in RBR, -1 if none */
+	int rx_eof;
+	int polls;		/* LSR reads left before stdin is looked at again */
+};
+
+int uart_attach(struct vm *vm, uint32_t base);
+
+#endif /* UART_H */
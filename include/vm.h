@@ -4,15 +4,97 @@
 #include <cpu.h>
 #include <mm.h>
 
+struct icache;
+struct threaded;
+struct jit;
+struct trace;
+struct vm_snapshot;
+struct prof;
+struct ecall;
+struct aot_image;
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define VM_MAX_SEGMENTS		8
+
+/* flat binaries: ROM at 0x10000, RAM at 0x20000, 32K each */
+#define VM_ROM_BASE		0x10000
+#define VM_ROM_SIZE		(32 * 1024)
+#define VM_RAM_BASE		0x20000
+#define VM_RAM_SIZE		(32 * 1024)
+
+/*
+ * Where the memories of a vm go. ELF images bring their own addresses for
+ * the code, the ROM fields only apply to flat binaries. A zero ram_base puts
+ * the RAM above the image, at VM_RAM_BASE at the lowest for flat binaries.
+ */
+struct vm_layout {
+	uint32_t rom_base;
+	uint32_t rom_size;
+	uint32_t ram_base;
+	uint32_t ram_size;
+	int huge;		/* back the memories with huge pages */
+};
+
+#define VM_LAYOUT_DEFAULT	{ VM_ROM_BASE, VM_ROM_SIZE, 0, VM_RAM_SIZE, 0 }
+#define VM_LOCKSTEP_LANES	8	/* vms run together by vm_run_lockstep() */
+
+/* instruction pairs run as one, see inst_fusion() */
+enum {
+	VM_FUSE_NONE,
+	VM_FUSE_LUI_ADDI,	/* lui rd; addi rd, rd: 32-bit constant */
+	VM_FUSE_AUIPC_JALR,	/* auipc rd; jalr rd: far call or tail call */
+	VM_FUSE_AUIPC_LW,	/* auipc rd; lw rd: PC-relative load */
+	VM_FUSE_SLT_BRANCH,	/* slt(i)(u) rd; beqz/bnez rd */
+	VM_FUSE_ADDI_BNE,	/* addi rd, rd; bne rd: loop counter */
+	VM_NR_FUSIONS,
+};
+
 struct vm {
 	struct cpu cpu;
-	struct memory rom;
+	struct memory rom;	/* the code the engines run, starting at cpu.pc */
 	struct memory ram;
+	struct memory segments[VM_MAX_SEGMENTS];	/* other ELF segments */
+	int nr_segments;
+	uint32_t image_end;	/* first address past the loaded image */
+	struct bus bus;
+	struct icache *icache;
+	struct threaded *threaded;
+	struct jit *jit;
+	struct trace *trace;
+	const struct aot_image *aot;	/* translated code, see aot.h */
+	struct ecall *ecall;	/* syscall emulation, from the first ecall on */
+	struct vm_snapshot *snapshot;	/* the one vm_restore() can use */
+	uint32_t brk;		/* program break, 0 until the guest asks for it */
+	uint64_t icount;	/* Instructions retired */
+	uint64_t fused[VM_NR_FUSIONS];	/* pairs retired as one, by kind */
+	int halted;		/* Set on access faults and exit(), engines stop */
+	int exited;		/* the guest called exit(), with exit_code */
+	int exit_code;
 };
 
-struct vm *vm_init(uint32_t entry_point, int rom_size, int ram_size);
+struct vm *vm_create(void);
+struct vm *vm_init(const struct vm_layout *layout);
+int vm_map_ram(struct vm *vm, uint32_t base_addr, uint32_t ram_size, int attr);
 int vm_load_bin(struct vm *vm, void *bin, int size);
+int vm_is_elf(const void *image, int size);
+int vm_load_elf(struct vm *vm, const void *image, int size, int fd);
+struct vm *vm_load_image(void *image, int size, int fd, const struct vm_layout *layout);
+void vm_share_code(struct vm *vm, struct vm *tmpl);
+uint64_t vm_rom_hash(struct vm *vm);
+void vm_destroy(struct vm *vm);
+struct vm_snapshot *vm_snapshot(struct vm *vm);
+int vm_restore(struct vm *vm, struct vm_snapshot *snap);
+void vm_snapshot_destroy(struct vm_snapshot *snap);
 void vm_run(struct vm *vm);
+void vm_run_fast(struct vm *vm);
+void vm_flush_fast(struct vm *vm);
+void vm_run_jit(struct vm *vm);
+void vm_flush_jit(struct vm *vm);
+void vm_run_aot(struct vm *vm);
+void vm_run_lockstep(struct vm **vms, int nr);
+void vm_run_prof(struct vm *vm, struct prof *prof);
 void vm_dump_registers(struct vm *vm);
 void vm_dump_rom(struct vm *vm, int size);
 
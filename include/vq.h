@@ -0,0 +1,82 @@
+#ifndef VQ_H
+#define VQ_H
+
+#include <stdint.h>
+#include <vm.h>
+
+/*
+ * Virtio-like queue device for streaming data between a host file and the
+ * guest. Each queue is a ring of buffer descriptors in guest RAM that the
+ * host works on in place: the guest posts buffers in the avail ring, writes
+ * the queue number to NOTIFY, and by the time the store returns the host
+ * has filled (rx) or drained (tx) them and listed them in the used ring.
+ *
+ * Ring layout at RING, 4-byte aligned, num a power of two:
+ *
+ *	struct vq_desc desc[num];
+ *	uint32_t avail_idx;
+ *	uint32_t avail[num];		descriptor numbers
+ *	uint32_t used_idx;
+ *	struct vq_used used[num];
+ *
+ * Indexes run freely, entry i lives in slot i & (num - 1).
+ */
+
+#define VQ_MMIO_BASE		0x10001000
+#define VQ_MMIO_SIZE		0x1000
+#define VQ_MAX_NUM		1024
+#define VQ_BATCH		64	/* buffers per host readv()/writev() */
+
+enum {
+	VQ_RX,			/* host file to guest */
+	VQ_TX,			/* guest to host file */
+	VQ_NR_QUEUES,
+};
+
+/* registers, all 32-bit; NUM, RING and READY apply to the queue in SEL */
+#define VQ_REG_SEL		0x00
+#define VQ_REG_NUM		0x04
+#define VQ_REG_RING		0x08
+#define VQ_REG_READY		0x0C
+#define VQ_REG_NOTIFY		0x10	/* write only, the queue to process */
+#define VQ_REG_STATUS		0x14	/* read only */
+
+enum {
+	VQ_STATUS_EOF = (1 << 0),	/* nothing more to receive */
+	VQ_STATUS_ERROR = (1 << 1),	/* bad ring or buffer, or host I/O failed */
+};
+
+struct vq_desc {
+	uint32_t addr;
+	uint32_t len;
+};
+
+struct vq_used {
+	uint32_t id;		/* descriptor number */
+	uint32_t len;		/* bytes received or sent */
+};
+
+struct vq {
+	uint32_t num;
+	uint32_t ring;
+	int ready;
+	int fd;
+	uint32_t last_avail;
+	/* host view of the ring, set up when the queue is made ready */
+	struct vq_desc *desc;
+	uint32_t *avail_idx;
+	uint32_t *avail;
+	uint32_t *used_idx;
+	struct vq_used *used;
+};
+
+struct vq_dev {
+	struct vm *vm;
+	struct vq queues[VQ_NR_QUEUES];
+	uint32_t sel;
+	uint32_t status;
+};
+
+struct vq_dev *vq_create(struct vm *vm, int rx_fd, int tx_fd);
+
+#endif /* VQ_H */
@@ -1,18 +1,37 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <vm.h>
 #include <inst.h>
 #include <bit_ops.h>
+#include <ecall.h>
 
-static void (*inst_opcodes[512])(struct vm *vm, uint32_t inst);
-static void (*inst_pseudo_opcodes[32])(struct vm *vm, uint32_t inst);
+static inst_handler_t inst_opcodes[RV_NR_OPCODES];
+static inst_expand_t inst_pseudo_opcodes[32];
 
-static void inst_install_opcode(void (*func)(struct vm *, uint32_t), int opcode)
+/* handlers for special operands, see inst_select() */
+struct inst_variants {
+	inst_handler_t rd_zero;
+	inst_handler_t a_zero;
+	inst_handler_t b_zero;
+};
+
+static struct inst_variants inst_variants[RV_NR_OPCODES];
+
+static void inst_install_opcode(inst_handler_t func, int opcode)
 {
 	inst_opcodes[opcode] = func;
 }
 
-static void inst_install_pseudo_opcode(void (*func)(struct vm *, uint32_t), int opcode)
+static void inst_install_variants(int opcode, inst_handler_t rd_zero, inst_handler_t a_zero,
+				  inst_handler_t b_zero)
+{
+	inst_variants[opcode].rd_zero = rd_zero;
+	inst_variants[opcode].a_zero = a_zero;
+	inst_variants[opcode].b_zero = b_zero;
+}
+
+static void inst_install_pseudo_opcode(inst_expand_t func, int opcode)
 {
 	inst_pseudo_opcodes[opcode] = func;
 }
@@ -37,677 +56,855 @@ static inline int decode_branch_imm(uint32_t instruction)
 	return sign_extend(imm, 13);
 }
 
-static void inst_lui(struct vm *vm, uint32_t inst)
+static inline int decode_i_imm(uint32_t instruction)
 {
-	printf("LUI\n");
-
-	int rds = bit_cut(inst, 7, 5);
-	int imm = sign_extend(inst & 0xFFFFF000, 32);
-
-	vm_write_register(vm, rds, imm);
+	return sign_extend(bit_cut(instruction, 20, 12), 12);
 }
 
-static void inst_auipc(struct vm *vm, uint32_t inst)
+static inline int decode_s_imm(uint32_t instruction)
 {
-	printf("AUPIC\n");
-
-	int rds = bit_cut(inst, 7, 5);
-	int imm = sign_extend(inst & 0xFFFFF000, 32);
-	uint32_t pc = vm_read_pc(vm);
-
-	vm_write_register(vm, rds, pc + imm);
+	return sign_extend(bit_cut(instruction, 7, 5) | (bit_cut(instruction, 25, 7) << 5), 12);
 }
 
-static void inst_jal(struct vm *vm, uint32_t inst)
+static void inst_unknown(struct vm *vm, struct inst_decoded *d)
 {
-	printf("JAL\n");
-
-	int rds = bit_cut(inst, 7, 5);
-	int offset = decode_jal_imm(inst);
-	uint32_t pc = vm_read_pc(vm);
-
-	vm_write_register(vm, rds, pc + 4);
-	vm_write_pc(vm, pc + offset - 4);
+	printf("UNKNOWN (0x%08x)\n", d->inst);
 }
 
-static void inst_jalr(struct vm *vm, uint32_t inst)
+/* all-zero word: the run loops stop right after it */
+static void inst_halt(struct vm *vm, struct inst_decoded *d)
 {
-	printf("JALR\n");
-
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int offset = sign_extend(bit_cut(inst, 20, 12), 12);
-	uint32_t pc = vm_read_pc(vm);
-	uint32_t jmp_addr = vm_read_register(vm, rs1);
-
-	vm_write_register(vm, rds, pc + 4);
-	vm_write_pc(vm, ((jmp_addr + offset) & (~(uint32_t)1)) - 4);
 }
 
-static void inst_beq(struct vm *vm, uint32_t inst)
+static void inst_lui(struct vm *vm, struct inst_decoded *d)
 {
-	printf("BEQ\n");
-
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
-	int offset = decode_branch_imm(inst);
-
-	if (vm_read_register(vm, rs1) == vm_read_register(vm, rs2))
-	{
-		uint32_t pc = vm_read_pc(vm);
-
-		vm_write_pc(vm, pc + offset - 4);
-	}
+	vm_write_register(vm, d->rd, d->imm);
 }
 
-static void inst_bne(struct vm *vm, uint32_t inst)
+static void inst_auipc(struct vm *vm, struct inst_decoded *d)
 {
-	printf("BNE\n");
-
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
-	int offset = decode_branch_imm(inst);
-
-	if (vm_read_register(vm, rs1) != vm_read_register(vm, rs2))
-	{
-		uint32_t pc = vm_read_pc(vm);
-
-		vm_write_pc(vm, pc + offset - 4);
-	}
+	/* imm already holds pc + (imm << 12) */
+	vm_write_register(vm, d->rd, d->imm);
 }
 
-static void inst_blt(struct vm *vm, uint32_t inst)
-{
-	printf("BLT\n");
+/*
+ * Most handlers below are instantiated from one description: a and b are
+ * the operands, rs1 and rs2 or the immediate, and each comes in variants
+ * for the operands compilers use all the time, picked by inst_select():
+ *
+ *	inst_<name>	general case
+ *	inst_<name>_az	rs1 is x0, a is a constant 0
+ *	inst_<name>_bz	rs2 is x0 or the immediate is 0, b is a constant 0
+ *
+ * Anything whose only effect is writing rd runs as inst_nop when rd is x0.
+ */
+#define INST_VARIANT(name, suffix, a_value, b_value, body)		\
+static void inst_##name##suffix(struct vm *vm, struct inst_decoded *d)	\
+{									\
+	uint32_t a = (a_value);						\
+	uint32_t b = (b_value);						\
+									\
+	body;								\
+}
 
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
-	int offset = decode_branch_imm(inst);
+#define INST_VARIANTS(name, b_value, body)				\
+	INST_VARIANT(name, , vm_read_register(vm, d->rs1), b_value, body) \
+	INST_VARIANT(name, _az, 0, b_value, body)			\
+	INST_VARIANT(name, _bz, vm_read_register(vm, d->rs1), 0, body)
 
-	if (vm_read_register(vm, rs1) < vm_read_register(vm, rs2))
-	{
-		uint32_t pc = vm_read_pc(vm);
+#define INST_ALU_IMM(name, expr)					\
+	INST_VARIANTS(name, d->imm, vm_write_register(vm, d->rd, (expr)))
+#define INST_ALU_REG(name, expr)					\
+	INST_VARIANTS(name, vm_read_register(vm, d->rs2),		\
+		      vm_write_register(vm, d->rd, (expr)))
+#define INST_BRANCH(name, cond)						\
+	INST_VARIANTS(name, vm_read_register(vm, d->rs2),		\
+		      if (cond) vm_write_pc(vm, d->target))
 
-		vm_write_pc(vm, pc + offset - 4);
-	}
+/* jumps, and their rd = x0 variants: j, jr and ret */
+#define INST_JUMP(name, target)						\
+static void inst_##name(struct vm *vm, struct inst_decoded *d)		\
+{									\
+	uint32_t addr = (target);					\
+									\
+	vm_write_register(vm, d->rd, vm_read_pc(vm));			\
+	vm_write_pc(vm, addr);						\
+}									\
+									\
+static void inst_##name##_nolink(struct vm *vm, struct inst_decoded *d)	\
+{									\
+	vm_write_pc(vm, (target));					\
 }
 
-static void inst_bge(struct vm *vm, uint32_t inst)
+static void inst_nop(struct vm *vm, struct inst_decoded *d)
 {
-	printf("BGE\n");
-
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
-	int offset = decode_branch_imm(inst);
-
-	if (vm_read_register(vm, rs1) >= vm_read_register(vm, rs2))
-	{
-		uint32_t pc = vm_read_pc(vm);
-
-		vm_write_pc(vm, pc + offset - 4);
-	}
 }
 
-static void inst_bltu(struct vm *vm, uint32_t inst)
-{
-	printf("BLTU\n");
+INST_JUMP(jal, d->target)
+INST_JUMP(jalr, (vm_read_register(vm, d->rs1) + d->imm) & (~(uint32_t)1))
 
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
-	int offset = decode_branch_imm(inst);
+INST_BRANCH(beq, a == b)
+INST_BRANCH(bne, a != b)
+INST_BRANCH(blt, (int32_t)a < (int32_t)b)
+INST_BRANCH(bge, (int32_t)a >= (int32_t)b)
+INST_BRANCH(bltu, a < b)
+INST_BRANCH(bgeu, a >= b)
 
-	if ((uint32_t)vm_read_register(vm, rs1) < (uint32_t)vm_read_register(vm, rs2))
-	{
-		uint32_t pc = vm_read_pc(vm);
+static void inst_lb(struct vm *vm, struct inst_decoded *d)
+{
+	int addr = vm_read_register(vm, d->rs1) + d->imm;
 
-		vm_write_pc(vm, pc + offset - 4);
-	}
+	vm_load_s8(vm, addr, d->rd);
 }
 
-static void inst_bgeu(struct vm *vm, uint32_t inst)
+static void inst_lh(struct vm *vm, struct inst_decoded *d)
 {
-	printf("BGEU\n");
-
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
-	int offset = decode_branch_imm(inst);
+	int addr = vm_read_register(vm, d->rs1) + d->imm;
 
-	if ((uint32_t)vm_read_register(vm, rs1) >= (uint32_t)vm_read_register(vm, rs2))
-	{
-		uint32_t pc = vm_read_pc(vm);
-
-		vm_write_pc(vm, pc + offset - 4);
-	}
+	vm_load_s16(vm, addr, d->rd);
 }
 
-static void inst_lb(struct vm *vm, uint32_t inst)
+static void inst_lw(struct vm *vm, struct inst_decoded *d)
 {
-	printf("LB\n");
+	int addr = vm_read_register(vm, d->rs1) + d->imm;
 
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int offset = sign_extend(bit_cut(inst, 20, 12), 12);
-	int addr = vm_read_register(vm, rs1) + offset;
-
-	vm_load_s8(vm, addr, rds);
+	vm_load_s32(vm, addr, d->rd);
 }
 
-static void inst_lh(struct vm *vm, uint32_t inst)
+static void inst_lbu(struct vm *vm, struct inst_decoded *d)
 {
-	printf("LH\n");
-
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int offset = sign_extend(bit_cut(inst, 20, 12), 12);
-	int addr = vm_read_register(vm, rs1) + offset;
+	int addr = vm_read_register(vm, d->rs1) + d->imm;
 
-	vm_load_s16(vm, addr, rds);
+	vm_load_u8(vm, addr, d->rd);
 }
 
-static void inst_lw(struct vm *vm, uint32_t inst)
+static void inst_lhu(struct vm *vm, struct inst_decoded *d)
 {
-	printf("LW\n");
+	int addr = vm_read_register(vm, d->rs1) + d->imm;
 
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int offset = sign_extend(bit_cut(inst, 20, 12), 12);
-	int addr = vm_read_register(vm, rs1) + offset;
-
-	vm_load_s32(vm, addr, rds);
+	vm_load_u16(vm, addr, d->rd);
 }
 
-static void inst_lbu(struct vm *vm, uint32_t inst)
+static void inst_sb(struct vm *vm, struct inst_decoded *d)
 {
-	printf("LBU\n");
-
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int offset = sign_extend(bit_cut(inst, 20, 12), 12);
-	int addr = vm_read_register(vm, rs1) + offset;
+	int addr = vm_read_register(vm, d->rs1) + d->imm;
 
-	vm_load_u8(vm, addr, rds);
+	vm_store_u8(vm, addr, d->rs2);
 }
 
-static void inst_lhu(struct vm *vm, uint32_t inst)
+static void inst_sh(struct vm *vm, struct inst_decoded *d)
 {
-	printf("LHU\n");
+	int addr = vm_read_register(vm, d->rs1) + d->imm;
 
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int offset = sign_extend(bit_cut(inst, 20, 12), 12);
-	int addr = vm_read_register(vm, rs1) + offset;
-
-	vm_load_u16(vm, addr, rds);
+	vm_store_u16(vm, addr, d->rs2);
 }
 
-static void inst_sb(struct vm *vm, uint32_t inst)
+static void inst_sw(struct vm *vm, struct inst_decoded *d)
 {
-	printf("SB\n");
-
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
-	int offset = sign_extend(bit_cut(inst, 7, 5) | (bit_cut(inst, 25, 7) << 5), 12);
-	int addr = vm_read_register(vm, rs1) + offset;
+	int addr = vm_read_register(vm, d->rs1) + d->imm;
 
-	vm_store_u8(vm, addr, rs2);
+	vm_store(vm, addr, d->rs2);
 }
 
-static void inst_sh(struct vm *vm, uint32_t inst)
-{
-	printf("SH\n");
+INST_ALU_IMM(addi, a + b)
+INST_ALU_IMM(slti, ((int32_t)a < (int32_t)b) ? 1 : 0)
+INST_ALU_IMM(sltiu, (a < b) ? 1 : 0)
+INST_ALU_IMM(xori, a ^ b)
+INST_ALU_IMM(ori, a | b)
+INST_ALU_IMM(andi, a & b)
+INST_ALU_IMM(slli, a << b)
+INST_ALU_IMM(srli, a >> b)
+INST_ALU_IMM(srai, (int32_t)a >> b)
 
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
-	int offset = sign_extend(bit_cut(inst, 7, 5) | (bit_cut(inst, 25, 7) << 5), 12);
-	int addr = vm_read_register(vm, rs1) + offset;
+INST_ALU_REG(add, a + b)
+INST_ALU_REG(sub, a - b)
+INST_ALU_REG(sll, a << (b & bit_mask(5)))
+INST_ALU_REG(slt, ((int32_t)a < (int32_t)b) ? 1 : 0)
+INST_ALU_REG(sltu, (a < b) ? 1 : 0)
+INST_ALU_REG(xor, a ^ b)
+INST_ALU_REG(srl, a >> (b & bit_mask(5)))
+INST_ALU_REG(sra, (int32_t)a >> (b & bit_mask(5)))
+INST_ALU_REG(or, a | b)
+INST_ALU_REG(and, a & b)
 
-	vm_store_u16(vm, addr, rs2);
-}
+INST_ALU_REG(mul, a * b)
+INST_ALU_REG(mulh, rv32m_mulh(a, b))
+INST_ALU_REG(mulhsu, rv32m_mulhsu(a, b))
+INST_ALU_REG(mulhu, rv32m_mulhu(a, b))
+INST_ALU_REG(div, rv32m_div(a, b))
+INST_ALU_REG(divu, rv32m_divu(a, b))
+INST_ALU_REG(rem, rv32m_rem(a, b))
+INST_ALU_REG(remu, rv32m_remu(a, b))
 
-static void inst_sw(struct vm *vm, uint32_t inst)
+static void inst_fence(struct vm *vm, struct inst_decoded *d)
 {
-	printf("SW\n");
-
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
-	int offset = sign_extend(bit_cut(inst, 7, 5) | (bit_cut(inst, 25, 7) << 5), 12);
-	int addr = vm_read_register(vm, rs1) + offset;
-
-	vm_store(vm, addr, rs2);
 }
 
-static void inst_addi(struct vm *vm, uint32_t inst)
+static void inst_ecall_ebreak(struct vm *vm, struct inst_decoded *d)
 {
-	printf("ADDI\n");
-
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int imm = sign_extend(bit_cut(inst, 20, 12), 12);
+	/* ebreak has no debugger to trap into */
+	if (!(d->inst >> 20))
+		ecall_handle(vm);
+}
 
-	int tmp = vm_read_register(vm, rs1);
+/*
+ * Superinstructions, installed on the first op of a pair by inst_fuse().
+ * The second op follows it in the same decoded page and is left alone for
+ * whatever jumps to it. Both instructions retire, in order.
+ */
+#define FUSED_NEXT(d)	((d) + ((d)->len >> 1))
 
-	vm_write_register(vm, rds, tmp + imm);
+static void inst_fused(struct vm *vm, int kind)
+{
+	vm->icount++;
+	vm->fused[kind]++;
 }
 
-static void inst_slti(struct vm *vm, uint32_t inst)
+static void inst_lui_addi(struct vm *vm, struct inst_decoded *d)
 {
-	printf("SLTI\n");
-
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int imm = sign_extend(bit_cut(inst, 20, 12), 12);
-
-	int tmp = vm_read_register(vm, rs1);
+	struct inst_decoded *n = FUSED_NEXT(d);
 
-	vm_write_register(vm, rds, (tmp < imm) ? 1 : 0);
+	vm_write_register(vm, d->rd, d->imm + n->imm);
+	vm_write_pc(vm, vm_read_pc(vm) + n->len);
+	inst_fused(vm, VM_FUSE_LUI_ADDI);
 }
 
-static void inst_sltiu(struct vm *vm, uint32_t inst)
+static void inst_auipc_jalr(struct vm *vm, struct inst_decoded *d)
 {
-	printf("SLTIU\n");
-
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	uint32_t imm = sign_extend(bit_cut(inst, 20, 12), 12);
-
-	uint32_t tmp = vm_read_register(vm, rs1);
-
-	vm_write_register(vm, rds, (tmp < imm) ? 1 : 0);
+	struct inst_decoded *n = FUSED_NEXT(d);
 
+	vm_write_register(vm, d->rd, d->imm);
+	vm_write_register(vm, n->rd, vm_read_pc(vm) + n->len);
+	vm_write_pc(vm, (d->imm + n->imm) & (~(uint32_t)1));
+	inst_fused(vm, VM_FUSE_AUIPC_JALR);
 }
 
-static void inst_xori(struct vm *vm, uint32_t inst)
+static void inst_auipc_lw(struct vm *vm, struct inst_decoded *d)
 {
-	printf("XORI\n");
+	struct inst_decoded *n = FUSED_NEXT(d);
 
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int imm = sign_extend(bit_cut(inst, 20, 12), 12);
-
-	int tmp = vm_read_register(vm, rs1);
-
-	vm_write_register(vm, rds, tmp ^ imm);
+	vm_write_register(vm, d->rd, d->imm);
+	vm_write_pc(vm, vm_read_pc(vm) + n->len);
+	vm_load_s32(vm, d->imm + n->imm, n->rd);
+	inst_fused(vm, VM_FUSE_AUIPC_LW);
+}
 
+/* funct3 bit 0 tells bnez, taken on 1, from beqz, taken on 0 */
+#define INST_SLT_BRANCH(name, type, rhs)				\
+static void inst_##name##_branch(struct vm *vm, struct inst_decoded *d)	\
+{									\
+	struct inst_decoded *n = FUSED_NEXT(d);				\
+	type tmp = vm_read_register(vm, d->rs1);			\
+	int cond = (tmp < (type)(rhs)) ? 1 : 0;				\
+									\
+	vm_write_register(vm, d->rd, cond);				\
+	if (cond == ((n->inst >> 12) & 1))				\
+		vm_write_pc(vm, n->target);				\
+	else								\
+		vm_write_pc(vm, vm_read_pc(vm) + n->len);		\
+	inst_fused(vm, VM_FUSE_SLT_BRANCH);				\
 }
 
-static void inst_ori(struct vm *vm, uint32_t inst)
-{
-	printf("ORI\n");
+INST_SLT_BRANCH(slt, int, vm_read_register(vm, d->rs2))
+INST_SLT_BRANCH(sltu, uint32_t, vm_read_register(vm, d->rs2))
+INST_SLT_BRANCH(slti, int, d->imm)
+INST_SLT_BRANCH(sltiu, uint32_t, d->imm)
 
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int imm = sign_extend(bit_cut(inst, 20, 12), 12);
+static void inst_addi_bne(struct vm *vm, struct inst_decoded *d)
+{
+	struct inst_decoded *n = FUSED_NEXT(d);
 
-	int tmp = vm_read_register(vm, rs1);
+	vm_write_register(vm, d->rd, vm_read_register(vm, d->rs1) + d->imm);
+	if (vm_read_register(vm, n->rs1) != vm_read_register(vm, n->rs2))
+		vm_write_pc(vm, n->target);
+	else
+		vm_write_pc(vm, vm_read_pc(vm) + n->len);
+	inst_fused(vm, VM_FUSE_ADDI_BNE);
+}
 
-	vm_write_register(vm, rds, tmp | imm);
+#if 0
+static void inst_lwu(struct vm *vm, struct inst_decoded *d)
+{
+	printf("LWU\n");
 
 }
 
-static void inst_andi(struct vm *vm, uint32_t inst)
+static void inst_ld(struct vm *vm, struct inst_decoded *d)
 {
-	printf("ANDI\n");
-
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int imm = sign_extend(bit_cut(inst, 20, 12), 12);
+	printf("LD\n");
 
-	int tmp = vm_read_register(vm, rs1);
+}
 
-	vm_write_register(vm, rds, tmp & imm);
+static void inst_sd(struct vm *vm, struct inst_decoded *d)
+{
+	printf("SD\n");
 
 }
 
-static void inst_slli(struct vm *vm, uint32_t inst)
+static void inst_addiw(struct vm *vm, struct inst_decoded *d)
 {
-	printf("SLLI\n");
+	printf("ADDIW\n");
 
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int shamt = bit_cut(inst, 20, 5);
+}
 
-	int tmp = vm_read_register(vm, rs1);
+static void inst_slliw(struct vm *vm, struct inst_decoded *d)
+{
+	printf("SLLIW\n");
 
-	vm_write_register(vm, rds, tmp << shamt);
 }
 
-static void inst_srli_srai(struct vm *vm, uint32_t inst)
+static void inst_srliw_sraiw(struct vm *vm, struct inst_decoded *d)
 {
 	int funct7;
 
-	funct7 = (inst >> 25) & 0xFF;
+	funct7 = (d->inst >> 25) & 0xFF;
 
 	if (funct7 == 0x20) {
-		printf("SRAI\n");
+		printf("SRAIW\n");
 	} else {
-		printf("SRLI\n");
+		printf("SRLIW\n");
 	}
-
 }
 
-static void inst_add_sub(struct vm *vm, uint32_t inst)
+static void inst_addw_subw(struct vm *vm, struct inst_decoded *d)
 {
 	int funct7;
 
-	funct7 = (inst >> 25) & 0xFF;
+	funct7 = (d->inst >> 25) & 0xFF;
 
 	if (funct7 == 0x20) {
-		printf("SUB\n");
+		printf("SUBW\n");
 	} else {
-		printf("ADD\n");
+		printf("ADDW\n");
 	}
 }
 
-static void inst_sll(struct vm *vm, uint32_t inst)
+static void inst_sllw(struct vm *vm, struct inst_decoded *d)
 {
-	printf("SLL\n");
-
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
-
-	int tmp = vm_read_register(vm, rs1);
-	int tmp2 = vm_read_register(vm, rs2);
-
-	vm_write_register(vm, rds, tmp << (tmp2 & bit_mask(5)));
+	printf("SLLW\n");
 
 }
 
-static void inst_slt(struct vm *vm, uint32_t inst)
+static void inst_srlw_sraw(struct vm *vm, struct inst_decoded *d)
 {
-	printf("SLT\n");
+	int funct7;
 
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
+	funct7 = (d->inst >> 25) & 0xFF;
 
-	int tmp = vm_read_register(vm, rs1);
-	int tmp2 = vm_read_register(vm, rs2);
+	if (funct7 == 0x20) {
+		printf("SRAW\n");
+	} else {
+		printf("SRLW\n");
+	}
 
-	vm_write_register(vm, rds, (tmp < tmp2) ? 1 : 0);
 }
+#endif
 
-static void inst_sltu(struct vm *vm, uint32_t inst)
+/*
+ * RVC: each compressed instruction is expanded once into the 32-bit
+ * instruction it stands for, which is then decoded as usual. The
+ * expanders are indexed by funct3 and quadrant (RVC_*) and return 0 for
+ * reserved encodings.
+ */
+static uint32_t rv_i(int opcode, int rd, int funct3, int rs1, int32_t imm)
 {
-	printf("SLTU\n");
-
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
-
-	uint32_t tmp = vm_read_register(vm, rs1);
-	uint32_t tmp2 = vm_read_register(vm, rs2);
-
-	vm_write_register(vm, rds, (tmp < tmp2) ? 1 : 0);
+	return ((uint32_t)imm << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
 }
 
-static void inst_xor(struct vm *vm, uint32_t inst)
+static uint32_t rv_r(int opcode, int rd, int funct3, int rs1, int rs2, int funct7)
 {
-	printf("XOR\n");
-
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
-
-	uint32_t tmp = vm_read_register(vm, rs1);
-	uint32_t tmp2 = vm_read_register(vm, rs2);
-
-	vm_write_register(vm, rds, tmp ^ tmp2);
+	return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
 }
 
-static void inst_srl_sra(struct vm *vm, uint32_t inst)
+static uint32_t rv_s(int funct3, int rs1, int rs2, int32_t imm)
 {
-	int funct7;
+	return rv_r(RV32_STORE_S_TYPE, imm & 0x1F, funct3, rs1, rs2, (imm >> 5) & 0x7F);
+}
 
-	funct7 = (inst >> 25) & 0xFF;
+static uint32_t rv_b(int funct3, int rs1, int rs2, int32_t imm)
+{
+	return rv_r(RV32_BRANCH_B_TYPE, (imm & 0x1E) | bit_check(imm, 11), funct3, rs1, rs2,
+		    (bit_check(imm, 12) << 6) | bit_cut(imm, 5, 6));
+}
 
-	if (funct7 == 0x20) {
-		printf("SRA\n");
-	} else {
-		printf("SRL\n");
-	}
+static uint32_t rv_j(int rd, int32_t imm)
+{
+	return (bit_check(imm, 20) << 31) | (bit_cut(imm, 1, 10) << 21) |
+		(bit_check(imm, 11) << 20) | (bit_cut(imm, 12, 8) << 12) | (rd << 7) | RV32_JAL;
 }
 
-static void inst_or(struct vm *vm, uint32_t inst)
+/* registers x8-x15 of the 3-bit rd'/rs1'/rs2' fields */
+static inline int rvc_reg(uint32_t c, int pos)
 {
-	printf("OR\n");
+	return 8 + bit_cut(c, pos, 3);
+}
 
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
+static inline int32_t rvc_imm6(uint32_t c)
+{
+	return sign_extend((bit_check(c, 12) << 5) | bit_cut(c, 2, 5), 6);
+}
 
-	uint32_t tmp = vm_read_register(vm, rs1);
-	uint32_t tmp2 = vm_read_register(vm, rs2);
+static inline int32_t rvc_j_imm(uint32_t c)
+{
+	return sign_extend((bit_check(c, 12) << 11) | (bit_check(c, 8) << 10) |
+			   (bit_cut(c, 9, 2) << 8) | (bit_check(c, 6) << 7) |
+			   (bit_check(c, 7) << 6) | (bit_check(c, 2) << 5) |
+			   (bit_check(c, 11) << 4) | (bit_cut(c, 3, 3) << 1), 12);
+}
 
-	vm_write_register(vm, rds, tmp | tmp2);
+static inline int32_t rvc_b_imm(uint32_t c)
+{
+	return sign_extend((bit_check(c, 12) << 8) | (bit_cut(c, 5, 2) << 6) |
+			   (bit_check(c, 2) << 5) | (bit_cut(c, 10, 2) << 3) |
+			   (bit_cut(c, 3, 2) << 1), 9);
 }
 
-static void inst_and(struct vm *vm, uint32_t inst)
+/* offset of c.lw/c.sw */
+static inline int32_t rvc_lw_imm(uint32_t c)
 {
-	printf("AND\n");
+	return (bit_check(c, 5) << 6) | (bit_cut(c, 10, 3) << 3) | (bit_check(c, 6) << 2);
+}
 
-	int rds = bit_cut(inst, 7, 5);
-	int rs1 = bit_cut(inst, 15, 5);
-	int rs2 = bit_cut(inst, 20, 5);
+static uint32_t rvc_addi4spn(uint32_t c)
+{
+	int32_t imm = (bit_cut(c, 7, 4) << 6) | (bit_cut(c, 11, 2) << 4) |
+		      (bit_check(c, 5) << 3) | (bit_check(c, 6) << 2);
 
-	uint32_t tmp = vm_read_register(vm, rs1);
-	uint32_t tmp2 = vm_read_register(vm, rs2);
+	if (!imm)
+		return 0;
 
-	vm_write_register(vm, rds, tmp & tmp2);
+	return rv_i(RV32_LOGIC_I_TYPE, rvc_reg(c, 2), 0, 2, imm);
 }
 
-static void inst_fence(struct vm *vm, uint32_t inst)
+static uint32_t rvc_lw(uint32_t c)
 {
-	printf("FENCE\n");
+	return rv_i(RV32_LOAD_I_TYPE, rvc_reg(c, 2), 2, rvc_reg(c, 7), rvc_lw_imm(c));
+}
 
+static uint32_t rvc_sw(uint32_t c)
+{
+	return rv_s(2, rvc_reg(c, 7), rvc_reg(c, 2), rvc_lw_imm(c));
 }
 
-static void inst_ecall_ebreak(struct vm *vm, uint32_t inst)
+static uint32_t rvc_addi(uint32_t c)
 {
-	printf("ECALL EBREAK\n");
+	int rd = bit_cut(c, 7, 5);
 
+	return rv_i(RV32_LOGIC_I_TYPE, rd, 0, rd, rvc_imm6(c));
 }
 
-#if 0
-static void inst_lwu(struct vm *vm, uint32_t inst)
+static uint32_t rvc_jal(uint32_t c)
 {
-	printf("LWU\n");
+	return rv_j(1, rvc_j_imm(c));
+}
 
+static uint32_t rvc_li(uint32_t c)
+{
+	return rv_i(RV32_LOGIC_I_TYPE, bit_cut(c, 7, 5), 0, 0, rvc_imm6(c));
 }
 
-static void inst_ld(struct vm *vm, uint32_t inst)
+static uint32_t rvc_addi16sp_lui(uint32_t c)
 {
-	printf("LD\n");
+	int rd = bit_cut(c, 7, 5);
+	int32_t imm;
 
+	if (rd == 2) {
+		imm = sign_extend((bit_check(c, 12) << 9) | (bit_cut(c, 3, 2) << 7) |
+				  (bit_check(c, 5) << 6) | (bit_check(c, 2) << 5) |
+				  (bit_check(c, 6) << 4), 10);
+		return imm ? rv_i(RV32_LOGIC_I_TYPE, 2, 0, 2, imm) : 0;
+	}
+
+	imm = rvc_imm6(c);
+	if (!imm)
+		return 0;
+
+	return ((uint32_t)imm << 12) | (rd << 7) | RV32_LUI;
+}
+
+static uint32_t rvc_alops1(uint32_t c)
+{
+	static const int funct3[] = { 0x0, 0x4, 0x6, 0x7 };	/* sub, xor, or, and */
+	int rd = rvc_reg(c, 7);
+
+	switch (bit_cut(c, 10, 2)) {
+	case 0:
+	case 1:
+		/* c.srli/c.srai, shamt[5] must be clear on RV32 */
+		if (bit_check(c, 12))
+			return 0;
+		return rv_i(RV32_LOGIC_I_TYPE, rd, 5, rd,
+			    (bit_check(c, 10) << 10) | bit_cut(c, 2, 5));
+	case 2:
+		return rv_i(RV32_LOGIC_I_TYPE, rd, 7, rd, rvc_imm6(c));
+	default:
+		/* c.subw/c.addw are RV64 only */
+		if (bit_check(c, 12))
+			return 0;
+		return rv_r(RV32_LOGIC_R_TYPE, rd, funct3[bit_cut(c, 5, 2)], rd, rvc_reg(c, 2),
+			    bit_cut(c, 5, 2) ? 0 : 0x20);
+	}
 }
 
-static void inst_sd(struct vm *vm, uint32_t inst)
+static uint32_t rvc_j(uint32_t c)
 {
-	printf("SD\n");
-
+	return rv_j(0, rvc_j_imm(c));
 }
 
-static void inst_addiw(struct vm *vm, uint32_t inst)
+static uint32_t rvc_beqz(uint32_t c)
 {
-	printf("ADDIW\n");
+	return rv_b(0, rvc_reg(c, 7), 0, rvc_b_imm(c));
+}
 
+static uint32_t rvc_bnez(uint32_t c)
+{
+	return rv_b(1, rvc_reg(c, 7), 0, rvc_b_imm(c));
 }
 
-static void inst_slliw(struct vm *vm, uint32_t inst)
+static uint32_t rvc_slli(uint32_t c)
 {
-	printf("SLLIW\n");
+	int rd = bit_cut(c, 7, 5);
 
+	if (bit_check(c, 12))
+		return 0;
+
+	return rv_i(RV32_LOGIC_I_TYPE, rd, 1, rd, bit_cut(c, 2, 5));
 }
 
-static void inst_srliw_sraiw(struct vm *vm, uint32_t inst)
+static uint32_t rvc_lwsp(uint32_t c)
 {
-	int funct7;
+	int rd = bit_cut(c, 7, 5);
+	int32_t imm = (bit_cut(c, 2, 2) << 6) | (bit_check(c, 12) << 5) | (bit_cut(c, 4, 3) << 2);
 
-	funct7 = (inst >> 25) & 0xFF;
+	if (!rd)
+		return 0;
 
-	if (funct7 == 0x20) {
-		printf("SRAIW\n");
-	} else {
-		printf("SRLIW\n");
-	}
+	return rv_i(RV32_LOAD_I_TYPE, rd, 2, 2, imm);
 }
 
-static void inst_addw_subw(struct vm *vm, uint32_t inst)
+static uint32_t rvc_alops2(uint32_t c)
 {
-	int funct7;
-
-	funct7 = (inst >> 25) & 0xFF;
+	int rd = bit_cut(c, 7, 5);
+	int rs2 = bit_cut(c, 2, 5);
 
-	if (funct7 == 0x20) {
-		printf("SUBW\n");
-	} else {
-		printf("ADDW\n");
+	if (!bit_check(c, 12)) {
+		if (rs2)
+			return rv_r(RV32_LOGIC_R_TYPE, rd, 0, 0, rs2, 0);		/* c.mv */
+		return rd ? rv_i(RV32_JALR, 0, 0, rd, 0) : 0;			/* c.jr */
 	}
+
+	if (rs2)
+		return rv_r(RV32_LOGIC_R_TYPE, rd, 0, rd, rs2, 0);		/* c.add */
+	if (rd)
+		return rv_i(RV32_JALR, 1, 0, rd, 0);				/* c.jalr */
+
+	return rv_i(RV32_ECALL_EBREAK, 0, 0, 0, 1);				/* c.ebreak */
 }
 
-static void inst_sllw(struct vm *vm, uint32_t inst)
+static uint32_t rvc_swsp(uint32_t c)
 {
-	printf("SLLW\n");
+	int32_t imm = (bit_cut(c, 7, 2) << 6) | (bit_cut(c, 9, 4) << 2);
 
+	return rv_s(2, 2, bit_cut(c, 2, 5), imm);
 }
 
-static void inst_srlw_sraw(struct vm *vm, uint32_t inst)
+/*
+ * Map an instruction to its inst_opcodes[] slot: bits [4:0] are the major
+ * opcode without its two low bits, bits [7:5] funct3, bit 8 the funct7
+ * alternate bit (SUB, SRA, SRAI) and bit 9 the RV32M funct7 bit. Returns
+ * -1 for opcodes we do not handle.
+ */
+int inst_opcode_index(uint32_t inst)
 {
-	int funct7;
+	int funct3 = (inst >> 12) & 0x7;
+	int opcode = (inst & RV_OPCODE_MASK) >> 2;
 
-	funct7 = (inst >> 25) & 0xFF;
-
-	if (funct7 == 0x20) {
-		printf("SRAW\n");
-	} else {
-		printf("SRLW\n");
+	switch (inst & RV_OPCODE_MASK) {
+	case RV32_LOGIC_R_TYPE:
+			return (bit_check(inst, 25) << 9) | (bit_check(inst, 30) << 8) |
+				(funct3 << 5) | opcode;
+	case RV32_LOGIC_I_TYPE:
+			if (funct3 == 0x5)
+				return (bit_check(inst, 30) << 8) | (funct3 << 5) | opcode;
+			/* fallthrough */
+	case RV32_LOAD_I_TYPE:
+	case RV32_STORE_S_TYPE:
+	case RV32_BRANCH_B_TYPE:
+			return (funct3 << 5) | opcode;
+	case RV32_FENCE:
+	case RV32_ECALL_EBREAK:
+	case RV32_AUPIC:
+	case RV32_LUI:
+	case RV32_JALR:
+	case RV32_JAL:
+			return opcode;
 	}
 
+	return -1;
 }
 
-static void inst_pseudo_li(struct vm *vm, uint32_t inst)
+/* The variant of the index handler for the operands of d, see INST_VARIANTS(). */
+static inst_handler_t inst_select(const struct inst_decoded *d, int index)
 {
-	printf("PSEUDO LI\n");
-}
+	const struct inst_variants *v = &inst_variants[index];
+	int b_zero;
 
-static void inst_pseudo_addi(struct vm *vm, uint32_t inst)
-{
-	printf("PSEUDO ADDI\n");
+	if ((d->inst & RV_OPCODE_MASK) == RV32_LOGIC_I_TYPE)
+		b_zero = !d->imm;
+	else
+		b_zero = !d->rs2;
+
+	if (v->rd_zero && !d->rd)
+		return v->rd_zero;
+	if (v->a_zero && !d->rs1)
+		return v->a_zero;
+	if (v->b_zero && b_zero)
+		return v->b_zero;
+
+	return inst_opcodes[index];
 }
-#endif
 
-void inst_execute(struct vm *vm, int inst)
+void inst_decode(struct inst_decoded *d, uint32_t inst, uint32_t pc)
 {
-	int opcode;
-	int funct3;
+	int index = inst_opcode_index(inst);
 
-#if 0
-	if ((inst & RV_OPCODE_MASK) != RV_OPCODE_MASK) {
-		inst_pseudo_opcodes[opcode](vm, inst);
-	}
-#endif
+	d->inst = inst;
+	d->len = 4;
+	d->rd = bit_cut(inst, 7, 5);
+	d->rs1 = bit_cut(inst, 15, 5);
+	d->rs2 = bit_cut(inst, 20, 5);
+	d->imm = 0;
+	d->target = 0;
 
-	switch (inst & RV_OPCODE_MASK) {
-	case RV32_LOAD_I_TYPE:
-			funct3 = (inst >> 12) & 0x7;
-			opcode = (funct3 << 5) | ((inst & RV_OPCODE_MASK) >> 2);
+	d->handler = (index < 0) ? NULL : inst_opcodes[index];
+	if (!d->handler)
+		d->handler = inst ? inst_unknown : inst_halt;
 
-			inst_opcodes[opcode](vm, inst);
+	switch (inst & RV_OPCODE_MASK) {
+	case RV32_LUI:
+			d->imm = inst & 0xFFFFF000;
 			break;
-	case RV32_FENCE:
-			opcode = ((inst & RV_OPCODE_MASK) >> 2);
-
-			inst_opcodes[opcode](vm, inst);
+	case RV32_AUPIC:
+			d->imm = pc + (inst & 0xFFFFF000);
 			break;
-	case RV32_ECALL_EBREAK:
-			opcode = ((inst & RV_OPCODE_MASK) >> 2);
-
-			inst_opcodes[opcode](vm, inst);
+	case RV32_JAL:
+			d->target = pc + decode_jal_imm(inst);
+			break;
+	case RV32_BRANCH_B_TYPE:
+			d->target = pc + decode_branch_imm(inst);
+			break;
+	case RV32_STORE_S_TYPE:
+			d->imm = decode_s_imm(inst);
 			break;
 	case RV32_LOGIC_I_TYPE:
-			funct3 = (inst >> 12) & 0x7;
-			opcode = (funct3 << 5) | ((inst & RV_OPCODE_MASK) >> 2);
-
-			inst_opcodes[opcode](vm, inst);
+			if (((inst >> 12) & 0x7) == 0x1 || ((inst >> 12) & 0x7) == 0x5)
+				d->imm = d->rs2;	/* shamt of SLLI/SRLI/SRAI */
+			else
+				d->imm = decode_i_imm(inst);
 			break;
-	case RV32_AUPIC:
-			opcode = ((inst & RV_OPCODE_MASK) >> 2);
-
-			inst_opcodes[opcode](vm, inst);
+	case RV32_LOAD_I_TYPE:
+	case RV32_JALR:
+			d->imm = decode_i_imm(inst);
 			break;
-#if 0
-	case RV64_LOGIC_I_TYPE:
-			funct3 = (inst >> 12) & 0x7;
-			opcode = (funct3 << 5) | ((inst & RV_OPCODE_MASK) >> 2);
+	}
 
-			inst_opcodes[opcode](vm, inst);
-			break;
-#endif
-	case RV32_STORE_S_TYPE:
-			funct3 = (inst >> 12) & 0x7;
-			opcode = (funct3 << 5) | ((inst & RV_OPCODE_MASK) >> 2);
+	if (index >= 0 && inst_opcodes[index])
+		d->handler = inst_select(d, index);
+}
 
-			inst_opcodes[opcode](vm, inst);
-			break;
-	case RV32_LOGIC_R_TYPE:
-			funct3 = (inst >> 12) & 0x7;
-			opcode = (funct3 << 5) | ((inst & RV_OPCODE_MASK) >> 2);
+/*
+ * Decode what starts at pc, bits being the 32 bits found there: 16-bit
+ * aligned and possibly a compressed instruction. A zero word still halts.
+ */
+void inst_decode_fetched(struct inst_decoded *d, uint32_t bits, uint32_t pc)
+{
+	uint32_t c = bits & 0xFFFF;
+	inst_expand_t expand;
+	uint32_t inst = 0;
 
-			inst_opcodes[opcode](vm, inst);
-			break;
-	case RV32_LUI:
-			opcode = ((inst & RV_OPCODE_MASK) >> 2);
+	if ((c & 0x3) == 0x3 || !bits) {
+		inst_decode(d, bits, pc);
+		return;
+	}
 
-			inst_opcodes[opcode](vm, inst);
-			break;
-#if 0
-	case RV64_LOGIC_R_TYPE:
-			funct3 = (inst >> 12) & 0x7;
-			opcode = (funct3 << 5) | ((inst & RV_OPCODE_MASK) >> 2);
+	expand = inst_pseudo_opcodes[((c >> 13) << 2) | (c & 0x3)];
+	if (expand)
+		inst = expand(c);
 
-			inst_opcodes[opcode](vm, inst);
-			break;
-#endif
-	case RV32_BRANCH_B_TYPE:
-			opcode = ((inst & RV_OPCODE_MASK) >> 2);
+	if (inst) {
+		inst_decode(d, inst, pc);
+	} else {
+		/* keep the 16 bits, which no 32-bit opcode matches */
+		inst_decode(d, c, pc);
+		d->handler = inst_unknown;
+	}
 
-			inst_opcodes[opcode](vm, inst);
-			break;
-	case RV32_JALR:
-			opcode = ((inst & RV_OPCODE_MASK) >> 2);
+	d->len = 2;
+}
 
-			inst_opcodes[opcode](vm, inst);
-			break;
-	case RV32_JAL:
-			opcode = ((inst & RV_OPCODE_MASK) >> 2);
+void inst_execute(struct vm *vm, int inst)
+{
+	struct inst_decoded d;
+
+	/* the caller has already moved the pc past the instruction */
+	inst_decode(&d, inst, vm_read_pc(vm) - 4);
+
+	d.handler(vm, &d);
+}
+
+const char *const inst_fusion_names[VM_NR_FUSIONS] = {
+	[VM_FUSE_LUI_ADDI] = "lui+addi",
+	[VM_FUSE_AUIPC_JALR] = "auipc+jalr",
+	[VM_FUSE_AUIPC_LW] = "auipc+lw",
+	[VM_FUSE_SLT_BRANCH] = "slt+branch",
+	[VM_FUSE_ADDI_BNE] = "addi+bne",
+};
+
+/*
+ * Peephole over two decoded ops, n being the one right after d: returns
+ * the VM_FUSE_* kind the pair can run as, VM_FUSE_NONE if it cannot. Only
+ * pairs where n consumes what d produced are taken. Tracing wants to see
+ * every instruction, so nothing fuses then.
+ */
+int inst_fusion(const struct inst_decoded *d, const struct inst_decoded *n)
+{
+#ifdef CONFIG_TRACE
+	/* trace_exec() runs once per handler, the second op of a pair would go unrecorded */
+	return VM_FUSE_NONE;
+#else
+	int first = inst_opcode_index(d->inst);
+	int second = inst_opcode_index(n->inst);
+
+	/* both decoded instructions, d not fused already */
+	if (first < 0 || second < 0 || !d->rd || !inst_opcodes[first] || !inst_opcodes[second] ||
+	    d->handler == inst_unknown || n->handler == inst_unknown ||
+	    d->handler != inst_select(d, first))
+		return VM_FUSE_NONE;
+
+	switch (first) {
+	case RV32I_LUI:
+		if (second == RV32I_ADDI && n->rs1 == d->rd && n->rd == d->rd)
+			return VM_FUSE_LUI_ADDI;
+		break;
+	case RV32I_AUIPC:
+		if (second == RV32I_JALR && n->rs1 == d->rd)
+			return VM_FUSE_AUIPC_JALR;
+		if (second == RV32I_LW && n->rs1 == d->rd)
+			return VM_FUSE_AUIPC_LW;
+		break;
+	case RV32I_SLT:
+	case RV32I_SLTU:
+	case RV32I_SLTI:
+	case RV32I_SLTIU:
+		if ((second == RV32I_BEQ || second == RV32I_BNE) &&
+		    n->rs1 == d->rd && !n->rs2)
+			return VM_FUSE_SLT_BRANCH;
+		break;
+	case RV32I_ADDI:
+		if (second == RV32I_BNE && d->rs1 == d->rd &&
+		    (n->rs1 == d->rd || n->rs2 == d->rd))
+			return VM_FUSE_ADDI_BNE;
+		break;
+	}
 
-			inst_opcodes[opcode](vm, inst);
-			break;
+	return VM_FUSE_NONE;
+#endif
+}
+
+/* Make d, the first op of a pair inst_fusion() found, run the pair. */
+void inst_fuse(struct inst_decoded *d, int kind)
+{
+	switch (kind) {
+	case VM_FUSE_LUI_ADDI:
+		d->handler = inst_lui_addi;
+		break;
+	case VM_FUSE_AUIPC_JALR:
+		d->handler = inst_auipc_jalr;
+		break;
+	case VM_FUSE_AUIPC_LW:
+		d->handler = inst_auipc_lw;
+		break;
+	case VM_FUSE_SLT_BRANCH:
+		switch (inst_opcode_index(d->inst)) {
+		case RV32I_SLT:		d->handler = inst_slt_branch; break;
+		case RV32I_SLTU:	d->handler = inst_sltu_branch; break;
+		case RV32I_SLTI:	d->handler = inst_slti_branch; break;
+		case RV32I_SLTIU:	d->handler = inst_sltiu_branch; break;
+		}
+		break;
+	case VM_FUSE_ADDI_BNE:
+		d->handler = inst_addi_bne;
+		break;
 	}
 }
 
-void inst_init(struct vm *vm)
+/* The handler running d alone, for engines going one instruction at a time. */
+inst_handler_t inst_single_handler(const struct inst_decoded *d)
+{
+	int index = inst_opcode_index(d->inst);
+
+	if (d->handler == inst_unknown || d->handler == inst_halt || index < 0)
+		return d->handler;
+
+	return inst_select(d, index);
+}
+
+/*
+ * The handler inst_decode() gives d, from its other fields only: for ops
+ * saved without their handler. Fusion is left to the caller.
+ */
+inst_handler_t inst_decoded_handler(const struct inst_decoded *d)
+{
+	int index = inst_opcode_index(d->inst);
+
+	if (index >= 0 && inst_opcodes[index])
+		return inst_select(d, index);
+
+	/* a compressed op is never a halt, not even a zero one */
+	return d->inst || d->len == 2 ? inst_unknown : inst_halt;
+}
+
+#define INST_INSTALL_ALU(name, opcode) do {				\
+	inst_install_opcode(inst_##name, opcode);			\
+	inst_install_variants(opcode, inst_nop, inst_##name##_az,	\
+			      inst_##name##_bz);			\
+} while (0)
+
+#define INST_INSTALL_BRANCH(name, opcode) do {				\
+	inst_install_opcode(inst_##name, opcode);			\
+	inst_install_variants(opcode, NULL, inst_##name##_az,		\
+			      inst_##name##_bz);			\
+} while (0)
+
+static void inst_install_opcodes(void)
 {
 	inst_install_opcode(inst_lui, RV32I_LUI);
+	inst_install_variants(RV32I_LUI, inst_nop, NULL, NULL);
 	inst_install_opcode(inst_auipc, RV32I_AUIPC);
+	inst_install_variants(RV32I_AUIPC, inst_nop, NULL, NULL);
 	inst_install_opcode(inst_jal, RV32I_JAL);
-	inst_install_opcode(inst_slli, RV32I_SLLI);
-	inst_install_opcode(inst_srli_srai, RV32I_SRLI_SRAI);
-	inst_install_opcode(inst_add_sub, RV32I_ADD_SUB);
-	inst_install_opcode(inst_sll, RV32I_SLL);
-	inst_install_opcode(inst_slt, RV32I_SLT);
-	inst_install_opcode(inst_sltu, RV32I_SLTU);
-	inst_install_opcode(inst_xor, RV32I_XOR);
-	inst_install_opcode(inst_srl_sra, RV32I_SRL_SRA);
-	inst_install_opcode(inst_or, RV32I_OR);
-	inst_install_opcode(inst_and, RV32I_AND);
+	inst_install_variants(RV32I_JAL, inst_jal_nolink, NULL, NULL);
+	INST_INSTALL_ALU(slli, RV32I_SLLI);
+	INST_INSTALL_ALU(srli, RV32I_SRLI_SRAI);
+	INST_INSTALL_ALU(srai, RV32I_SRAI);
+	INST_INSTALL_ALU(add, RV32I_ADD_SUB);
+	INST_INSTALL_ALU(sub, RV32I_SUB);
+	INST_INSTALL_ALU(sll, RV32I_SLL);
+	INST_INSTALL_ALU(slt, RV32I_SLT);
+	INST_INSTALL_ALU(sltu, RV32I_SLTU);
+	INST_INSTALL_ALU(xor, RV32I_XOR);
+	INST_INSTALL_ALU(srl, RV32I_SRL_SRA);
+	INST_INSTALL_ALU(sra, RV32I_SRA);
+	INST_INSTALL_ALU(or, RV32I_OR);
+	INST_INSTALL_ALU(and, RV32I_AND);
 	inst_install_opcode(inst_jalr, RV32I_JALR);
-	inst_install_opcode(inst_beq, RV32I_BEQ);
-	inst_install_opcode(inst_bne, RV32I_BNE);
-	inst_install_opcode(inst_blt, RV32I_BLT);
-	inst_install_opcode(inst_bge, RV32I_BGE);
-	inst_install_opcode(inst_bltu, RV32I_BLTU);
-	inst_install_opcode(inst_bgeu, RV32I_BGEU);
+	inst_install_variants(RV32I_JALR, inst_jalr_nolink, NULL, NULL);
+	INST_INSTALL_BRANCH(beq, RV32I_BEQ);
+	INST_INSTALL_BRANCH(bne, RV32I_BNE);
+	INST_INSTALL_BRANCH(blt, RV32I_BLT);
+	INST_INSTALL_BRANCH(bge, RV32I_BGE);
+	INST_INSTALL_BRANCH(bltu, RV32I_BLTU);
+	INST_INSTALL_BRANCH(bgeu, RV32I_BGEU);
 	inst_install_opcode(inst_lb, RV32I_LB);
 	inst_install_opcode(inst_lh, RV32I_LH);
 	inst_install_opcode(inst_lw, RV32I_LW);
@@ -716,12 +913,20 @@ void inst_init(struct vm *vm)
 	inst_install_opcode(inst_sb, RV32I_SB);
 	inst_install_opcode(inst_sh, RV32I_SH);
 	inst_install_opcode(inst_sw, RV32I_SW);
-	inst_install_opcode(inst_addi, RV32I_ADDI);
-	inst_install_opcode(inst_slti, RV32I_SLTI);
-	inst_install_opcode(inst_sltiu, RV32I_SLTIU);
-	inst_install_opcode(inst_xori, RV32I_XORI);
-	inst_install_opcode(inst_ori, RV32I_ORI);
-	inst_install_opcode(inst_andi, RV32I_ANDI);
+	INST_INSTALL_ALU(addi, RV32I_ADDI);
+	INST_INSTALL_ALU(slti, RV32I_SLTI);
+	INST_INSTALL_ALU(sltiu, RV32I_SLTIU);
+	INST_INSTALL_ALU(xori, RV32I_XORI);
+	INST_INSTALL_ALU(ori, RV32I_ORI);
+	INST_INSTALL_ALU(andi, RV32I_ANDI);
+	INST_INSTALL_ALU(mul, RV32M_MUL);
+	INST_INSTALL_ALU(mulh, RV32M_MULH);
+	INST_INSTALL_ALU(mulhsu, RV32M_MULHSU);
+	INST_INSTALL_ALU(mulhu, RV32M_MULHU);
+	INST_INSTALL_ALU(div, RV32M_DIV);
+	INST_INSTALL_ALU(divu, RV32M_DIVU);
+	INST_INSTALL_ALU(rem, RV32M_REM);
+	INST_INSTALL_ALU(remu, RV32M_REMU);
 #if 0
 	inst_install_opcode(inst_addiw, RV64I_ADDIW);
 	inst_install_opcode(inst_slliw, RV64I_SLLIW);
@@ -736,8 +941,31 @@ void inst_init(struct vm *vm)
 	inst_install_opcode(inst_ecall_ebreak, RV32I_ECALL_EBREAK);
 	inst_install_opcode(inst_fence, RV32I_FENCE);
 
-#if 0
-	inst_install_pseudo_opcode(inst_pseudo_addi, RVC_ADDI);
-	inst_install_pseudo_opcode(inst_pseudo_li, RVC_LI);
-#endif
+
+	inst_install_pseudo_opcode(rvc_addi4spn, RVC_ADDI4SPN);
+	inst_install_pseudo_opcode(rvc_lw, RVC_LW);
+	inst_install_pseudo_opcode(rvc_sw, RVC_SW);
+	inst_install_pseudo_opcode(rvc_addi, RVC_ADDI);
+	inst_install_pseudo_opcode(rvc_jal, RVC_JAL);
+	inst_install_pseudo_opcode(rvc_li, RVC_LI);
+	inst_install_pseudo_opcode(rvc_addi16sp_lui, RVC_ADDI16SP_LUI);
+	inst_install_pseudo_opcode(rvc_alops1, RVC_ALOPS1);
+	inst_install_pseudo_opcode(rvc_j, RVC_J);
+	inst_install_pseudo_opcode(rvc_beqz, RVC_BEQZ);
+	inst_install_pseudo_opcode(rvc_bnez, RVC_BNEZ);
+	inst_install_pseudo_opcode(rvc_slli, RVC_SLLI);
+	inst_install_pseudo_opcode(rvc_lwsp, RVC_LWSP);
+	inst_install_pseudo_opcode(rvc_alops2, RVC_ALOPS2);
+	inst_install_pseudo_opcode(rvc_swsp, RVC_SWSP);
+}
+
+/*
+ * The opcode table is shared by every vm and only written once, so vms can
+ * be created from several threads.
+ */
+void inst_init(struct vm *vm)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, inst_install_opcodes);
 }
@@ -0,0 +1,988 @@
+#include <sys/mman.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vm.h>
+#include <inst.h>
+#include <icache.h>
+#include <mm.h>
+#include <sizes.h>
+
+/*
+ * Basic-block translator to x86-64. A block runs from its entry PC up to
+ * and including the first JAL/JALR/branch, or stops right before an
+ * instruction it does not cover; such instructions are executed by the
+ * interpreter. Guest registers stay in struct vm (rbx points to it), r12
+ * holds the flat guest space, or the bus page table without BUS_FLAT, for
+ * inline loads/stores, a block returns the next guest PC in eax.
+ *
+ * Exits to a static PC (JAL, both ways out of a branch, falling through)
+ * end in a jmp that first goes to the return path, which also hands back
+ * where that jmp is in rdx. Once the block at the PC has been compiled,
+ * vm_run_jit() points the jmp at it, past its frame setup, and from then
+ * on the exit goes block to block without a lookup. Blocks are only ever
+ * discarded all at once, their links go along with them.
+ */
+
+#define JIT_CODE_SIZE		SZ_4M
+#define JIT_BLOCK_MAX_INSTS	64
+#define JIT_BLOCK_MAX_BYTES	(JIT_BLOCK_MAX_INSTS * 128)
+
+/* marks a PC whose first instruction has to go through the interpreter */
+#define JIT_INTERP		((jit_block_t)1)
+
+/* returned in eax and rdx: the next PC, and the exit to link to it if any */
+struct jit_exit {
+	uint32_t pc;
+	uint8_t *link;
+};
+
+typedef struct jit_exit (*jit_block_t)(struct vm *vm);
+
+struct jit {
+	uint8_t *code;
+	uint8_t *cur;
+	jit_block_t *blocks;
+	int nr_blocks;
+	int frame_len;		/* bytes of frame setup a linked exit skips */
+	uint8_t *link;		/* rel32 of the exit taken last, if linkable */
+};
+
+#if defined(__x86_64__)
+
+enum {
+	EAX = 0,
+	ECX = 1,
+	EDX = 2,
+	EBX = 3,
+	ESI = 6,
+	EDI = 7,
+};
+
+/* x86 condition codes, used by setcc/cmovcc */
+enum {
+	CC_B = 0x2,
+	CC_AE = 0x3,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_L = 0xC,
+	CC_GE = 0xD,
+};
+
+static inline void emit8(uint8_t **p, uint8_t b)
+{
+	*(*p)++ = b;
+}
+
+static inline void emit32(uint8_t **p, uint32_t v)
+{
+	memcpy(*p, &v, sizeof(v));
+	*p += sizeof(v);
+}
+
+static inline void emit64(uint8_t **p, uint64_t v)
+{
+	memcpy(*p, &v, sizeof(v));
+	*p += sizeof(v);
+}
+
+/* modrm for [rbx + disp] */
+static void emit_rbx_mem(uint8_t **p, int reg, int32_t disp)
+{
+	if (disp >= -128 && disp < 128) {
+		emit8(p, 0x40 | (reg << 3) | EBX);
+		emit8(p, disp);
+	} else {
+		emit8(p, 0x80 | (reg << 3) | EBX);
+		emit32(p, disp);
+	}
+}
+
+static int32_t guest_reg_offset(int reg)
+{
+	return offsetof(struct vm, cpu.regs) + reg * sizeof(uint32_t);
+}
+
+/* mov host, xN */
+static void emit_load_reg(uint8_t **p, int host, int reg)
+{
+	if (!reg) {
+		/* xor host, host */
+		emit8(p, 0x31);
+		emit8(p, 0xC0 | (host << 3) | host);
+		return;
+	}
+
+	emit8(p, 0x8B);
+	emit_rbx_mem(p, host, guest_reg_offset(reg));
+}
+
+/* mov xN, host */
+static void emit_store_reg(uint8_t **p, int reg, int host)
+{
+	if (!reg)
+		return;
+
+	emit8(p, 0x89);
+	emit_rbx_mem(p, host, guest_reg_offset(reg));
+}
+
+/* mov xN, imm32 */
+static void emit_store_reg_imm(uint8_t **p, int reg, uint32_t imm)
+{
+	if (!reg)
+		return;
+
+	emit8(p, 0xC7);
+	emit_rbx_mem(p, 0, guest_reg_offset(reg));
+	emit32(p, imm);
+}
+
+/* mov host, imm32 */
+static void emit_mov_imm(uint8_t **p, int host, uint32_t imm)
+{
+	emit8(p, 0xB8 + host);
+	emit32(p, imm);
+}
+
+/* <op> eax, imm32 with op one of add/or/and/xor/cmp (/digit) */
+static void emit_alu_eax_imm(uint8_t **p, int digit, uint32_t imm)
+{
+	emit8(p, 0x05 | (digit << 3));
+	emit32(p, imm);
+}
+
+/* <op> eax, ecx with op given by its "r/m, reg" opcode */
+static void emit_alu_eax_ecx(uint8_t **p, uint8_t opcode)
+{
+	emit8(p, opcode);
+	emit8(p, 0xC0 | (ECX << 3) | EAX);
+}
+
+/* shl/shr/sar eax by imm8 (digit 4/5/7) */
+static void emit_shift_imm(uint8_t **p, int digit, uint8_t imm)
+{
+	emit8(p, 0xC1);
+	emit8(p, 0xC0 | (digit << 3) | EAX);
+	emit8(p, imm);
+}
+
+/* shl/shr/sar eax by cl (digit 4/5/7) */
+static void emit_shift_cl(uint8_t **p, int digit)
+{
+	emit8(p, 0xD3);
+	emit8(p, 0xC0 | (digit << 3) | EAX);
+}
+
+/* setcc al; movzx eax, al */
+static void emit_setcc(uint8_t **p, int cc)
+{
+	emit8(p, 0x0F);
+	emit8(p, 0x90 | cc);
+	emit8(p, 0xC0);
+	emit8(p, 0x0F);
+	emit8(p, 0xB6);
+	emit8(p, 0xC0);
+}
+
+static void emit_prologue(uint8_t **p)
+{
+	/* push rbx; push r12; sub rsp, 8 (keeps calls 16-byte aligned) */
+	emit8(p, 0x53);
+	emit8(p, 0x41);
+	emit8(p, 0x54);
+	emit8(p, 0x48);
+	emit8(p, 0x83);
+	emit8(p, 0xEC);
+	emit8(p, 0x08);
+
+	/* mov rbx, rdi */
+	emit8(p, 0x48);
+	emit8(p, 0x89);
+	emit8(p, 0xFB);
+
+	/* mov r12, [rbx + bus.base] or [rbx + bus.pages] */
+	emit8(p, 0x4C);
+	emit8(p, 0x8B);
+#ifdef BUS_FLAT
+	emit_rbx_mem(p, 4, offsetof(struct vm, bus.base));
+#else
+	emit_rbx_mem(p, 4, offsetof(struct vm, bus.pages));
+#endif
+}
+
+/* charge the instructions retired on the way to an exit */
+static void emit_count(uint8_t **p, int count)
+{
+	/* add qword [rbx + icount], count */
+	emit8(p, 0x48);
+	emit8(p, 0x81);
+	emit_rbx_mem(p, 0, offsetof(struct vm, icount));
+	emit32(p, count);
+}
+
+static void emit_epilogue(uint8_t **p)
+{
+	/* add rsp, 8; pop r12; pop rbx; ret */
+	emit8(p, 0x48);
+	emit8(p, 0x83);
+	emit8(p, 0xC4);
+	emit8(p, 0x08);
+	emit8(p, 0x41);
+	emit8(p, 0x5C);
+	emit8(p, 0x5B);
+	emit8(p, 0xC3);
+}
+
+/* return to vm_run_jit(), nothing to link */
+static void emit_return(uint8_t **p)
+{
+	/* xor edx, edx */
+	emit8(p, 0x31);
+	emit8(p, 0xD2);
+	emit_epilogue(p);
+}
+
+/*
+ * Leave for pc once count instructions retired, through a jmp that
+ * vm_run_jit() links to the block at pc.
+ */
+static void emit_exit(uint8_t **p, uint32_t pc, int count)
+{
+	emit_count(p, count);
+	emit_mov_imm(p, EAX, pc);
+
+	/* a halted vm goes back to vm_run_jit() even once linked */
+	/* cmp dword [rbx + halted], 0; jne unlinked */
+	emit8(p, 0x83);
+	emit_rbx_mem(p, 7, offsetof(struct vm, halted));
+	emit8(p, 0x00);
+	emit8(p, 0x75);
+	emit8(p, 5);
+
+	/* jmp unlinked, until linked */
+	emit8(p, 0xE9);
+	emit32(p, 0);
+
+	/* unlinked: lea rdx, [rip - 11], the rel32 of the jmp */
+	emit8(p, 0x48);
+	emit8(p, 0x8D);
+	emit8(p, 0x15);
+	emit32(p, -11);
+
+	emit_epilogue(p);
+}
+
+/*
+ * A bus access that faulted halted the vm: leave at the access, which is
+ * counted as the interpreter counts it, before anything after it runs.
+ */
+static void emit_halted_check(uint8_t **p, uint32_t pc, int count)
+{
+	uint8_t *je;
+
+	/* cmp dword [rbx + halted], 0; je done */
+	emit8(p, 0x83);
+	emit_rbx_mem(p, 7, offsetof(struct vm, halted));
+	emit8(p, 0x00);
+	emit8(p, 0x74);
+	je = *p;
+	emit8(p, 0);
+
+	emit_count(p, count);
+	emit_mov_imm(p, EAX, pc);
+	emit_return(p);
+
+	*je = *p - (je + 1);
+}
+
+/* call helper(vm, esi, edx), the result lands in eax */
+static void emit_call(uint8_t **p, void *helper)
+{
+	/* mov rdi, rbx */
+	emit8(p, 0x48);
+	emit8(p, 0x89);
+	emit8(p, 0xDF);
+
+	/* mov rax, helper; call rax */
+	emit8(p, 0x48);
+	emit8(p, 0xB8);
+	emit64(p, (uint64_t)helper);
+	emit8(p, 0xFF);
+	emit8(p, 0xD0);
+}
+
+/* esi = xN + imm */
+static void emit_address(uint8_t **p, int reg, int32_t imm)
+{
+	emit_load_reg(p, ESI, reg);
+
+	if (imm) {
+		/* add esi, imm32 */
+		emit8(p, 0x81);
+		emit8(p, 0xC0 | ESI);
+		emit32(p, imm);
+	}
+}
+
+static int jit_lb(struct vm *vm, uint32_t addr)
+{
+	return bus_read_s8(&vm->bus, addr);
+}
+
+static int jit_lh(struct vm *vm, uint32_t addr)
+{
+	return bus_read_s16(&vm->bus, addr);
+}
+
+static int jit_lw(struct vm *vm, uint32_t addr)
+{
+	return bus_read_u32(&vm->bus, addr);
+}
+
+static int jit_lbu(struct vm *vm, uint32_t addr)
+{
+	return bus_read_u8(&vm->bus, addr);
+}
+
+static int jit_lhu(struct vm *vm, uint32_t addr)
+{
+	return bus_read_u16(&vm->bus, addr);
+}
+
+static void jit_sb(struct vm *vm, uint32_t addr, uint32_t value)
+{
+	bus_write_u8(&vm->bus, addr, value);
+}
+
+static void jit_sh(struct vm *vm, uint32_t addr, uint32_t value)
+{
+	bus_write_u16(&vm->bus, addr, value);
+}
+
+static void jit_sw(struct vm *vm, uint32_t addr, uint32_t value)
+{
+	bus_write_u32(&vm->bus, addr, value);
+}
+
+/* opcode bytes of "<load> eax, <mem>" */
+static const uint8_t jit_load_ops[][2] = {
+	[0] = { 0x8B, 0x00 },	/* mov */
+	[1] = { 0x0F, 0xBE },	/* movsx byte */
+	[2] = { 0x0F, 0xB6 },	/* movzx byte */
+	[3] = { 0x0F, 0xBF },	/* movsx word */
+	[4] = { 0x0F, 0xB7 },	/* movzx word */
+};
+
+#ifdef BUS_FLAT
+
+/*
+ * Loads and stores are a single access to [r12 + rsi], anything but plain
+ * memory faults and is taken care of by bus_trap(), which knows these movs.
+ * Any of them may have been a guest fault once it returns. The helpers are
+ * only needed for the table.
+ */
+static void emit_load(uint8_t **p, struct inst_decoded *d, uint32_t pc, int count, int op,
+		      void *helper)
+{
+	emit_address(p, d->rs1, d->imm);
+
+	/* <load> eax, [r12 + rsi] */
+	emit8(p, 0x41);
+	emit8(p, jit_load_ops[op][0]);
+	if (jit_load_ops[op][1])
+		emit8(p, jit_load_ops[op][1]);
+	emit8(p, 0x04);
+	emit8(p, 0x34);
+
+	emit_store_reg(p, d->rd, EAX);
+	emit_halted_check(p, pc, count);
+}
+
+static void emit_store(uint8_t **p, struct inst_decoded *d, uint32_t pc, int count, int size,
+		       void *helper)
+{
+	emit_address(p, d->rs1, d->imm);
+	emit_load_reg(p, EDX, d->rs2);
+
+	/* mov [r12 + rsi], edx/dx/dl */
+	if (size == 2)
+		emit8(p, 0x66);
+	emit8(p, 0x41);
+	emit8(p, size == 1 ? 0x88 : 0x89);
+	emit8(p, 0x14);
+	emit8(p, 0x34);
+
+	emit_halted_check(p, pc, count);
+}
+
+#else
+
+static const int jit_load_sizes[] = { 4, 1, 1, 2, 2 };
+
+/*
+ * Inline bus fast path for a size byte access at the address in esi: look
+ * the page up in the table held in r12 and leave the host page in rax and
+ * the page offset in rcx. Accesses that run past the page take the slow
+ * path too. Sets where to patch the jumps to it in slow, NULL if unused.
+ */
+static void emit_bus_lookup(uint8_t **p, int right, int size, uint8_t *slow[2])
+{
+	/* mov eax, esi; shr eax, BUS_PAGE_SHIFT */
+	emit8(p, 0x89);
+	emit8(p, 0xF0);
+	emit8(p, 0xC1);
+	emit8(p, 0xE8);
+	emit8(p, BUS_PAGE_SHIFT);
+
+	/* mov rax, [r12 + rax * 8] */
+	emit8(p, 0x49);
+	emit8(p, 0x8B);
+	emit8(p, 0x04);
+	emit8(p, 0xC4);
+
+	/* test al, right; jz slow */
+	emit8(p, 0xA8);
+	emit8(p, right);
+	emit8(p, 0x74);
+	slow[0] = *p;
+	emit8(p, 0);
+
+	/* and rax, ~BUS_FLAGS_MASK */
+	emit8(p, 0x48);
+	emit8(p, 0x83);
+	emit8(p, 0xE0);
+	emit8(p, (uint8_t)~BUS_FLAGS_MASK);
+
+	/* mov ecx, esi; and ecx, BUS_PAGE_SIZE - 1 */
+	emit8(p, 0x89);
+	emit8(p, 0xF1);
+	emit8(p, 0x81);
+	emit8(p, 0xE1);
+	emit32(p, BUS_PAGE_SIZE - 1);
+
+	slow[1] = NULL;
+	if (size == 1)
+		return;
+
+	/* cmp ecx, BUS_PAGE_SIZE - size; ja slow */
+	emit8(p, 0x81);
+	emit8(p, 0xF9);
+	emit32(p, BUS_PAGE_SIZE - size);
+	emit8(p, 0x77);
+	slow[1] = *p;
+	emit8(p, 0);
+}
+
+/*
+ * Host access done: jump over the slow path, which calls helper, writes
+ * rd for loads (-1 for stores) and stops if the access faulted.
+ */
+static void emit_bus_slow(uint8_t **p, uint8_t *slow[2], void *helper, int rd, uint32_t pc,
+			  int count)
+{
+	uint8_t *jmp;
+
+	/* jmp done */
+	emit8(p, 0xEB);
+	jmp = *p;
+	emit8(p, 0);
+
+	for (int i = 0; i < 2; i++)
+		if (slow[i])
+			*slow[i] = *p - (slow[i] + 1);
+	emit_call(p, helper);
+	if (rd >= 0)
+		emit_store_reg(p, rd, EAX);
+	emit_halted_check(p, pc, count);
+	*jmp = *p - (jmp + 1);
+}
+
+static void emit_load(uint8_t **p, struct inst_decoded *d, uint32_t pc, int count, int op,
+		      void *helper)
+{
+	uint8_t *slow[2];
+
+	emit_address(p, d->rs1, d->imm);
+	emit_bus_lookup(p, BUS_READ, jit_load_sizes[op], slow);
+
+	emit8(p, jit_load_ops[op][0]);
+	if (jit_load_ops[op][1])
+		emit8(p, jit_load_ops[op][1]);
+	emit8(p, 0x04);
+	emit8(p, 0x08);
+
+	emit_bus_slow(p, slow, helper, d->rd, pc, count);
+	emit_store_reg(p, d->rd, EAX);
+}
+
+static void emit_store(uint8_t **p, struct inst_decoded *d, uint32_t pc, int count, int size,
+		       void *helper)
+{
+	uint8_t *slow[2];
+
+	emit_address(p, d->rs1, d->imm);
+	emit_load_reg(p, EDX, d->rs2);
+	emit_bus_lookup(p, BUS_WRITE, size, slow);
+
+	/* mov [rax + rcx], edx/dx/dl */
+	if (size == 2)
+		emit8(p, 0x66);
+	emit8(p, size == 1 ? 0x88 : 0x89);
+	emit8(p, 0x14);
+	emit8(p, 0x08);
+
+	emit_bus_slow(p, slow, helper, -1, pc, count);
+}
+
+#endif /* BUS_FLAT */
+
+static void emit_alu_imm(uint8_t **p, struct inst_decoded *d, int digit)
+{
+	if (!d->rd)
+		return;
+
+	emit_load_reg(p, EAX, d->rs1);
+	emit_alu_eax_imm(p, digit, d->imm);
+	emit_store_reg(p, d->rd, EAX);
+}
+
+static void emit_alu_reg(uint8_t **p, struct inst_decoded *d, uint8_t opcode)
+{
+	if (!d->rd)
+		return;
+
+	emit_load_reg(p, EAX, d->rs1);
+	emit_load_reg(p, ECX, d->rs2);
+	emit_alu_eax_ecx(p, opcode);
+	emit_store_reg(p, d->rd, EAX);
+}
+
+static void emit_shift(uint8_t **p, struct inst_decoded *d, int digit, int by_reg)
+{
+	if (!d->rd)
+		return;
+
+	emit_load_reg(p, EAX, d->rs1);
+
+	if (by_reg) {
+		emit_load_reg(p, ECX, d->rs2);
+		emit_shift_cl(p, digit);
+	} else {
+		emit_shift_imm(p, digit, d->imm);
+	}
+
+	emit_store_reg(p, d->rd, EAX);
+}
+
+static void emit_set(uint8_t **p, struct inst_decoded *d, int cc, int by_reg)
+{
+	if (!d->rd)
+		return;
+
+	emit_load_reg(p, EAX, d->rs1);
+
+	if (by_reg) {
+		emit_load_reg(p, ECX, d->rs2);
+		/* cmp eax, ecx */
+		emit_alu_eax_ecx(p, 0x39);
+	} else {
+		emit_alu_eax_imm(p, 7, d->imm);
+	}
+
+	emit_setcc(p, cc);
+	emit_store_reg(p, d->rd, EAX);
+}
+
+/* each way out gets its own exit, so that both can be linked */
+static void emit_branch(uint8_t **p, struct inst_decoded *d, uint32_t pc, int count, int cc)
+{
+	uint8_t *jcc;
+
+	emit_load_reg(p, EAX, d->rs1);
+	emit_load_reg(p, ECX, d->rs2);
+	/* cmp eax, ecx */
+	emit_alu_eax_ecx(p, 0x39);
+
+	/* jcc taken */
+	emit8(p, 0x70 | cc);
+	jcc = *p;
+	emit8(p, 0);
+
+	emit_exit(p, pc + d->len, count);
+
+	*jcc = *p - (jcc + 1);
+	emit_exit(p, d->target, count);
+}
+
+/* mul/imul ecx (digit 4/5): edx:eax = rs1 * rs2, rd takes the half in host */
+static void emit_mul(uint8_t **p, struct inst_decoded *d, int digit, int host)
+{
+	if (!d->rd)
+		return;
+
+	emit_load_reg(p, EAX, d->rs1);
+	emit_load_reg(p, ECX, d->rs2);
+
+	emit8(p, 0xF7);
+	emit8(p, 0xC0 | (digit << 3) | ECX);
+
+	emit_store_reg(p, d->rd, host);
+}
+
+static uint32_t jit_mulhsu(struct vm *vm, uint32_t a, uint32_t b)
+{
+	return rv32m_mulhsu(a, b);
+}
+
+static uint32_t jit_div(struct vm *vm, uint32_t a, uint32_t b)
+{
+	return rv32m_div(a, b);
+}
+
+static uint32_t jit_divu(struct vm *vm, uint32_t a, uint32_t b)
+{
+	return rv32m_divu(a, b);
+}
+
+static uint32_t jit_rem(struct vm *vm, uint32_t a, uint32_t b)
+{
+	return rv32m_rem(a, b);
+}
+
+static uint32_t jit_remu(struct vm *vm, uint32_t a, uint32_t b)
+{
+	return rv32m_remu(a, b);
+}
+
+/* rd = helper(vm, rs1, rs2), for what needs more than a host instruction */
+static void emit_alu_call(uint8_t **p, struct inst_decoded *d, void *helper)
+{
+	if (!d->rd)
+		return;
+
+	emit_load_reg(p, ESI, d->rs1);
+	emit_load_reg(p, EDX, d->rs2);
+	emit_call(p, helper);
+	emit_store_reg(p, d->rd, EAX);
+}
+
+/*
+ * Emit one instruction, the count-th of its block. Returns 1 if it ends
+ * the block, 0 if translation goes on and -1 if the instruction is not
+ * covered by the JIT.
+ */
+static int jit_emit_inst(uint8_t **p, struct inst_decoded *d, uint32_t pc, int count)
+{
+	switch (inst_opcode_index(d->inst)) {
+	case RV32I_LUI:
+	case RV32I_AUIPC:
+		emit_store_reg_imm(p, d->rd, d->imm);
+		return 0;
+	case RV32I_JAL:
+		emit_store_reg_imm(p, d->rd, pc + d->len);
+		emit_exit(p, d->target, count);
+		return 1;
+	case RV32I_JALR:
+		emit_load_reg(p, EAX, d->rs1);
+		emit_alu_eax_imm(p, 0, d->imm);
+		emit_alu_eax_imm(p, 4, ~(uint32_t)1);
+		emit_store_reg_imm(p, d->rd, pc + d->len);
+		emit_count(p, count);
+		emit_return(p);
+		return 1;
+	case RV32I_BEQ:
+		emit_branch(p, d, pc, count, CC_E);
+		return 1;
+	case RV32I_BNE:
+		emit_branch(p, d, pc, count, CC_NE);
+		return 1;
+	case RV32I_BLT:
+		emit_branch(p, d, pc, count, CC_L);
+		return 1;
+	case RV32I_BGE:
+		emit_branch(p, d, pc, count, CC_GE);
+		return 1;
+	case RV32I_BLTU:
+		emit_branch(p, d, pc, count, CC_B);
+		return 1;
+	case RV32I_BGEU:
+		emit_branch(p, d, pc, count, CC_AE);
+		return 1;
+	case RV32I_LB:
+		emit_load(p, d, pc, count, 1, jit_lb);
+		return 0;
+	case RV32I_LH:
+		emit_load(p, d, pc, count, 3, jit_lh);
+		return 0;
+	case RV32I_LW:
+		emit_load(p, d, pc, count, 0, jit_lw);
+		return 0;
+	case RV32I_LBU:
+		emit_load(p, d, pc, count, 2, jit_lbu);
+		return 0;
+	case RV32I_LHU:
+		emit_load(p, d, pc, count, 4, jit_lhu);
+		return 0;
+	case RV32I_SB:
+		emit_store(p, d, pc, count, 1, jit_sb);
+		return 0;
+	case RV32I_SH:
+		emit_store(p, d, pc, count, 2, jit_sh);
+		return 0;
+	case RV32I_SW:
+		emit_store(p, d, pc, count, 4, jit_sw);
+		return 0;
+	case RV32I_ADDI:
+		emit_alu_imm(p, d, 0);
+		return 0;
+	case RV32I_ORI:
+		emit_alu_imm(p, d, 1);
+		return 0;
+	case RV32I_ANDI:
+		emit_alu_imm(p, d, 4);
+		return 0;
+	case RV32I_XORI:
+		emit_alu_imm(p, d, 6);
+		return 0;
+	case RV32I_SLTI:
+		emit_set(p, d, CC_L, 0);
+		return 0;
+	case RV32I_SLTIU:
+		emit_set(p, d, CC_B, 0);
+		return 0;
+	case RV32I_SLLI:
+		emit_shift(p, d, 4, 0);
+		return 0;
+	case RV32I_SRLI_SRAI:
+		emit_shift(p, d, 5, 0);
+		return 0;
+	case RV32I_SRAI:
+		emit_shift(p, d, 7, 0);
+		return 0;
+	case RV32I_ADD_SUB:
+		emit_alu_reg(p, d, 0x01);
+		return 0;
+	case RV32I_SUB:
+		emit_alu_reg(p, d, 0x29);
+		return 0;
+	case RV32I_XOR:
+		emit_alu_reg(p, d, 0x31);
+		return 0;
+	case RV32I_OR:
+		emit_alu_reg(p, d, 0x09);
+		return 0;
+	case RV32I_AND:
+		emit_alu_reg(p, d, 0x21);
+		return 0;
+	case RV32I_SLT:
+		emit_set(p, d, CC_L, 1);
+		return 0;
+	case RV32I_SLTU:
+		emit_set(p, d, CC_B, 1);
+		return 0;
+	case RV32I_SLL:
+		emit_shift(p, d, 4, 1);
+		return 0;
+	case RV32I_SRL_SRA:
+		emit_shift(p, d, 5, 1);
+		return 0;
+	case RV32I_SRA:
+		emit_shift(p, d, 7, 1);
+		return 0;
+	case RV32M_MUL:
+		emit_mul(p, d, 4, EAX);
+		return 0;
+	case RV32M_MULH:
+		emit_mul(p, d, 5, EDX);
+		return 0;
+	case RV32M_MULHU:
+		emit_mul(p, d, 4, EDX);
+		return 0;
+	/* x86 div faults on zero and overflow, RISC-V defines a result */
+	case RV32M_MULHSU:
+		emit_alu_call(p, d, jit_mulhsu);
+		return 0;
+	case RV32M_DIV:
+		emit_alu_call(p, d, jit_div);
+		return 0;
+	case RV32M_DIVU:
+		emit_alu_call(p, d, jit_divu);
+		return 0;
+	case RV32M_REM:
+		emit_alu_call(p, d, jit_rem);
+		return 0;
+	case RV32M_REMU:
+		emit_alu_call(p, d, jit_remu);
+		return 0;
+	case RV32I_FENCE:
+		/* a single hart with no caches to maintain */
+		return 0;
+	}
+
+	return -1;
+}
+
+static jit_block_t jit_compile(struct jit *jit, struct vm *vm, uint32_t pc)
+{
+	uint32_t end = vm->rom.base_addr + vm->rom.size;
+	uint8_t *start, *p;
+	int count = 0;
+	int ret = 0;
+
+	if (jit->cur + JIT_BLOCK_MAX_BYTES > jit->code + JIT_CODE_SIZE) {
+		memset(jit->blocks, 0, jit->nr_blocks * sizeof(*jit->blocks));
+		jit->cur = jit->code;
+		jit->link = NULL;
+	}
+
+	start = p = jit->cur;
+
+	emit_prologue(&p);
+	jit->frame_len = p - start;
+
+	while (pc < end && count < JIT_BLOCK_MAX_INSTS) {
+		struct inst_decoded *d = icache_lookup(vm->icache, pc);
+
+		if (!d->inst)
+			break;
+
+		ret = jit_emit_inst(&p, d, pc, count + 1);
+		if (ret < 0)
+			break;
+
+		count++;
+		pc += d->len;
+
+		if (ret)
+			break;
+	}
+
+	if (!count)
+		return JIT_INTERP;
+
+	/* pc is the first instruction the block did not cover */
+	if (ret <= 0)
+		emit_exit(&p, pc, count);
+
+	jit->cur = p;
+
+	return (jit_block_t)start;
+}
+
+static struct jit *jit_create(struct vm *vm)
+{
+	struct jit *jit;
+
+	jit = malloc(sizeof(*jit));
+	if (!jit)
+		return NULL;
+
+	jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED)
+		goto err_free;
+
+	jit->nr_blocks = vm->rom.size / 2;
+	jit->blocks = calloc(jit->nr_blocks, sizeof(*jit->blocks));
+	if (!jit->blocks)
+		goto err_unmap;
+
+	jit->cur = jit->code;
+	jit->link = NULL;
+
+	return jit;
+
+err_unmap:
+	munmap(jit->code, JIT_CODE_SIZE);
+err_free:
+	free(jit);
+	return NULL;
+}
+
+void vm_flush_jit(struct vm *vm)
+{
+	if (!vm->jit)
+		return;
+
+	munmap(vm->jit->code, JIT_CODE_SIZE);
+	free(vm->jit->blocks);
+	free(vm->jit);
+	vm->jit = NULL;
+}
+
+void vm_run_jit(struct vm *vm)
+{
+	uint32_t base = vm->rom.base_addr;
+	uint32_t size = vm->rom.size;
+	uint32_t pc = vm->cpu.pc;
+	struct jit *jit;
+
+	if (!vm->jit) {
+		vm->jit = jit_create(vm);
+		if (!vm->jit) {
+			printf("cannot allocate jit code buffer\n");
+			return;
+		}
+	}
+
+	jit = vm->jit;
+	/* whoever ran the vm last may have moved the PC since */
+	jit->link = NULL;
+
+	while (pc - base < size && !vm->halted) {
+		jit_block_t *block = &jit->blocks[(pc - base) >> 1];
+		struct inst_decoded *d;
+
+		if (!*block)
+			*block = jit_compile(jit, vm, pc);
+
+		if (*block != JIT_INTERP) {
+			struct jit_exit exit;
+
+			/* the exit that brought us here goes straight to the block next time */
+			if (jit->link) {
+				uint8_t *entry = (uint8_t *)*block + jit->frame_len;
+				int32_t rel = entry - (jit->link + sizeof(int32_t));
+
+				memcpy(jit->link, &rel, sizeof(rel));
+			}
+
+			exit = (*block)(vm);
+			pc = exit.pc;
+			jit->link = exit.link;
+			continue;
+		}
+
+		jit->link = NULL;
+
+		d = icache_lookup(vm->icache, pc);
+
+		vm->cpu.pc = pc + d->len;
+		d->handler(vm, d);
+		vm->icount++;
+
+		pc = vm->cpu.pc;
+
+		if (!d->inst)
+			break;
+	}
+
+	vm->cpu.pc = pc;
+}
+
+#else
+
+void vm_flush_jit(struct vm *vm)
+{
+}
+
+/* no code generator for this host, use the fastest interpreter */
+void vm_run_jit(struct vm *vm)
+{
+	vm_run_fast(vm);
+}
+
+#endif /* __x86_64__ */
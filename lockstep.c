@@ -0,0 +1,357 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vm.h>
+#include <inst.h>
+#include <icache.h>
+#include <mm.h>
+
+/*
+ * Lockstep engine: up to LOCKSTEP_LANES vms running the same image from the
+ * same pc, each with its own registers and memory, share one instruction
+ * stream. The register file is stored as structure-of-arrays, one vector
+ * of lanes per register, so that an ALU instruction is a single vector
+ * operation across all instances (SSE2 by default, AVX2 with -mavx2).
+ *
+ * Lanes only leave the group: when a branch or an indirect jump does not
+ * go the same way for every lane, the minority is written back to its vm
+ * and finished on the scalar interpreter once the group is done. Lanes
+ * that left keep computing garbage in the vector ops, only loads and
+ * stores look at the active mask.
+ */
+#define LOCKSTEP_LANES		VM_LOCKSTEP_LANES
+
+typedef uint32_t lanes_t __attribute__((vector_size(LOCKSTEP_LANES * sizeof(uint32_t))));
+typedef int32_t slanes_t __attribute__((vector_size(LOCKSTEP_LANES * sizeof(int32_t))));
+
+struct lockstep {
+	lanes_t x[32];
+	struct vm *vms[LOCKSTEP_LANES];
+	int nr;
+	uint32_t active;	/* lanes still following the group */
+	uint32_t split;		/* lanes to finish on the scalar interpreter */
+	uint64_t icount;	/* instructions executed by the group */
+	int16_t *index;		/* opcode index + 1 of each ROM halfword, 0 until seen */
+};
+
+#define for_each_lane(ls, l)	for (int l = 0; l < (ls)->nr; l++) if ((ls)->active & (1u << l))
+
+#define RD	ls->x[d->rd]
+#define RS1	ls->x[d->rs1]
+#define RS2	ls->x[d->rs2]
+#define IMM	((uint32_t)d->imm)
+#define SRS1	((slanes_t)RS1)
+#define SRS2	((slanes_t)RS2)
+
+#define BRANCH(cond)	do {							\
+				slanes_t __c = (cond);				\
+				uint32_t __taken = 0;				\
+				for (int l = 0; l < LOCKSTEP_LANES; l++)	\
+					__taken |= (__c[l] & 1u) << l;		\
+				pc = lockstep_branch(ls, __taken, pc + d->len, d->target); \
+			} while (0)
+
+static void lockstep_get_lane(struct lockstep *ls, int l)
+{
+	uint32_t *regs = (uint32_t *)&ls->vms[l]->cpu.regs;
+
+	for (int r = 0; r < 32; r++)
+		ls->x[r][l] = regs[r];
+}
+
+static void lockstep_put_lane(struct lockstep *ls, int l)
+{
+	uint32_t *regs = (uint32_t *)&ls->vms[l]->cpu.regs;
+
+	for (int r = 1; r < 32; r++)
+		regs[r] = ls->x[r][l];
+}
+
+/* Write lane l back to its vm, stopped at pc, and take it out of the group. */
+static void lockstep_leave(struct lockstep *ls, int l, uint32_t pc)
+{
+	struct vm *vm = ls->vms[l];
+
+	lockstep_put_lane(ls, l);
+	vm->cpu.pc = pc;
+	vm->icount += ls->icount;
+	ls->active &= ~(1u << l);
+}
+
+static void lockstep_split(struct lockstep *ls, uint32_t mask, const uint32_t *next)
+{
+	for_each_lane(ls, l) {
+		if (!(mask & (1u << l)))
+			continue;
+
+		lockstep_leave(ls, l, next[l]);
+		ls->split |= 1u << l;
+	}
+}
+
+/* Lanes whose access faulted stop right after the instruction, as in vm_run(). */
+static void lockstep_check_faults(struct lockstep *ls, uint32_t next)
+{
+	for_each_lane(ls, l)
+		if (ls->vms[l]->halted)
+			lockstep_leave(ls, l, next);
+}
+
+/*
+ * Per-lane next pc after an indirect jump or a scalar instruction: the
+ * group follows the first active lane, the lanes going elsewhere split.
+ */
+static uint32_t lockstep_converge(struct lockstep *ls, const uint32_t *next)
+{
+	uint32_t pc = 0, diverged = 0;
+	int leader = -1;
+
+	for_each_lane(ls, l) {
+		if (leader < 0) {
+			leader = l;
+			pc = next[l];
+		} else if (next[l] != pc) {
+			diverged |= 1u << l;
+		}
+	}
+
+	lockstep_split(ls, diverged, next);
+
+	return pc;
+}
+
+/*
+ * Conditional branch falling through to fall: the larger of the taken and
+ * not taken sets stays.
+ */
+static uint32_t lockstep_branch(struct lockstep *ls, uint32_t taken, uint32_t fall, uint32_t target)
+{
+	uint32_t next[LOCKSTEP_LANES];
+	uint32_t stay;
+
+	taken &= ls->active;
+
+	for_each_lane(ls, l)
+		next[l] = (taken & (1u << l)) ? target : fall;
+
+	if (taken == ls->active)
+		return target;
+	if (!taken)
+		return fall;
+
+	if (__builtin_popcount(taken) * 2 >= __builtin_popcount(ls->active))
+		stay = taken;
+	else
+		stay = ls->active & ~taken;
+
+	lockstep_split(ls, ls->active & ~stay, next);
+
+	return stay == taken ? target : fall;
+}
+
+/* Anything without a vector implementation runs lane by lane on its vm. */
+static uint32_t lockstep_scalar(struct lockstep *ls, struct inst_decoded *d, uint32_t pc)
+{
+	uint32_t next[LOCKSTEP_LANES];
+
+	for_each_lane(ls, l) {
+		struct vm *vm = ls->vms[l];
+
+		lockstep_put_lane(ls, l);
+		vm->cpu.pc = pc + d->len;
+		inst_single_handler(d)(vm, d);
+		lockstep_get_lane(ls, l);
+		next[l] = vm->cpu.pc;
+
+		if (vm->halted)
+			lockstep_leave(ls, l, next[l]);
+	}
+
+	return lockstep_converge(ls, next);
+}
+
+static void lockstep_load(struct lockstep *ls, struct inst_decoded *d, int index)
+{
+	lanes_t addr = RS1 + IMM;
+
+	for_each_lane(ls, l) {
+		struct bus *bus = &ls->vms[l]->bus;
+
+		switch (index) {
+		case RV32I_LB:	RD[l] = bus_read_s8(bus, addr[l]); break;
+		case RV32I_LH:	RD[l] = bus_read_s16(bus, addr[l]); break;
+		case RV32I_LW:	RD[l] = bus_read_u32(bus, addr[l]); break;
+		case RV32I_LBU:	RD[l] = bus_read_u8(bus, addr[l]); break;
+		case RV32I_LHU:	RD[l] = bus_read_u16(bus, addr[l]); break;
+		}
+	}
+}
+
+static void lockstep_store(struct lockstep *ls, struct inst_decoded *d, int index)
+{
+	lanes_t addr = RS1 + IMM;
+
+	for_each_lane(ls, l) {
+		struct bus *bus = &ls->vms[l]->bus;
+
+		switch (index) {
+		case RV32I_SB:	bus_write_u8(bus, addr[l], RS2[l]); break;
+		case RV32I_SH:	bus_write_u16(bus, addr[l], RS2[l]); break;
+		case RV32I_SW:	bus_write_u32(bus, addr[l], RS2[l]); break;
+		}
+	}
+}
+
+static void lockstep_run_group(struct lockstep *ls)
+{
+	struct vm *vm = ls->vms[0];
+	uint32_t base = vm->rom.base_addr;
+	uint32_t size = vm->rom.size;
+	uint32_t pc = vm->cpu.pc;
+	uint32_t next[LOCKSTEP_LANES];
+	const lanes_t zero = { 0 };
+
+	while (ls->active) {
+		struct inst_decoded *d;
+		int index;
+
+		if (pc - base >= size) {
+			for_each_lane(ls, l)
+				lockstep_leave(ls, l, pc);
+			break;
+		}
+
+		d = icache_lookup(vm->icache, pc);
+		index = ls->index[(pc - base) >> 1] - 1;
+		if (index < 0) {
+			index = inst_opcode_index(d->inst);
+			ls->index[(pc - base) >> 1] = index + 1;
+		}
+		ls->x[0] = zero;
+		ls->icount++;
+
+		if (!d->inst) {
+			for_each_lane(ls, l)
+				lockstep_leave(ls, l, pc + d->len);
+			break;
+		}
+
+		switch (index) {
+		case RV32I_LUI:
+		case RV32I_AUIPC:	RD = zero + IMM; pc += d->len; break;
+		case RV32I_JAL:		RD = zero + (pc + d->len); pc = d->target; break;
+		case RV32I_JALR:
+			{
+				lanes_t addr = (RS1 + IMM) & ~1u;
+
+				RD = zero + (pc + d->len);
+				for_each_lane(ls, l)
+					next[l] = addr[l];
+				pc = lockstep_converge(ls, next);
+				break;
+			}
+
+		case RV32I_BEQ:		BRANCH(RS1 == RS2); break;
+		case RV32I_BNE:		BRANCH(RS1 != RS2); break;
+		case RV32I_BLT:		BRANCH(SRS1 < SRS2); break;
+		case RV32I_BGE:		BRANCH(SRS1 >= SRS2); break;
+		case RV32I_BLTU:	BRANCH(RS1 < RS2); break;
+		case RV32I_BGEU:	BRANCH(RS1 >= RS2); break;
+
+		case RV32I_LB:
+		case RV32I_LH:
+		case RV32I_LW:
+		case RV32I_LBU:
+		case RV32I_LHU:
+			lockstep_load(ls, d, index);
+			lockstep_check_faults(ls, pc + d->len);
+			pc += d->len;
+			break;
+		case RV32I_SB:
+		case RV32I_SH:
+		case RV32I_SW:
+			lockstep_store(ls, d, index);
+			lockstep_check_faults(ls, pc + d->len);
+			pc += d->len;
+			break;
+
+		case RV32I_ADDI:	RD = RS1 + IMM; pc += d->len; break;
+		case RV32I_SLTI:	RD = (lanes_t)(SRS1 < (int32_t)IMM) & 1; pc += d->len; break;
+		case RV32I_SLTIU:	RD = (lanes_t)(RS1 < IMM) & 1; pc += d->len; break;
+		case RV32I_XORI:	RD = RS1 ^ IMM; pc += d->len; break;
+		case RV32I_ORI:		RD = RS1 | IMM; pc += d->len; break;
+		case RV32I_ANDI:	RD = RS1 & IMM; pc += d->len; break;
+		case RV32I_SLLI:	RD = RS1 << IMM; pc += d->len; break;
+		case RV32I_SRLI_SRAI:	RD = RS1 >> IMM; pc += d->len; break;
+		case RV32I_SRAI:	RD = (lanes_t)(SRS1 >> IMM); pc += d->len; break;
+
+		case RV32I_ADD_SUB:	RD = RS1 + RS2; pc += d->len; break;
+		case RV32I_SUB:		RD = RS1 - RS2; pc += d->len; break;
+		case RV32I_SLL:		RD = RS1 << (RS2 & 0x1F); pc += d->len; break;
+		case RV32I_SLT:		RD = (lanes_t)(SRS1 < SRS2) & 1; pc += d->len; break;
+		case RV32I_SLTU:	RD = (lanes_t)(RS1 < RS2) & 1; pc += d->len; break;
+		case RV32I_XOR:		RD = RS1 ^ RS2; pc += d->len; break;
+		case RV32I_SRL_SRA:	RD = RS1 >> (RS2 & 0x1F); pc += d->len; break;
+		case RV32I_SRA:		RD = (lanes_t)(SRS1 >> (slanes_t)(RS2 & 0x1F)); pc += d->len; break;
+		case RV32I_OR:		RD = RS1 | RS2; pc += d->len; break;
+		case RV32I_AND:		RD = RS1 & RS2; pc += d->len; break;
+
+		/* the rest of RV32M has no vector form, it goes through lockstep_scalar() */
+		case RV32M_MUL:		RD = RS1 * RS2; pc += d->len; break;
+
+		case RV32I_FENCE:	pc += d->len; break;
+
+		default:
+			pc = lockstep_scalar(ls, d, pc);
+			break;
+		}
+	}
+}
+
+/*
+ * Run nr vms loaded from the same image, all stopped at the same pc, in
+ * groups of LOCKSTEP_LANES. Each vm ends up in the state vm_run() would
+ * have left it in.
+ */
+void vm_run_lockstep(struct vm **vms, int nr)
+{
+	struct lockstep ls;
+	int16_t *index;
+
+	if (!nr)
+		return;
+
+	/* the switch index of each instruction, shared by all the groups */
+	index = calloc(vms[0]->rom.size / 2, sizeof(*index));
+	if (!index) {
+		printf("cannot allocate lockstep index\n");
+		return;
+	}
+
+	for (int first = 0; first < nr; first += LOCKSTEP_LANES) {
+		memset(&ls, 0, sizeof(ls));
+		ls.index = index;
+		ls.nr = nr - first < LOCKSTEP_LANES ? nr - first : LOCKSTEP_LANES;
+
+		for (int l = 0; l < ls.nr; l++) {
+			ls.vms[l] = vms[first + l];
+			lockstep_get_lane(&ls, l);
+			ls.active |= 1u << l;
+		}
+
+		lockstep_run_group(&ls);
+
+		for (int l = 0; l < ls.nr; l++) {
+			struct vm *vm = ls.vms[l];
+
+			if (!(ls.split & (1u << l)) || vm->halted)
+				continue;
+
+			if (vm->cpu.pc - vm->rom.base_addr < vm->rom.size)
+				vm_run(vm);
+		}
+	}
+
+	free(index);
+}
@@ -1,6 +1,12 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <ucontext.h>
 #include <mm.h>
 
 static int mm_get_offset(struct memory *mem, uint32_t addr)
@@ -13,23 +19,115 @@ static int mm_get_offset(struct memory *mem, uint32_t addr)
 	return offset;
 }
 
-int mm_create_mapping(struct memory *mem, uint32_t base_addr, int size, int type, int attr)
+/*
+ * Page aligned so that the bus can keep its flags in the low bits of the
+ * host address, with a little slack for unaligned accesses straddling the
+ * end of the mapping. Placed memories have none, the next guest page is
+ * whatever the guest space holds there.
+ */
+static size_t mm_mapping_len(uint32_t size, int attr)
 {
-	int ret = 0;
+	size_t align = (attr & HUGETLB) ? MM_HUGE_PAGE_SIZE : BUS_PAGE_SIZE;
+	size_t slack = (attr & PLACED) ? 0 : sizeof(uint32_t);
 
-	mem->mem = malloc(size);
-	if (!mem->mem) {
-		ret = -ENOMEM;
-		goto err;
+	return ((size_t)size + slack + align - 1) & ~(align - 1);
+}
+
+/* Give a range back to the flat space it was placed in, see bus_space_init(). */
+static void mm_unplace(void *host, size_t len)
+{
+	mmap(host, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+}
+
+/*
+ * Guest memory is anonymous and not accounted up front: the kernel backs
+ * it page by page as the guest touches it, so a RAM of a few hundred MB
+ * costs what the guest actually uses. With HUGE, the hugetlb pool is tried
+ * first and transparent huge pages are the fallback. hugetlb pages are
+ * reserved at mmap() time, a pool too small to back the whole mapping
+ * would otherwise only show as SIGBUS on first touch. With a flat bus the
+ * memory is created at its place in the guest space, where hugetlb pages
+ * only fit a 2M aligned memory.
+ */
+int mm_create_mapping(struct memory *mem, struct bus *bus, uint32_t base_addr, uint32_t size,
+		      int type, int attr)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	void *host = MAP_FAILED;
+	void *place = NULL;
+
+	attr &= ~(HUGETLB | PLACED);
+
+	if (bus && bus->base) {
+		place = mm_bus_place(bus, base_addr, size);
+		if (!place)
+			return -EBUSY;
+		flags |= MAP_FIXED;
+		attr |= PLACED;
 	}
 
+	if ((attr & HUGE) && (!place || !((base_addr | size) & (MM_HUGE_PAGE_SIZE - 1)))) {
+		host = mmap(place, mm_mapping_len(size, attr | HUGETLB), PROT_READ | PROT_WRITE,
+			    flags | MAP_HUGETLB, -1, 0);
+		if (host != MAP_FAILED)
+			attr |= HUGETLB;
+	}
+
+	if (host == MAP_FAILED) {
+		host = mmap(place, mm_mapping_len(size, attr), PROT_READ | PROT_WRITE,
+			    flags | MAP_NORESERVE, -1, 0);
+		if (host == MAP_FAILED) {
+			/* a failed MAP_FIXED may have unmapped the range already */
+			if (place)
+				mm_unplace(place, mm_mapping_len(size, attr));
+			return -ENOMEM;
+		}
+
+		if (attr & HUGE)
+			madvise(host, mm_mapping_len(size, attr), MADV_HUGEPAGE);
+	}
+
+	mem->mem = host;
 	mem->base_addr = base_addr;
 	mem->size = size;
 	mem->type = type;
 	mem->attr = attr;
 
-err:
-	return ret;
+	return 0;
+}
+
+void mm_destroy_mapping(struct memory *mem)
+{
+	if (!mem->mem)
+		return;
+
+	/*
+	 * Placed memories hand their range back to the reservation, a hole in
+	 * it could get other host mappings. File mappings carry one page of
+	 * slack otherwise, see elf_map_segment().
+	 */
+	if (mem->attr & PLACED)
+		mm_unplace(mem->mem, mm_mapping_len(mem->size, mem->attr));
+	else if (mem->attr & MAPPED)
+		munmap(mem->mem, mem->size + BUS_PAGE_SIZE);
+	else
+		munmap(mem->mem, mm_mapping_len(mem->size, mem->attr));
+
+	mem->mem = NULL;
+}
+
+/* Copy data to the start of mem from the host, even if mem is read-only. */
+void mm_fill(struct memory *mem, const void *data, uint32_t len)
+{
+	int ro = (mem->attr & PLACED) && !(mem->attr & RW);
+
+	if (ro)
+		mprotect(mem->mem, mm_mapping_len(mem->size, mem->attr), PROT_READ | PROT_WRITE);
+
+	memcpy(mem->mem, data, len);
+
+	if (ro)
+		mprotect(mem->mem, mm_mapping_len(mem->size, mem->attr), PROT_READ);
 }
 
 int mm_read(struct memory *mem, uint32_t addr)
@@ -94,3 +192,760 @@ int mm_read_s32(struct memory *mem, uint32_t addr)
 
 	return *(int32_t *)(mem->mem + offset);
 }
+
+#ifdef BUS_FLAT
+
+/*
+ * Flat guest spaces alive, found by address from the SIGSEGV handler.
+ * Slots are taken under the lock, the handler only reads: a base is set
+ * after its bus and cleared before the space goes away.
+ */
+static uintptr_t bus_space_base[BUS_MAX_SPACES];
+static struct bus *bus_space[BUS_MAX_SPACES];
+static int bus_nr_spaces;
+static pthread_mutex_t bus_space_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t bus_trap_once = PTHREAD_ONCE_INIT;
+
+static void bus_trap_install(void);
+
+static int bus_space_register(struct bus *bus)
+{
+	int i;
+
+	pthread_mutex_lock(&bus_space_lock);
+
+	for (i = 0; i < BUS_MAX_SPACES && bus_space_base[i]; i++)
+		;
+
+	if (i < BUS_MAX_SPACES) {
+		bus_space[i] = bus;
+		__atomic_store_n(&bus_space_base[i], (uintptr_t)bus->base, __ATOMIC_RELEASE);
+		if (i == bus_nr_spaces)
+			__atomic_store_n(&bus_nr_spaces, i + 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&bus_space_lock);
+
+	return i < BUS_MAX_SPACES ? 0 : -ENOSPC;
+}
+
+static void bus_space_unregister(struct bus *bus)
+{
+	pthread_mutex_lock(&bus_space_lock);
+
+	for (int i = 0; i < bus_nr_spaces; i++) {
+		if (bus_space_base[i] == (uintptr_t)bus->base) {
+			__atomic_store_n(&bus_space_base[i], 0, __ATOMIC_RELEASE);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&bus_space_lock);
+}
+
+static struct bus *bus_space_find(uintptr_t addr)
+{
+	int nr = __atomic_load_n(&bus_nr_spaces, __ATOMIC_ACQUIRE);
+
+	for (int i = 0; i < nr; i++) {
+		uintptr_t base = __atomic_load_n(&bus_space_base[i], __ATOMIC_ACQUIRE);
+
+		if (base && addr - base < BUS_SPACE_SIZE + BUS_GUARD_SIZE)
+			return bus_space[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Reserve the guest space, 2M aligned so that aligned memories can have
+ * hugetlb pages. Nothing is committed until memories are created in it.
+ */
+static int bus_space_init(struct bus *bus)
+{
+	size_t len = BUS_SPACE_SIZE + BUS_GUARD_SIZE + MM_HUGE_PAGE_SIZE;
+	uint8_t *host, *base;
+	int ret;
+
+	pthread_once(&bus_trap_once, bus_trap_install);
+
+	host = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (host == MAP_FAILED)
+		return -ENOMEM;
+
+	base = (uint8_t *)(((uintptr_t)host + MM_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(MM_HUGE_PAGE_SIZE - 1));
+	if (base > host)
+		munmap(host, base - host);
+	munmap(base + BUS_SPACE_SIZE + BUS_GUARD_SIZE,
+	       host + len - (base + BUS_SPACE_SIZE + BUS_GUARD_SIZE));
+
+	bus->base = base;
+
+	ret = bus_space_register(bus);
+	if (ret < 0) {
+		munmap(base, BUS_SPACE_SIZE + BUS_GUARD_SIZE);
+		bus->base = NULL;
+	}
+
+	return ret;
+}
+
+static void bus_space_exit(struct bus *bus)
+{
+	if (!bus->base)
+		return;
+
+	bus_space_unregister(bus);
+	munmap(bus->base, BUS_SPACE_SIZE + BUS_GUARD_SIZE);
+	bus->base = NULL;
+}
+
+/* Host protection of guest pages with rights, see bus_trap(). */
+static int bus_prot(uintptr_t rights)
+{
+	return (rights & BUS_WRITE) ? PROT_READ | PROT_WRITE : PROT_READ;
+}
+
+#else
+
+static int bus_space_init(struct bus *bus)
+{
+	bus->base = NULL;
+
+	return 0;
+}
+
+static void bus_space_exit(struct bus *bus)
+{
+}
+
+#endif /* BUS_FLAT */
+
+int mm_bus_init(struct bus *bus)
+{
+	/* calloc()ed so that only the table pages actually used get committed */
+	bus->pages = calloc(BUS_NR_PAGES, sizeof(*bus->pages));
+	if (!bus->pages)
+		return -ENOMEM;
+
+	if (bus_space_init(bus) < 0) {
+		free(bus->pages);
+		bus->pages = NULL;
+		return -ENOMEM;
+	}
+
+	bus->nr_mmio = 0;
+	bus->last_mmio = NULL;
+	bus->fault = NULL;
+	bus->dirty = NULL;
+	bus->nr_dirty = 0;
+	bus->max_dirty = 0;
+
+	return 0;
+}
+
+void mm_bus_exit(struct bus *bus)
+{
+	for (int i = 0; i < bus->nr_mmio; i++)
+		if (bus->mmio[i].ops->release)
+			bus->mmio[i].ops->release(bus->mmio[i].opaque);
+	bus->nr_mmio = 0;
+	bus->last_mmio = NULL;
+
+	bus_space_exit(bus);
+
+	free(bus->pages);
+	bus->pages = NULL;
+	free(bus->dirty);
+	bus->dirty = NULL;
+}
+
+int mm_bus_map(struct bus *bus, struct memory *mem)
+{
+	uint32_t first = mem->base_addr >> BUS_PAGE_SHIFT;
+	uint32_t count = ((uint64_t)mem->size + BUS_PAGE_SIZE - 1) >> BUS_PAGE_SHIFT;
+	uintptr_t rights = BUS_READ;
+
+	if (mem->base_addr & (BUS_PAGE_SIZE - 1))
+		return -EINVAL;
+
+	if ((uint64_t)first + count > BUS_NR_PAGES)
+		return -EINVAL;
+
+	for (uint32_t i = 0; i < count; i++)
+		if (bus->pages[first + i])
+			return -EBUSY;
+
+	if (mem->attr & RW)
+		rights |= BUS_WRITE;
+
+	if (!(mem->attr & XN))
+		rights |= BUS_EXEC;
+
+	/* a flat bus reaches memory at base + guest address only */
+	if (bus->base && mem->mem != bus->base + mem->base_addr)
+		return -EINVAL;
+
+#ifdef BUS_FLAT
+	if (bus->base)
+		mprotect(mem->mem, (size_t)count << BUS_PAGE_SHIFT, bus_prot(rights));
+#endif
+
+	for (uint32_t i = 0; i < count; i++)
+		bus->pages[first + i] = ((uintptr_t)mem->mem + (i << BUS_PAGE_SHIFT)) | rights;
+
+	return 0;
+}
+
+/*
+ * Where memory for [base_addr, base_addr + size) goes on a flat bus. NULL
+ * without one, or if the range is in use already.
+ */
+void *mm_bus_place(struct bus *bus, uint32_t base_addr, uint32_t size)
+{
+	uint32_t first = base_addr >> BUS_PAGE_SHIFT;
+	uint32_t count = ((uint64_t)size + BUS_PAGE_SIZE - 1) >> BUS_PAGE_SHIFT;
+
+	if (!bus->base || (base_addr & (BUS_PAGE_SIZE - 1)) ||
+	    (uint64_t)first + count > BUS_NR_PAGES)
+		return NULL;
+
+	for (uint32_t i = 0; i < count; i++)
+		if (bus->pages[first + i])
+			return NULL;
+
+	return bus->base + base_addr;
+}
+
+/*
+ * Register a device region. The table stays sorted by base for the binary
+ * search in bus_find_mmio(). Regions must not overlap; small ones may share
+ * a page, which then belongs to devices as a whole.
+ */
+int mm_bus_map_mmio(struct bus *bus, uint32_t base_addr, uint32_t size,
+		    const struct bus_mmio_ops *ops, void *opaque)
+{
+	struct bus_mmio *mmio;
+	uint32_t first = base_addr >> BUS_PAGE_SHIFT;
+	uint32_t count = ((uint64_t)(base_addr & (BUS_PAGE_SIZE - 1)) + size +
+			  BUS_PAGE_SIZE - 1) >> BUS_PAGE_SHIFT;
+	int i;
+
+	if (bus->nr_mmio == BUS_MAX_MMIO)
+		return -ENOSPC;
+
+	if (!size || (uint64_t)base_addr + size > (1ULL << 32))
+		return -EINVAL;
+
+	for (i = 0; i < bus->nr_mmio && bus->mmio[i].base < base_addr; i++)
+		;
+
+	if ((i > 0 && bus->mmio[i - 1].base + bus->mmio[i - 1].size > base_addr) ||
+	    (i < bus->nr_mmio && base_addr + size > bus->mmio[i].base))
+		return -EBUSY;
+
+	/* nor take over memory */
+	for (uint32_t p = 0; p < count; p++)
+		if (bus->pages[first + p] & ~(uintptr_t)BUS_MMIO)
+			return -EBUSY;
+
+	memmove(&bus->mmio[i + 1], &bus->mmio[i], (bus->nr_mmio - i) * sizeof(*mmio));
+	bus->nr_mmio++;
+	bus->last_mmio = NULL;
+
+	mmio = &bus->mmio[i];
+	mmio->base = base_addr;
+	mmio->size = size;
+	mmio->ops = ops;
+	mmio->opaque = opaque;
+
+	for (uint32_t p = 0; p < count; p++)
+		bus->pages[first + p] = BUS_MMIO;
+
+	return 0;
+}
+
+/*
+ * Dirty page tracking: the writable pages of mem lose their write right
+ * and get BUS_TRACK instead, so the first write to each of them takes the
+ * slow path, which logs the page and gives the right back. Pages already
+ * tracked are left alone.
+ */
+int mm_bus_track(struct bus *bus, struct memory *mem)
+{
+	uint32_t first = mem->base_addr >> BUS_PAGE_SHIFT;
+	uint32_t count = ((uint32_t)mem->size + BUS_PAGE_SIZE - 1) >> BUS_PAGE_SHIFT;
+	uint32_t *dirty;
+
+	if (!(mem->attr & RW))
+		return 0;
+
+	dirty = realloc(bus->dirty, (bus->max_dirty + count) * sizeof(*dirty));
+	if (!dirty)
+		return -ENOMEM;
+
+	bus->dirty = dirty;
+
+	for (uint32_t i = 0; i < count; i++) {
+		uintptr_t *page = &bus->pages[first + i];
+
+		if (!(*page & BUS_WRITE) || (*page & BUS_MMIO))
+			continue;
+
+		*page = (*page & ~(uintptr_t)BUS_WRITE) | BUS_TRACK;
+		bus->max_dirty++;
+	}
+
+#ifdef BUS_FLAT
+	/* from now on the first write to each page traps, see bus_trap() */
+	if (bus->base)
+		mprotect(mem->mem, (size_t)count << BUS_PAGE_SHIFT, PROT_READ);
+#endif
+
+	return 0;
+}
+
+/* Re-arm tracking on the pages written since the last call. */
+void mm_bus_clear_dirty(struct bus *bus)
+{
+	for (int i = 0; i < bus->nr_dirty; i++) {
+		uintptr_t *page = &bus->pages[bus->dirty[i]];
+
+		*page = (*page & ~(uintptr_t)BUS_WRITE) | BUS_TRACK;
+#ifdef BUS_FLAT
+		if (bus->base)
+			mprotect(bus->base + ((size_t)bus->dirty[i] << BUS_PAGE_SHIFT),
+				 BUS_PAGE_SIZE, PROT_READ);
+#endif
+	}
+
+	bus->nr_dirty = 0;
+}
+
+/* The first write to a tracked page: log it and give the write right back. */
+static void bus_track_write(struct bus *bus, uint32_t nr)
+{
+	uintptr_t *page = &bus->pages[nr];
+
+	if (bus->written)
+		bus->written(bus, nr);
+
+	*page = (*page & ~(uintptr_t)BUS_TRACK) | BUS_WRITE;
+	bus->dirty[bus->nr_dirty++] = nr;
+#ifdef BUS_FLAT
+	if (bus->base)
+		mprotect(bus->base + ((size_t)nr << BUS_PAGE_SHIFT), BUS_PAGE_SIZE,
+			 PROT_READ | PROT_WRITE);
+#endif
+}
+
+static void bus_write_dirty(struct bus *bus, uint32_t addr, uint32_t value, int size)
+{
+	uintptr_t *page = &bus->pages[addr >> BUS_PAGE_SHIFT];
+
+	bus_track_write(bus, addr >> BUS_PAGE_SHIFT);
+
+	switch (size) {
+	case 1:
+		*(uint8_t *)bus_host(*page, addr) = value;
+		break;
+	case 2:
+		*(uint16_t *)bus_host(*page, addr) = value;
+		break;
+	default:
+		*(uint32_t *)bus_host(*page, addr) = value;
+		break;
+	}
+}
+
+/*
+ * Device accesses come in runs on the same device, polling a status
+ * register or filling a FIFO, so the last region hit is tried first.
+ */
+static struct bus_mmio *bus_find_mmio(struct bus *bus, uint32_t addr)
+{
+	struct bus_mmio *mmio = bus->last_mmio;
+	int lo = 0, hi = bus->nr_mmio - 1;
+
+	if (!(bus->pages[addr >> BUS_PAGE_SHIFT] & BUS_MMIO))
+		return NULL;
+
+	if (mmio && addr - mmio->base < mmio->size)
+		return mmio;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+
+		mmio = &bus->mmio[mid];
+		if (addr < mmio->base) {
+			hi = mid - 1;
+		} else if (addr - mmio->base >= mmio->size) {
+			lo = mid + 1;
+		} else {
+			bus->last_mmio = mmio;
+			return mmio;
+		}
+	}
+
+	return NULL;
+}
+
+static void bus_fault(struct bus *bus, uint32_t addr, int access)
+{
+	if (bus->fault)
+		bus->fault(bus, addr, access);
+}
+
+/*
+ * The fast paths only look at the page an access starts in. One that runs
+ * into the next page is memory if both pages allow it, and is then done a
+ * byte at a time, the two pages need not be contiguous on the host.
+ */
+static int bus_crosses(struct bus *bus, uint32_t addr, int size, int access)
+{
+	uintptr_t first = bus->pages[addr >> BUS_PAGE_SHIFT];
+	uintptr_t next = bus->pages[(uint32_t)(addr + size - 1) >> BUS_PAGE_SHIFT];
+
+	if ((addr & (BUS_PAGE_SIZE - 1)) <= BUS_PAGE_SIZE - size)
+		return 0;
+
+	return (first & access) && (next & access);
+}
+
+uint32_t bus_read_slow(struct bus *bus, uint32_t addr, int size)
+{
+	struct bus_mmio *mmio;
+
+	if (bus_crosses(bus, addr, size, BUS_READ)) {
+		uint32_t value = 0;
+
+		for (int i = 0; i < size; i++) {
+			uintptr_t page = bus->pages[(uint32_t)(addr + i) >> BUS_PAGE_SHIFT];
+
+			value |= (uint32_t)*(uint8_t *)bus_host(page, addr + i) << (i * 8);
+		}
+
+		return value;
+	}
+
+	mmio = bus_find_mmio(bus, addr);
+
+	if (mmio && mmio->ops->read)
+		return mmio->ops->read(mmio->opaque, addr - mmio->base, size);
+
+	bus_fault(bus, addr, BUS_READ);
+
+	return 0;
+}
+
+void bus_write_slow(struct bus *bus, uint32_t addr, uint32_t value, int size)
+{
+	struct bus_mmio *mmio;
+
+	if (bus_crosses(bus, addr, size, BUS_WRITE | BUS_TRACK)) {
+		for (int i = 0; i < size; i++) {
+			uint32_t byte_addr = addr + i;
+			uintptr_t page = bus->pages[byte_addr >> BUS_PAGE_SHIFT];
+
+			if (page & BUS_TRACK)
+				bus_write_dirty(bus, byte_addr, value >> (i * 8), 1);
+			else
+				*(uint8_t *)bus_host(page, byte_addr) = value >> (i * 8);
+		}
+		return;
+	}
+
+	if (bus->pages[addr >> BUS_PAGE_SHIFT] & BUS_TRACK) {
+		bus_write_dirty(bus, addr, value, size);
+		return;
+	}
+
+	mmio = bus_find_mmio(bus, addr);
+
+	if (mmio && mmio->ops->write) {
+		mmio->ops->write(mmio->opaque, addr - mmio->base, value, size);
+		return;
+	}
+
+	bus_fault(bus, addr, BUS_WRITE);
+}
+
+/* what page allows, a tracked page takes writes once they are logged */
+static uintptr_t bus_rights(uintptr_t page)
+{
+	return (page & BUS_TRACK) ? page | BUS_WRITE : page;
+}
+
+/*
+ * Host address of [addr, addr + len) when it lies in pages with the access
+ * right set that are also contiguous on the host, i.e. in one mapping, so
+ * that the host can work on guest memory in place. NULL otherwise. Tracked
+ * pages asked for writing are logged as written.
+ */
+void *bus_host_range(struct bus *bus, uint32_t addr, uint32_t len, int access)
+{
+	uint32_t first = addr >> BUS_PAGE_SHIFT;
+	uint32_t last = (addr + len - 1) >> BUS_PAGE_SHIFT;
+	uintptr_t page = bus->pages[first];
+
+	if (!len || (uint64_t)addr + len > (1ULL << 32) || (bus_rights(page) & access) != access)
+		return NULL;
+
+	for (uint32_t p = first + 1; p <= last; p++) {
+		uintptr_t next = bus->pages[p];
+
+		if ((bus_rights(next) & access) != access ||
+		    (next & ~BUS_FLAGS_MASK) !=
+		    (page & ~BUS_FLAGS_MASK) + ((uintptr_t)(p - first) << BUS_PAGE_SHIFT))
+			return NULL;
+	}
+
+	if (access & BUS_WRITE)
+		for (uint32_t p = first; p <= last; p++)
+			if (bus->pages[p] & BUS_TRACK)
+				bus_track_write(bus, p);
+
+	return bus_host(page, addr);
+}
+
+/*
+ * A compressed instruction may end a memory, only what the instruction
+ * needs is read: the upper half comes from the next page if it is there.
+ */
+uint32_t bus_fetch(struct bus *bus, uint32_t addr)
+{
+	uintptr_t page = bus->pages[addr >> BUS_PAGE_SHIFT];
+	uint32_t inst;
+
+	if (!(page & BUS_EXEC)) {
+		bus_fault(bus, addr, BUS_EXEC);
+		return 0;
+	}
+
+	inst = *(uint16_t *)bus_host(page, addr);
+	if ((inst & 3) != 3)
+		return inst;
+
+	addr += 2;
+	if (!(addr & (BUS_PAGE_SIZE - 1))) {
+		page = bus->pages[addr >> BUS_PAGE_SHIFT];
+		if (!(page & BUS_EXEC))
+			return inst;
+	}
+
+	return inst | (uint32_t)*(uint16_t *)bus_host(page, addr) << 16;
+}
+
+#ifdef BUS_FLAT
+
+/* ucontext registers in x86 register number order */
+static const int bus_trap_regs[16] = {
+	REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+	REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+};
+
+/* a guest access as done by the accessors in mm.h or the JIT */
+struct bus_insn {
+	int len;
+	int store;
+	int size;
+	int sign;		/* loads: sign rather than zero extend */
+	int reg;		/* x86 register number of the value */
+	int high8;		/* ah..bh rather than a low byte */
+	uintptr_t addr;		/* host address accessed */
+};
+
+/*
+ * Decode the mov at rip: [66] [REX] 8B/89/88 or 0F B6/B7/BE/BF with a
+ * memory operand. Returns -1 for anything else.
+ */
+static int bus_decode(const uint8_t *rip, greg_t *gregs, struct bus_insn *insn)
+{
+	const uint8_t *p = rip;
+	int opsize16 = 0, rex = 0;
+	int modrm, mod, rm;
+	uintptr_t addr = 0;
+
+	if (*p == 0x66) {
+		opsize16 = 1;
+		p++;
+	}
+
+	if ((*p & 0xF0) == 0x40)
+		rex = *p++;
+
+	/* no 64-bit moves */
+	if (rex & 0x8)
+		return -1;
+
+	insn->sign = 0;
+
+	switch (*p++) {
+	case 0x8B:
+		insn->store = 0;
+		insn->size = 4;
+		break;
+	case 0x89:
+		insn->store = 1;
+		insn->size = opsize16 ? 2 : 4;
+		break;
+	case 0x88:
+		insn->store = 1;
+		insn->size = 1;
+		break;
+	case 0x0F:
+		switch (*p++) {
+		case 0xB6:
+			insn->store = 0;
+			insn->size = 1;
+			break;
+		case 0xB7:
+			insn->store = 0;
+			insn->size = 2;
+			break;
+		case 0xBE:
+			insn->store = 0;
+			insn->size = 1;
+			insn->sign = 1;
+			break;
+		case 0xBF:
+			insn->store = 0;
+			insn->size = 2;
+			insn->sign = 1;
+			break;
+		default:
+			return -1;
+		}
+		break;
+	default:
+		return -1;
+	}
+
+	if (opsize16 && !(insn->store && insn->size == 2))
+		return -1;
+
+	modrm = *p++;
+	mod = modrm >> 6;
+	rm = modrm & 7;
+	insn->reg = ((modrm >> 3) & 7) | ((rex & 0x4) << 1);
+	insn->high8 = insn->store && insn->size == 1 && !rex && insn->reg >= 4;
+
+	if (mod == 3)
+		return -1;
+
+	if (rm == 4) {
+		int sib = *p++;
+		int index = ((sib >> 3) & 7) | ((rex & 0x2) << 2);
+		int base = (sib & 7) | ((rex & 0x1) << 3);
+
+		if (index != 4)
+			addr += (uintptr_t)gregs[bus_trap_regs[index]] << (sib >> 6);
+
+		if ((base & 7) == 5 && !mod) {
+			addr += (int32_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+			p += 4;
+		} else {
+			addr += gregs[bus_trap_regs[base]];
+		}
+	} else if (rm == 5 && !mod) {
+		/* rip relative, from the end of the instruction */
+		addr += (int32_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		p += 4;
+		addr += (uintptr_t)p;
+	} else {
+		addr += gregs[bus_trap_regs[rm | ((rex & 0x1) << 3)]];
+	}
+
+	if (mod == 1) {
+		addr += (int8_t)*p;
+		p++;
+	} else if (mod == 2) {
+		addr += (int32_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		p += 4;
+	}
+
+	insn->addr = addr;
+	insn->len = p - rip;
+
+	return 0;
+}
+
+/*
+ * Everything the page table would have sent to the slow path ends up here
+ * on a flat bus. The first write to a tracked page is logged and retried
+ * once the page is writable again; device accesses and guest faults get
+ * the faulting mov decoded, done by the slow path and skipped. Faults that
+ * are no guest access, or not from a mov the decoder knows, are the host's
+ * and get the default action.
+ *
+ * Device models run from here, on the guest's behalf: the signal is
+ * synchronous, whatever they call was not interrupted half way. They may
+ * fault on tracked pages themselves, hence SA_NODEFER.
+ */
+static void bus_trap(int sig, siginfo_t *si, void *ctx)
+{
+	ucontext_t *uc = ctx;
+	greg_t *gregs = uc->uc_mcontext.gregs;
+	uintptr_t host = (uintptr_t)si->si_addr;
+	struct bus *bus = bus_space_find(host);
+	struct bus_insn insn;
+	uint64_t addr;
+
+	if (!bus)
+		goto crash;
+
+	addr = host - (uintptr_t)bus->base;
+
+	if ((gregs[REG_ERR] & 2) && addr < BUS_SPACE_SIZE &&
+	    (bus->pages[addr >> BUS_PAGE_SHIFT] & BUS_TRACK)) {
+		bus_track_write(bus, addr >> BUS_PAGE_SHIFT);
+		return;
+	}
+
+	if (bus_decode((const uint8_t *)gregs[REG_RIP], gregs, &insn) < 0)
+		goto crash;
+
+	/* where the access starts, which need not be the page that faulted */
+	addr = (uint32_t)(insn.addr - (uintptr_t)bus->base);
+
+	if (insn.store) {
+		uint32_t value = gregs[bus_trap_regs[insn.high8 ? insn.reg - 4 : insn.reg]];
+
+		if (insn.high8)
+			value >>= 8;
+		if (insn.size < 4)
+			value &= (1U << (insn.size * 8)) - 1;
+
+		bus_write_slow(bus, addr, value, insn.size);
+	} else {
+		uint32_t value = bus_read_slow(bus, addr, insn.size);
+
+		if (insn.size == 1)
+			value = insn.sign ? (uint32_t)(int8_t)value : (uint8_t)value;
+		else if (insn.size == 2)
+			value = insn.sign ? (uint32_t)(int16_t)value : (uint16_t)value;
+
+		/* a 32-bit destination clears the upper half */
+		gregs[bus_trap_regs[insn.reg]] = value;
+	}
+
+	gregs[REG_RIP] += insn.len;
+	return;
+
+crash:
+	signal(sig, SIG_DFL);
+}
+
+static void bus_trap_install(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = bus_trap;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(SIGSEGV, &sa, NULL);
+}
+
+#endif /* BUS_FLAT */
@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pool.h>
+
+int pool_nr_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+static int pool_pop(struct pool_worker *w)
+{
+	int job = -1;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->head < w->tail)
+		job = w->head++;
+	pthread_mutex_unlock(&w->lock);
+
+	return job;
+}
+
+static int pool_steal(struct pool_worker *w)
+{
+	struct pool *pool = w->pool;
+
+	for (int i = 1; i < pool->nr_workers; i++) {
+		struct pool_worker *victim = &pool->workers[(w->id + i) % pool->nr_workers];
+		int start, end;
+
+		pthread_mutex_lock(&victim->lock);
+		end = victim->tail;
+		start = end - (end - victim->head + 1) / 2;
+		if (start < end)
+			victim->tail = start;
+		pthread_mutex_unlock(&victim->lock);
+
+		if (start >= end)
+			continue;
+
+		pthread_mutex_lock(&w->lock);
+		w->head = start + 1;
+		w->tail = end;
+		pthread_mutex_unlock(&w->lock);
+
+		return start;
+	}
+
+	return -1;
+}
+
+static void *pool_worker(void *arg)
+{
+	struct pool_worker *w = arg;
+	int job;
+
+	for (;;) {
+		job = pool_pop(w);
+		if (job < 0)
+			job = pool_steal(w);
+		if (job < 0)
+			break;
+
+		w->pool->fn(w->pool->arg, job);
+	}
+
+	return NULL;
+}
+
+/* Run fn(arg, job) for every job in [0, nr_jobs) and wait for all of them. */
+int pool_run(int nr_jobs, int nr_workers, void (*fn)(void *arg, int job), void *arg)
+{
+	struct pool pool;
+	int started = 0;
+
+	if (nr_workers > nr_jobs)
+		nr_workers = nr_jobs;
+	if (nr_workers < 1)
+		return 0;
+
+	pool.workers = calloc(nr_workers, sizeof(*pool.workers));
+	if (!pool.workers)
+		return -ENOMEM;
+
+	pool.nr_workers = nr_workers;
+	pool.fn = fn;
+	pool.arg = arg;
+
+	for (int i = 0; i < nr_workers; i++) {
+		struct pool_worker *w = &pool.workers[i];
+
+		pthread_mutex_init(&w->lock, NULL);
+		w->head = (long)nr_jobs * i / nr_workers;
+		w->tail = (long)nr_jobs * (i + 1) / nr_workers;
+		w->id = i;
+		w->pool = &pool;
+	}
+
+	for (int i = 0; i < nr_workers; i++, started++) {
+		if (pthread_create(&pool.workers[i].thread, NULL, pool_worker, &pool.workers[i])) {
+			printf("cannot start pool worker %d\n", i);
+			break;
+		}
+	}
+
+	/* the jobs of workers that failed to start get stolen by the others */
+	if (!started)
+		pool_worker(&pool.workers[0]);
+
+	for (int i = 0; i < started; i++)
+		pthread_join(pool.workers[i].thread, NULL);
+
+	for (int i = 0; i < nr_workers; i++)
+		pthread_mutex_destroy(&pool.workers[i].lock);
+	free(pool.workers);
+
+	return 0;
+}
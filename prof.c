@@ -0,0 +1,389 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <elf.h>
+#include <vm.h>
+#include <inst.h>
+#include <icache.h>
+#include <prof.h>
+
+struct prof *prof_create(struct vm *vm)
+{
+	struct prof *prof;
+	int nr_slots = vm->rom.size / 2;
+
+	prof = calloc(1, sizeof(*prof));
+	if (!prof)
+		return NULL;
+
+	prof->base = vm->rom.base_addr;
+	prof->size = vm->rom.size;
+
+	prof->count = calloc(nr_slots, sizeof(*prof->count));
+	prof->block = calloc(nr_slots, sizeof(*prof->block));
+	prof->taken = calloc(nr_slots, sizeof(*prof->taken));
+	prof->nodes = malloc(PROF_MAX_NODES * sizeof(*prof->nodes));
+	if (!prof->count || !prof->block || !prof->taken || !prof->nodes) {
+		prof_destroy(prof);
+		return NULL;
+	}
+
+	/* the root is whatever runs first */
+	memset(&prof->nodes[0], 0, sizeof(prof->nodes[0]));
+	prof->nodes[0].func = vm->cpu.pc;
+	prof->nr_nodes = 1;
+	prof->mark = vm->icount;
+
+	return prof;
+}
+
+void prof_destroy(struct prof *prof)
+{
+	for (int i = 0; i < prof->nr_syms; i++)
+		free(prof->syms[i].name);
+
+	free(prof->syms);
+	free(prof->nodes);
+	free(prof->taken);
+	free(prof->block);
+	free(prof->count);
+	free(prof);
+}
+
+static void prof_charge(struct prof *prof, uint64_t icount)
+{
+	prof->nodes[prof->cur].self += icount - prof->mark;
+	prof->mark = icount;
+}
+
+static void prof_call(struct prof *prof, uint32_t func, uint64_t icount)
+{
+	struct prof_node *parent = &prof->nodes[prof->cur];
+	uint32_t child;
+
+	prof_charge(prof, icount);
+
+	for (child = parent->child; child; child = prof->nodes[child].sibling)
+		if (prof->nodes[child].func == func)
+			break;
+
+	if (!child) {
+		/* out of nodes, keep charging the caller */
+		if (prof->nr_nodes == PROF_MAX_NODES)
+			return;
+
+		child = prof->nr_nodes++;
+		prof->nodes[child].func = func;
+		prof->nodes[child].parent = prof->cur;
+		prof->nodes[child].child = 0;
+		prof->nodes[child].sibling = parent->child;
+		prof->nodes[child].self = 0;
+		parent->child = child;
+	}
+
+	prof->cur = child;
+}
+
+static void prof_return(struct prof *prof, uint64_t icount)
+{
+	prof_charge(prof, icount);
+	prof->cur = prof->nodes[prof->cur].parent;
+}
+
+static int is_link(int reg)
+{
+	return reg == 1 || reg == 5;
+}
+
+/*
+ * The interpreter loop of vm_run() with every instruction accounted for.
+ * Calls are jal/jalr linking through ra or t0, returns are jalr through
+ * one of them without linking, as in the RISC-V calling convention hints.
+ */
+void vm_run_prof(struct vm *vm, struct prof *prof)
+{
+	struct inst_decoded *d;
+	uint32_t base = vm->rom.base_addr;
+	uint32_t size = vm->rom.size;
+	uint32_t pc, off;
+	int leader = 1;
+
+	do {
+		pc = vm->cpu.pc;
+		d = icache_lookup(vm->icache, pc);
+		off = (pc - base) >> 1;
+
+		prof->count[off]++;
+		if (leader)
+			prof->block[off]++;
+
+		/* pairs are not fused here, every instruction is counted */
+		vm->cpu.pc = pc + d->len;
+		inst_single_handler(d)(vm, d);
+		vm->icount++;
+
+		switch (d->inst & RV_OPCODE_MASK) {
+		case RV32_BRANCH_B_TYPE:
+			if (vm->cpu.pc != pc + d->len)
+				prof->taken[off]++;
+			leader = 1;
+			break;
+		case RV32_JAL:
+			if (is_link(d->rd))
+				prof_call(prof, vm->cpu.pc, vm->icount);
+			leader = 1;
+			break;
+		case RV32_JALR:
+			if (is_link(d->rd))
+				prof_call(prof, vm->cpu.pc, vm->icount);
+			else if (!d->rd && is_link(d->rs1) && prof->cur)
+				prof_return(prof, vm->icount);
+			leader = 1;
+			break;
+		default:
+			leader = 0;
+			break;
+		}
+	} while (d->inst && !vm->halted && vm->cpu.pc - base < size);
+
+	prof_charge(prof, vm->icount);
+}
+
+static int prof_sym_cmp(const void *a, const void *b)
+{
+	const struct prof_sym *x = a, *y = b;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/*
+ * Pick up the function and code labels of an ELF image's symbol table so
+ * that reports show names rather than addresses.
+ */
+int prof_load_symbols(struct prof *prof, const void *image, int size)
+{
+	const Elf32_Ehdr *eh = image;
+	const Elf32_Shdr *sh;
+	int ret = 0;
+
+	if (!vm_is_elf(image, size) || !eh->e_shoff || eh->e_shentsize != sizeof(Elf32_Shdr) ||
+	    eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf32_Shdr) > size)
+		return 0;
+
+	sh = (const Elf32_Shdr *)((const uint8_t *)image + eh->e_shoff);
+
+	for (int i = 0; i < eh->e_shnum; i++) {
+		struct prof_sym *syms;
+		const Elf32_Sym *sym;
+		const char *strtab;
+		int nr;
+
+		if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum ||
+		    sh[i].sh_offset + (uint64_t)sh[i].sh_size > size ||
+		    sh[sh[i].sh_link].sh_offset + (uint64_t)sh[sh[i].sh_link].sh_size > size)
+			continue;
+
+		sym = (const Elf32_Sym *)((const uint8_t *)image + sh[i].sh_offset);
+		nr = sh[i].sh_size / sizeof(*sym);
+		strtab = (const char *)image + sh[sh[i].sh_link].sh_offset;
+
+		/* the symbols found so far stay usable if this fails */
+		syms = realloc(prof->syms, (prof->nr_syms + nr) * sizeof(*prof->syms));
+		if (!syms) {
+			ret = -ENOMEM;
+			break;
+		}
+		prof->syms = syms;
+
+		for (int j = 0; j < nr; j++, sym++) {
+			int type = ELF32_ST_TYPE(sym->st_info);
+			const char *name = strtab + sym->st_name;
+
+			if (type != STT_FUNC && type != STT_NOTYPE)
+				continue;
+			if (sym->st_shndx == SHN_UNDEF || sym->st_shndx >= SHN_LORESERVE)
+				continue;
+			if (sym->st_name >= sh[sh[i].sh_link].sh_size)
+				continue;
+			/* section and mapping symbols */
+			if (!name[0] || name[0] == '.' || name[0] == '$')
+				continue;
+			if (sym->st_value - prof->base >= prof->size)
+				continue;
+
+			prof->syms[prof->nr_syms].addr = sym->st_value;
+			prof->syms[prof->nr_syms].name = strdup(name);
+			prof->nr_syms++;
+		}
+	}
+
+	qsort(prof->syms, prof->nr_syms, sizeof(*prof->syms), prof_sym_cmp);
+
+	return ret;
+}
+
+static void prof_name(struct prof *prof, uint32_t addr, char *buf, int len)
+{
+	int lo = 0, hi = prof->nr_syms - 1, found = -1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+
+		if (prof->syms[mid].addr <= addr) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	if (found < 0)
+		snprintf(buf, len, "0x%08x", addr);
+	else if (prof->syms[found].addr == addr)
+		snprintf(buf, len, "%s", prof->syms[found].name);
+	else
+		snprintf(buf, len, "%s+0x%x", prof->syms[found].name, addr - prof->syms[found].addr);
+}
+
+struct prof_block {
+	uint32_t start;
+	uint32_t last;
+	uint32_t len;
+	uint64_t entries;
+	uint64_t insts;
+};
+
+static int prof_block_cmp(const void *a, const void *b)
+{
+	const struct prof_block *x = a, *y = b;
+
+	return (x->insts < y->insts) - (x->insts > y->insts);
+}
+
+/* Hot blocks by instructions executed, with the branch ending them if any. */
+void prof_dump(struct prof *prof, struct vm *vm, FILE *out)
+{
+	uint32_t nr_slots = prof->size / 2;
+	struct prof_block *blocks;
+	uint64_t total = 0;
+	int nr = 0;
+	char name[128];
+
+	blocks = malloc(nr_slots * sizeof(*blocks));
+	if (!blocks)
+		return;
+
+	for (uint32_t i = 0; i < nr_slots; i++)
+		total += prof->count[i];
+
+	for (uint32_t i = 0; i < nr_slots; i++) {
+		struct prof_block *b;
+
+		if (!prof->block[i])
+			continue;
+
+		b = &blocks[nr++];
+		b->start = i;
+		b->last = i;
+		b->entries = prof->block[i];
+		b->insts = 0;
+		b->len = 0;
+
+		/* up to the next leader, the block's exit is the last instruction executed */
+		for (uint32_t j = i; j < nr_slots;
+		     j += icache_lookup(vm->icache, prof->base + j * 2)->len >> 1) {
+			if (j != i && prof->block[j])
+				break;
+			if (!prof->count[j])
+				break;
+			b->insts += prof->count[j];
+			b->last = j;
+			b->len++;
+		}
+	}
+
+	qsort(blocks, nr, sizeof(*blocks), prof_block_cmp);
+
+	fprintf(out, "hot blocks (%llu instructions):\n", (unsigned long long)total);
+
+	for (int i = 0; i < nr && i < PROF_HOT_BLOCKS; i++) {
+		struct prof_block *b = &blocks[i];
+		uint32_t addr = prof->base + b->start * 2;
+		uint32_t last = b->last;
+
+		name[0] = '\0';
+		if (prof->nr_syms)
+			prof_name(prof, addr, name, sizeof(name));
+		fprintf(out, "  0x%08x %-24s %4u insts %12llu entries %14llu insts %6.2f%%",
+			addr, name, b->len, (unsigned long long)b->entries,
+			(unsigned long long)b->insts, total ? 100.0 * b->insts / total : 0.0);
+
+		if ((icache_lookup(vm->icache, prof->base + last * 2)->inst & RV_OPCODE_MASK) ==
+		    RV32_BRANCH_B_TYPE)
+			fprintf(out, "  branch taken %llu not taken %llu",
+				(unsigned long long)prof->taken[last],
+				(unsigned long long)(prof->count[last] - prof->taken[last]));
+		fprintf(out, "\n");
+	}
+
+	free(blocks);
+}
+
+static void prof_folded_path(struct prof *prof, uint32_t node, uint32_t *chain,
+			     char *buf, int len)
+{
+	char name[128];
+	int depth = 0;
+	int n = 0;
+
+	for (; node; node = prof->nodes[node].parent)
+		chain[depth++] = node;
+	chain[depth++] = 0;
+
+	while (depth-- && n < len) {
+		prof_name(prof, prof->nodes[chain[depth]].func, name, sizeof(name));
+		n += snprintf(buf + n, len - n, "%s%s", n ? ";" : "", name);
+	}
+}
+
+/*
+ * One line per calling context, "root;caller;callee instructions", which
+ * is what flamegraph.pl and friends take as input.
+ */
+int prof_write_folded(struct prof *prof, const char *path)
+{
+	FILE *out;
+	uint32_t *chain;
+	char *buf;
+	int len = 1 << 16;
+
+	out = fopen(path, "w");
+	if (!out) {
+		printf("cannot create %s.\n", path);
+		return -EIO;
+	}
+
+	buf = malloc(len);
+	chain = malloc(prof->nr_nodes * sizeof(*chain));
+	if (!buf || !chain) {
+		free(buf);
+		fclose(out);
+		return -ENOMEM;
+	}
+
+	for (uint32_t i = 0; i < prof->nr_nodes; i++) {
+		if (!prof->nodes[i].self)
+			continue;
+
+		prof_folded_path(prof, i, chain, buf, len);
+		fprintf(out, "%s %llu\n", buf, (unsigned long long)prof->nodes[i].self);
+	}
+
+	free(chain);
+	free(buf);
+	fclose(out);
+
+	return 0;
+}
@@ -2,27 +2,440 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #include <sizes.h>
 #include <vm.h>
+#include <trace.h>
+#include <batch.h>
+#include <pool.h>
+#include <prof.h>
+#include <ecall.h>
+#include <vq.h>
+#include <inst.h>
+#include <aot.h>
+#include <cache.h>
 
+enum {
+	ENGINE_INTERP = (1 << 0),
+	ENGINE_FAST = (1 << 1),
+	ENGINE_JIT = (1 << 2),
+	ENGINE_LOCKSTEP = (1 << 3),
+	ENGINE_AOT = (1 << 4),		/* only with translated code, -a */
+	ENGINE_ALL = ENGINE_INTERP | ENGINE_FAST | ENGINE_JIT | ENGINE_LOCKSTEP,
+};
+
+static void run_lockstep(struct vm *vm)
+{
+	vm_run_lockstep(&vm, 1);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(struct vm *vm);
+	void (*run_many)(struct vm **vms, int nr);
+	int engine;
+} engines[] = {
+	{ "interp", vm_run, NULL, ENGINE_INTERP },
+	{ "fast", vm_run_fast, NULL, ENGINE_FAST },
+	{ "jit", vm_run_jit, NULL, ENGINE_JIT },
+	{ "lockstep", run_lockstep, vm_run_lockstep, ENGINE_LOCKSTEP },
+	{ "aot", vm_run_aot, NULL, ENGINE_AOT },
+};
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-e interp|fast|jit|lockstep|aot|all] [-a file] [-C dir] [-r] [-t off|inst|regs] [-T file] [-p file] [-i file] [-o file] [-m [base:]size] [-R [base:]size] [-H] <riscv binary or ELF>\n", prog);
+	printf("       %s [-e interp|fast|jit|lockstep|aot] [-a file] [-C dir] [-j workers] [-m [base:]size] [-R [base:]size] [-H] -b <job list>\n", prog);
+	printf("  -e engine\texecution engine, \"all\" runs each of them in turn\n");
+	printf("  -a file\tcode translated by rnv-aot, run by the aot engine (the default then)\n");
+	printf("  -C dir\t\tkeep decoded code in dir between runs, and look there for rnv-aot -C output\n");
+	printf("  -r\t\tdump registers when the guest stops\n");
+	printf("  -t level\trecord the last executed instructions (interp engine, TRACE=1 builds)\n");
+	printf("  -T file\twrite a binary trace of every instruction, see rnv-tracedump\n");
+	printf("  -p file\tprofile on the interp engine: print hot blocks, write folded stacks to file\n");
+	printf("  -i file\tfeed file to the guest's receive queue, \"-\" for stdin\n");
+	printf("  -o file\twrite the guest's send queue to file, \"-\" for stdout\n");
+	printf("  -m region\tguest RAM, e.g. 256M or 0x80000000:1G; defaults to 32K above the image\n");
+	printf("  -R region\tROM of flat binaries, defaults to 0x10000:32K\n");
+	printf("  -H\t\tback guest memory with huge pages\n");
+	printf("  -b list\trun the jobs in list, one \"binary [a0 ... a7]\" per line, in parallel\n");
+	printf("  -j workers\tnumber of batch worker threads, defaults to the number of cpus\n");
+}
+
+static int parse_engines(const char *arg)
+{
+	if (!strcmp(arg, "all"))
+		return ENGINE_ALL;
+
+	for (int i = 0; i < sizeof(engines) / sizeof(engines[0]); i++)
+		if (!strcmp(arg, engines[i].name))
+			return engines[i].engine;
+
+	return 0;
+}
+
+static int parse_size(const char *arg, uint32_t *size)
+{
+	unsigned long long val;
+	char *end;
+
+	val = strtoull(arg, &end, 0);
+	switch (*end) {
+	case 'G':
+		val <<= 10;
+		/* fallthrough */
+	case 'M':
+		val <<= 10;
+		/* fallthrough */
+	case 'K':
+		val <<= 10;
+		end++;
+		break;
+	}
+
+	if (end == arg || *end || !val || val > 0xFFFFF000ULL)
+		return -EINVAL;
+
+	*size = (val + 0xFFF) & ~0xFFFULL;
+
+	return 0;
+}
+
+/* "size" or "base:size", the base page aligned */
+static int parse_region(const char *arg, uint32_t *base, uint32_t *size)
+{
+	const char *colon = strchr(arg, ':');
+	unsigned long long val;
+	char *end;
+
+	if (!colon)
+		return parse_size(arg, size);
+
+	val = strtoull(arg, &end, 0);
+	if (end != colon || val > 0xFFFFFFFFULL || (val & 0xFFF))
+		return -EINVAL;
+
+	*base = val;
+
+	return parse_size(colon + 1, size);
+}
+
+static int open_queue_file(const char *path, int tx)
+{
+	if (!strcmp(path, "-"))
+		return tx ? STDOUT_FILENO : STDIN_FILENO;
+
+	return tx ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+}
+
+/* Attach the queue device to vm, see vq.h, with the files opened anew for each run. */
+static int attach_queues(struct vm *vm, const char *rx_file, const char *tx_file)
+{
+	int rx_fd = -1, tx_fd = -1;
+
+	if (rx_file) {
+		rx_fd = open_queue_file(rx_file, 0);
+		if (rx_fd < 0) {
+			printf("cannot open file: %s\n", rx_file);
+			return -ENOENT;
+		}
+	}
+
+	if (tx_file) {
+		tx_fd = open_queue_file(tx_file, 1);
+		if (tx_fd < 0) {
+			printf("cannot create file: %s\n", tx_file);
+			goto err_close;
+		}
+	}
+
+	if (!vq_create(vm, rx_fd, tx_fd)) {
+		printf("cannot attach queue device.\n");
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	if (rx_fd > STDERR_FILENO)
+		close(rx_fd);
+	if (tx_fd > STDERR_FILENO)
+		close(tx_fd);
+	return -EIO;
+}
+
+static double elapsed(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* How often each kind of fused pair ran, if any did. */
+static void print_fused(struct vm *vm, const char *name)
+{
+	int first = 1;
+
+	for (int i = VM_FUSE_NONE + 1; i < VM_NR_FUSIONS; i++) {
+		if (!vm->fused[i])
+			continue;
+		if (first)
+			printf("%s: fused", name);
+		printf("%s %s %llu", first ? "" : ",", inst_fusion_names[i],
+		       (unsigned long long)vm->fused[i]);
+		first = 0;
+	}
+	if (!first)
+		printf("\n");
+}
+
+/* Returns the guest's exit code, 0 if it did not call exit(), or a negative errno. */
+static int run_engine(int idx, char *bin, int size, int fd, int dump, int regs, int trace,
+		      const char *trace_file, const char *prof_file, const char *rx_file,
+		      const char *tx_file, const struct vm_layout *layout)
+{
+	struct timespec start, end;
+	struct prof *prof = NULL;
+	struct vm *vm;
+	double secs;
+	int ret = 0;
+
+	vm = vm_load_image(bin, size, fd, layout);
+	if (!vm) {
+		printf("cannot create vm.\n");
+		return -ENOMEM;
+	}
+
+	cache_attach(vm);
+
+	if (rx_file || tx_file) {
+		ret = attach_queues(vm, rx_file, tx_file);
+		if (ret < 0)
+			goto err_destroy;
+	}
+
+	if (trace_file) {
+		vm->trace = trace_create_stream(vm, trace_file);
+		if (!vm->trace) {
+			printf("cannot start trace writer.\n");
+			ret = -EIO;
+			goto err_destroy;
+		}
+	} else if (trace != TRACE_OFF) {
+		vm->trace = trace_create(trace, TRACE_RING_RECORDS);
+		if (!vm->trace) {
+			printf("cannot allocate trace buffer.\n");
+			ret = -ENOMEM;
+			goto err_destroy;
+		}
+	}
+
+	if (dump)
+		vm_dump_rom(vm, 32);
+
+	if (prof_file) {
+		prof = prof_create(vm);
+		if (!prof) {
+			printf("cannot allocate profile.\n");
+			ret = -ENOMEM;
+			goto err_destroy;
+		}
+		prof_load_symbols(prof, bin, size);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (prof)
+		vm_run_prof(vm, prof);
+	else
+		engines[idx].run(vm);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = elapsed(&start, &end);
+
+	/* the guest's output goes before the reports */
+	ecall_flush(vm);
+
+	if (vm->trace) {
+		if (!trace_file)
+			trace_dump(vm->trace, stdout);
+		trace_destroy(vm->trace);
+		vm->trace = NULL;
+	}
+
+	if (prof) {
+		prof_dump(prof, vm, stdout);
+		prof_write_folded(prof, prof_file);
+		prof_destroy(prof);
+	}
+
+	if (regs)
+		vm_dump_registers(vm);
+
+	printf("%s: %llu instructions in %.6f s (%.2f MIPS)\n", engines[idx].name,
+	       (unsigned long long)vm->icount, secs, secs > 0 ? vm->icount / secs / 1e6 : 0.0);
+
+	print_fused(vm, engines[idx].name);
+
+	if (vm->exited) {
+		printf("%s: exit code %d\n", engines[idx].name, vm->exit_code);
+		ret = vm->exit_code & 0xFF;
+	}
+
+	vm_destroy(vm);
+
+	return ret;
+
+err_destroy:
+	if (vm->trace)
+		trace_destroy(vm->trace);
+	vm_destroy(vm);
+	return ret;
+}
 
 int main(int argc, char **argv)
 {
 	int fd;
+	int opt;
+	int ret = 0;
+	int engine = 0;
+	int regs = 0;
+	int trace = TRACE_OFF;
+	const char *trace_file = NULL;
+	const char *batch = NULL;
+	const char *prof_file = NULL;
+	const char *rx_file = NULL;
+	const char *tx_file = NULL;
+	const char *aot_file = NULL;
+	const char *cache_dir = NULL;
+	struct vm_layout layout = VM_LAYOUT_DEFAULT;
+	int workers = pool_nr_cpus();
 	char *bin;
 	struct stat sb;
-	struct vm *vm;
 
-	if (argc < 2) {
+	while ((opt = getopt(argc, argv, "e:a:C:rt:T:p:i:o:m:R:Hb:j:h")) != -1) {
+		switch (opt) {
+		case 'e':
+			engine = parse_engines(optarg);
+			if (!engine) {
+				printf("unknown engine: %s\n", optarg);
+				usage(argv[0]);
+				return -EINVAL;
+			}
+			break;
+		case 'a':
+			aot_file = optarg;
+			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
+		case 'r':
+			regs = 1;
+			break;
+		case 't':
+			trace = trace_parse_level(optarg);
+			if (trace < 0) {
+				printf("unknown trace level: %s\n", optarg);
+				usage(argv[0]);
+				return -EINVAL;
+			}
+#ifndef CONFIG_TRACE
+			if (trace != TRACE_OFF)
+				printf("tracing is not built in, rebuild with TRACE=1.\n");
+#endif
+			break;
+		case 'T':
+			trace_file = optarg;
+#ifndef CONFIG_TRACE
+			printf("tracing is not built in, rebuild with TRACE=1.\n");
+#endif
+			break;
+		case 'p':
+			prof_file = optarg;
+			break;
+		case 'i':
+			rx_file = optarg;
+			break;
+		case 'o':
+			tx_file = optarg;
+			break;
+		case 'm':
+			if (parse_region(optarg, &layout.ram_base, &layout.ram_size) < 0) {
+				printf("invalid RAM region: %s\n", optarg);
+				return -EINVAL;
+			}
+			break;
+		case 'R':
+			if (parse_region(optarg, &layout.rom_base, &layout.rom_size) < 0) {
+				printf("invalid ROM region: %s\n", optarg);
+				return -EINVAL;
+			}
+			break;
+		case 'H':
+			layout.huge = 1;
+			break;
+		case 'b':
+			batch = optarg;
+			break;
+		case 'j':
+			workers = atoi(optarg);
+			if (workers < 1) {
+				printf("invalid number of workers: %s\n", optarg);
+				return -EINVAL;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return -EINVAL;
+		}
+	}
+
+	if (cache_dir && cache_init(cache_dir) < 0)
+		return -EINVAL;
+
+	if (aot_file) {
+		if (aot_load(aot_file) < 0)
+			return -EINVAL;
+		if (!engine)
+			engine = ENGINE_AOT;
+		else if (engine == ENGINE_ALL)
+			engine |= ENGINE_AOT;
+	} else if ((engine & ENGINE_AOT) && !cache_dir) {
+		printf("the aot engine needs translated code, see -a and -C.\n");
+		return -EINVAL;
+	}
+
+	if (!engine)
+		engine = ENGINE_INTERP;
+
+	if (batch) {
+		for (int i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+			if (engine != engines[i].engine)
+				continue;
+
+			return batch_run(batch, engines[i].run, engines[i].run_many,
+					 engines[i].name, workers, &layout);
+		}
+
+		printf("batch mode runs a single engine.\n");
+		return -EINVAL;
+	}
+
+	if (prof_file && engine != ENGINE_INTERP) {
+		printf("profiling runs on the interp engine.\n");
+		engine = ENGINE_INTERP;
+	}
+
+	if (optind >= argc) {
 		printf("riscv binary path not specified.\n");
+		usage(argv[0]);
+		return -EINVAL;
 	}
 
-	fd = open(argv[1], O_RDONLY);
+	fd = open(argv[optind], O_RDONLY);
 	if (fd < 0) {
-		printf("cannot open file: %s\n", argv[1]);
+		printf("cannot open file: %s\n", argv[optind]);
 		return -ENOENT;
 	}
 
@@ -37,16 +450,20 @@ int main(int argc, char **argv)
 		return -EIO;
 	}
 
-	vm = vm_init(0x10000, SZ_32K, SZ_32K);
+	for (int i = 0, first = 1; i < sizeof(engines) / sizeof(engines[0]); i++) {
+		if (!(engine & engines[i].engine))
+			continue;
+
+		ret = run_engine(i, bin, sb.st_size, fd, first, regs, trace, trace_file,
+				 prof_file, rx_file, tx_file, &layout);
+		if (ret < 0)
+			break;
 
-	vm_load_bin(vm, bin, sb.st_size);
+		first = 0;
+	}
 
 	munmap(bin, sb.st_size);
 	close(fd);
 
-	vm_dump_rom(vm, 32);
-
-	vm_run(vm);
-
-	return 0;
+	return ret;
 }
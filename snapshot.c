@@ -0,0 +1,235 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <vm.h>
+#include <mm.h>
+
+#define SNAPSHOT_MAX_MEMS	(2 + VM_MAX_SEGMENTS)
+
+/*
+ * Saved state of a vm: its cpu and its writable memories, copied on write.
+ * The bus tracks those pages and hands each one to snapshot_written() before
+ * its first write lands, which copies it into an area only committed as it
+ * fills, so memory the guest never writes costs nothing. vm_restore() copies
+ * back the pages logged since. Devices that have state_size are saved along
+ * with it. Only the last snapshot taken of a vm can be restored.
+ */
+struct vm_snapshot {
+	struct vm *vm;
+	struct cpu cpu;
+	uint64_t icount;
+	int halted;
+	int exited;
+	int exit_code;
+	uint32_t brk;
+	struct memory *mems[SNAPSHOT_MAX_MEMS];
+	uint8_t *copies[SNAPSHOT_MAX_MEMS];
+	uint8_t *copied[SNAPSHOT_MAX_MEMS];	/* per page, in copies[] yet */
+	int nr_mems;
+	void *devices[BUS_MAX_MMIO];
+};
+
+static uint32_t snapshot_nr_pages(const struct memory *mem)
+{
+	return (mem->size + BUS_PAGE_SIZE - 1) >> BUS_PAGE_SHIFT;
+}
+
+static int snapshot_add(struct vm_snapshot *snap, struct memory *mem)
+{
+	void *copy;
+	uint8_t *copied;
+
+	if (!mem->mem || !(mem->attr & RW))
+		return 0;
+
+	copy = mmap(NULL, mem->size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (copy == MAP_FAILED)
+		return -ENOMEM;
+
+	copied = calloc(snapshot_nr_pages(mem), 1);
+	if (!copied) {
+		munmap(copy, mem->size);
+		return -ENOMEM;
+	}
+
+	snap->mems[snap->nr_mems] = mem;
+	snap->copies[snap->nr_mems] = copy;
+	snap->copied[snap->nr_mems] = copied;
+	snap->nr_mems++;
+
+	return mm_bus_track(&snap->vm->bus, mem);
+}
+
+/* the memory page nr lies in, with its offset there */
+static int snapshot_find(struct vm_snapshot *snap, uint32_t nr, uint32_t *offset, uint32_t *len)
+{
+	for (int i = 0; i < snap->nr_mems; i++) {
+		struct memory *mem = snap->mems[i];
+
+		*offset = (nr << BUS_PAGE_SHIFT) - mem->base_addr;
+		if (*offset >= mem->size)
+			continue;
+
+		*len = BUS_PAGE_SIZE;
+		if (*len > mem->size - *offset)
+			*len = mem->size - *offset;
+
+		return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Called by the bus before the first write to a tracked page since the last
+ * snapshot or restore, from the fault handler on the flat bus: no allocation.
+ */
+static void snapshot_written(struct bus *bus, uint32_t nr)
+{
+	struct vm_snapshot *snap = container_of(bus, struct vm, bus)->snapshot;
+	uint32_t offset, len;
+	int i;
+
+	if (!snap)
+		return;
+
+	i = snapshot_find(snap, nr, &offset, &len);
+	if (i < 0 || snap->copied[i][offset >> BUS_PAGE_SHIFT])
+		return;
+
+	memcpy(snap->copies[i] + offset, snap->mems[i]->mem + offset, len);
+	snap->copied[i][offset >> BUS_PAGE_SHIFT] = 1;
+}
+
+static int snapshot_add_devices(struct vm_snapshot *snap)
+{
+	struct bus *bus = &snap->vm->bus;
+
+	for (int i = 0; i < bus->nr_mmio; i++) {
+		const struct bus_mmio_ops *ops = bus->mmio[i].ops;
+
+		if (!ops->state_size)
+			continue;
+
+		snap->devices[i] = malloc(ops->state_size);
+		if (!snap->devices[i])
+			return -ENOMEM;
+
+		ops->save(bus->mmio[i].opaque, snap->devices[i]);
+	}
+
+	return 0;
+}
+
+struct vm_snapshot *vm_snapshot(struct vm *vm)
+{
+	struct vm_snapshot *snap;
+	int ret;
+
+	snap = calloc(1, sizeof(*snap));
+	if (!snap)
+		return NULL;
+
+	snap->vm = vm;
+	snap->cpu = vm->cpu;
+	snap->icount = vm->icount;
+	snap->halted = vm->halted;
+	snap->exited = vm->exited;
+	snap->exit_code = vm->exit_code;
+	snap->brk = vm->brk;
+
+	/* the log restarts from this snapshot */
+	mm_bus_clear_dirty(&vm->bus);
+
+	ret = snapshot_add(snap, &vm->rom);
+	if (ret < 0)
+		goto err_destroy;
+
+	ret = snapshot_add(snap, &vm->ram);
+	if (ret < 0)
+		goto err_destroy;
+
+	for (int i = 0; i < vm->nr_segments; i++) {
+		ret = snapshot_add(snap, &vm->segments[i]);
+		if (ret < 0)
+			goto err_destroy;
+	}
+
+	ret = snapshot_add_devices(snap);
+	if (ret < 0)
+		goto err_destroy;
+
+	vm->snapshot = snap;
+	vm->bus.written = snapshot_written;
+
+	return snap;
+
+err_destroy:
+	printf("cannot snapshot vm.\n");
+	vm_snapshot_destroy(snap);
+	return NULL;
+}
+
+static void snapshot_restore_page(struct vm_snapshot *snap, uint32_t nr)
+{
+	uint32_t offset, len;
+	int i;
+
+	i = snapshot_find(snap, nr, &offset, &len);
+	if (i < 0 || !snap->copied[i][offset >> BUS_PAGE_SHIFT])
+		return;
+
+	memcpy(snap->mems[i]->mem + offset, snap->copies[i] + offset, len);
+}
+
+/* Put vm back in the state of snap, copying only the pages written since. */
+int vm_restore(struct vm *vm, struct vm_snapshot *snap)
+{
+	struct bus *bus = &vm->bus;
+
+	if (snap->vm != vm || vm->snapshot != snap)
+		return -EINVAL;
+
+	for (int i = 0; i < bus->nr_dirty; i++)
+		snapshot_restore_page(snap, bus->dirty[i]);
+
+	mm_bus_clear_dirty(bus);
+
+	vm->cpu = snap->cpu;
+	vm->icount = snap->icount;
+	vm->halted = snap->halted;
+	vm->exited = snap->exited;
+	vm->exit_code = snap->exit_code;
+	vm->brk = snap->brk;
+
+	for (int i = 0; i < bus->nr_mmio; i++) {
+		if (snap->devices[i])
+			bus->mmio[i].ops->restore(bus->mmio[i].opaque, snap->devices[i]);
+	}
+
+	return 0;
+}
+
+void vm_snapshot_destroy(struct vm_snapshot *snap)
+{
+	struct vm *vm = snap->vm;
+
+	if (vm->snapshot == snap) {
+		vm->snapshot = NULL;
+		vm->bus.written = NULL;
+	}
+
+	for (int i = 0; i < snap->nr_mems; i++) {
+		munmap(snap->copies[i], snap->mems[i]->size);
+		free(snap->copied[i]);
+	}
+
+	for (int i = 0; i < BUS_MAX_MMIO; i++)
+		free(snap->devices[i]);
+
+	free(snap);
+}
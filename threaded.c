@@ -0,0 +1,347 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vm.h>
+#include <inst.h>
+#include <mm.h>
+
+/*
+ * Direct-threaded interpreter: every ROM halfword gets an op holding the
+ * address of the label implementing it, so dispatch is a single indirect
+ * jump from the end of the previous op. All RV32I handlers live in
+ * vm_run_fast() and work on a local copy of the register file.
+ */
+struct threaded_op {
+	const void *label;
+	struct inst_decoded d;
+};
+
+struct threaded {
+	struct threaded_op *ops;
+	int nr_ops;
+};
+
+static struct threaded *threaded_create(struct vm *vm, const void *translate, const void *exit)
+{
+	struct threaded *t;
+
+	t = malloc(sizeof(*t));
+	if (!t)
+		return NULL;
+
+	t->nr_ops = vm->rom.size / 2;
+
+	/*
+	 * Two extra ops so that falling off the end of the ROM exits, even
+	 * from a 32-bit instruction starting at its last halfword.
+	 */
+	t->ops = calloc(t->nr_ops + 2, sizeof(*t->ops));
+	if (!t->ops) {
+		free(t);
+		return NULL;
+	}
+
+	for (int i = 0; i < t->nr_ops; i++)
+		t->ops[i].label = translate;
+	t->ops[t->nr_ops].label = exit;
+	t->ops[t->nr_ops + 1].label = exit;
+
+	return t;
+}
+
+void vm_flush_fast(struct vm *vm)
+{
+	if (!vm->threaded)
+		return;
+
+	free(vm->threaded->ops);
+	free(vm->threaded);
+	vm->threaded = NULL;
+}
+
+#define RD	x[op->d.rd]
+#define RS1	x[op->d.rs1]
+#define RS2	x[op->d.rs2]
+#define IMM	op->d.imm
+
+#define OP_PC()		(base + (uint32_t)(op - ops) * 2)
+
+#define DISPATCH()	do { x[0] = 0; icount++; goto *op->label; } while (0)
+#define NEXT()		do { op += op->d.len >> 1; DISPATCH(); } while (0)
+#define JUMP(addr)	do {						\
+				uint32_t __addr = (addr);		\
+				if (__addr - base >= size ||		\
+				    vm->halted) {			\
+					pc = __addr;			\
+					goto out;			\
+				}					\
+				op = &ops[(__addr - base) >> 1];	\
+				DISPATCH();				\
+			} while (0)
+#define BRANCH(cond)	do { if (cond) JUMP(op->d.target); NEXT(); } while (0)
+/* an access that faulted halts the vm, nothing after it may run */
+#define MEM()		do {						\
+				if (vm->halted) {			\
+					pc = OP_PC();			\
+					goto out;			\
+				}					\
+				NEXT();					\
+			} while (0)
+
+/* fused pairs, see inst_fusion(): the second op retires here too */
+#define PAIR		(op + (op->d.len >> 1))
+#define FUSED(kind)	do { icount++; fused[kind]++; } while (0)
+#define SLT_BRANCH(cond) do {						\
+				uint32_t __cond = (cond);		\
+				RD = __cond;				\
+				FUSED(VM_FUSE_SLT_BRANCH);		\
+				op = PAIR;				\
+				BRANCH(__cond == ((op->d.inst >> 12) & 1)); \
+			} while (0)
+
+void vm_run_fast(struct vm *vm)
+{
+	static const void *labels[RV_NR_OPCODES] = {
+		[RV32I_LUI] = &&op_lui,
+		[RV32I_AUIPC] = &&op_auipc,
+		[RV32I_JAL] = &&op_jal,
+		[RV32I_JALR] = &&op_jalr,
+		[RV32I_BEQ] = &&op_beq,
+		[RV32I_BNE] = &&op_bne,
+		[RV32I_BLT] = &&op_blt,
+		[RV32I_BGE] = &&op_bge,
+		[RV32I_BLTU] = &&op_bltu,
+		[RV32I_BGEU] = &&op_bgeu,
+		[RV32I_LB] = &&op_lb,
+		[RV32I_LH] = &&op_lh,
+		[RV32I_LW] = &&op_lw,
+		[RV32I_LBU] = &&op_lbu,
+		[RV32I_LHU] = &&op_lhu,
+		[RV32I_SB] = &&op_sb,
+		[RV32I_SH] = &&op_sh,
+		[RV32I_SW] = &&op_sw,
+		[RV32I_ADDI] = &&op_addi,
+		[RV32I_SLTI] = &&op_slti,
+		[RV32I_SLTIU] = &&op_sltiu,
+		[RV32I_XORI] = &&op_xori,
+		[RV32I_ORI] = &&op_ori,
+		[RV32I_ANDI] = &&op_andi,
+		[RV32I_SLLI] = &&op_slli,
+		[RV32I_SRLI_SRAI] = &&op_srli,
+		[RV32I_SRAI] = &&op_srai,
+		[RV32I_ADD_SUB] = &&op_add,
+		[RV32I_SUB] = &&op_sub,
+		[RV32I_SLL] = &&op_sll,
+		[RV32I_SLT] = &&op_slt,
+		[RV32I_SLTU] = &&op_sltu,
+		[RV32I_XOR] = &&op_xor,
+		[RV32I_SRL_SRA] = &&op_srl,
+		[RV32I_SRA] = &&op_sra,
+		[RV32I_OR] = &&op_or,
+		[RV32I_AND] = &&op_and,
+		[RV32M_MUL] = &&op_mul,
+		[RV32M_MULH] = &&op_mulh,
+		[RV32M_MULHSU] = &&op_mulhsu,
+		[RV32M_MULHU] = &&op_mulhu,
+		[RV32M_DIV] = &&op_div,
+		[RV32M_DIVU] = &&op_divu,
+		[RV32M_REM] = &&op_rem,
+		[RV32M_REMU] = &&op_remu,
+		[RV32I_FENCE] = &&op_nop,
+		[RV32I_ECALL_EBREAK] = &&op_ecall,
+	};
+	struct threaded_op *ops, *op;
+	uint32_t base = vm->rom.base_addr;
+	uint32_t size = vm->rom.size;
+	uint32_t pc = vm->cpu.pc;
+	uint64_t icount = 0;
+	uint64_t fused[VM_NR_FUSIONS] = { 0 };
+	struct bus *bus = &vm->bus;
+	uint32_t x[32];
+
+	if (!vm->threaded) {
+		vm->threaded = threaded_create(vm, &&op_translate, &&op_exit);
+		if (!vm->threaded) {
+			printf("cannot allocate threaded code\n");
+			return;
+		}
+	}
+
+	ops = vm->threaded->ops;
+
+	memcpy(x, &vm->cpu.regs, sizeof(x));
+
+	JUMP(pc);
+
+op_translate:
+	{
+		uint32_t addr = OP_PC();
+		struct threaded_op *next;
+		int index;
+
+		inst_decode_fetched(&op->d, bus_fetch(bus, addr), addr);
+		index = inst_opcode_index(op->d.inst);
+
+		if (!op->d.inst)
+			op->label = &&op_halt;
+		else if (index < 0 || !labels[index])
+			op->label = &&op_unknown;
+		else
+			op->label = labels[index];
+
+		/*
+		 * Look at the op after this one for a pair to fuse. Only this
+		 * op changes, the next one still runs alone when jumped to.
+		 */
+		next = PAIR;
+		if (next - ops >= vm->threaded->nr_ops)
+			goto *op->label;
+
+		if (next->label == &&op_translate)
+			inst_decode_fetched(&next->d, bus_fetch(bus, addr + op->d.len),
+					    addr + op->d.len);
+
+		switch (inst_fusion(&op->d, &next->d)) {
+		case VM_FUSE_LUI_ADDI:
+			op->label = &&op_lui_addi;
+			break;
+		case VM_FUSE_AUIPC_JALR:
+			op->label = &&op_auipc_jalr;
+			break;
+		case VM_FUSE_AUIPC_LW:
+			op->label = &&op_auipc_lw;
+			break;
+		case VM_FUSE_SLT_BRANCH:
+			if (index == RV32I_SLT)
+				op->label = &&op_slt_branch;
+			else if (index == RV32I_SLTU)
+				op->label = &&op_sltu_branch;
+			else if (index == RV32I_SLTI)
+				op->label = &&op_slti_branch;
+			else
+				op->label = &&op_sltiu_branch;
+			break;
+		case VM_FUSE_ADDI_BNE:
+			op->label = &&op_addi_bne;
+			break;
+		}
+
+		goto *op->label;
+	}
+
+op_lui:		RD = IMM; NEXT();
+op_auipc:	RD = IMM; NEXT();
+op_jal:		RD = OP_PC() + op->d.len; JUMP(op->d.target);
+op_jalr:
+	{
+		uint32_t addr = (RS1 + IMM) & ~(uint32_t)1;
+
+		RD = OP_PC() + op->d.len;
+		JUMP(addr);
+	}
+
+op_beq:		BRANCH(RS1 == RS2);
+op_bne:		BRANCH(RS1 != RS2);
+op_blt:		BRANCH((int32_t)RS1 < (int32_t)RS2);
+op_bge:		BRANCH((int32_t)RS1 >= (int32_t)RS2);
+op_bltu:	BRANCH(RS1 < RS2);
+op_bgeu:	BRANCH(RS1 >= RS2);
+
+op_lb:		RD = bus_read_s8(bus, RS1 + IMM); MEM();
+op_lh:		RD = bus_read_s16(bus, RS1 + IMM); MEM();
+op_lw:		RD = bus_read_u32(bus, RS1 + IMM); MEM();
+op_lbu:		RD = bus_read_u8(bus, RS1 + IMM); MEM();
+op_lhu:		RD = bus_read_u16(bus, RS1 + IMM); MEM();
+op_sb:		bus_write_u8(bus, RS1 + IMM, RS2); MEM();
+op_sh:		bus_write_u16(bus, RS1 + IMM, RS2); MEM();
+op_sw:		bus_write_u32(bus, RS1 + IMM, RS2); MEM();
+
+op_addi:	RD = RS1 + IMM; NEXT();
+op_slti:	RD = (int32_t)RS1 < IMM; NEXT();
+op_sltiu:	RD = RS1 < (uint32_t)IMM; NEXT();
+op_xori:	RD = RS1 ^ IMM; NEXT();
+op_ori:		RD = RS1 | IMM; NEXT();
+op_andi:	RD = RS1 & IMM; NEXT();
+op_slli:	RD = RS1 << IMM; NEXT();
+op_srli:	RD = RS1 >> IMM; NEXT();
+op_srai:	RD = (int32_t)RS1 >> IMM; NEXT();
+
+op_add:		RD = RS1 + RS2; NEXT();
+op_sub:		RD = RS1 - RS2; NEXT();
+op_sll:		RD = RS1 << (RS2 & 0x1F); NEXT();
+op_slt:		RD = (int32_t)RS1 < (int32_t)RS2; NEXT();
+op_sltu:	RD = RS1 < RS2; NEXT();
+op_xor:		RD = RS1 ^ RS2; NEXT();
+op_srl:		RD = RS1 >> (RS2 & 0x1F); NEXT();
+op_sra:		RD = (int32_t)RS1 >> (RS2 & 0x1F); NEXT();
+op_or:		RD = RS1 | RS2; NEXT();
+op_and:		RD = RS1 & RS2; NEXT();
+
+op_mul:		RD = RS1 * RS2; NEXT();
+op_mulh:	RD = rv32m_mulh(RS1, RS2); NEXT();
+op_mulhsu:	RD = rv32m_mulhsu(RS1, RS2); NEXT();
+op_mulhu:	RD = rv32m_mulhu(RS1, RS2); NEXT();
+op_div:		RD = rv32m_div(RS1, RS2); NEXT();
+op_divu:	RD = rv32m_divu(RS1, RS2); NEXT();
+op_rem:		RD = rv32m_rem(RS1, RS2); NEXT();
+op_remu:	RD = rv32m_remu(RS1, RS2); NEXT();
+
+op_nop:		NEXT();
+
+op_lui_addi:	RD = IMM + PAIR->d.imm; FUSED(VM_FUSE_LUI_ADDI); op = PAIR; NEXT();
+op_auipc_jalr:
+	{
+		uint32_t addr = (IMM + PAIR->d.imm) & ~(uint32_t)1;
+
+		RD = IMM;
+		x[PAIR->d.rd] = OP_PC() + op->d.len + PAIR->d.len;
+		FUSED(VM_FUSE_AUIPC_JALR);
+		JUMP(addr);
+	}
+op_auipc_lw:
+	RD = IMM;
+	x[PAIR->d.rd] = bus_read_u32(bus, IMM + PAIR->d.imm);
+	FUSED(VM_FUSE_AUIPC_LW);
+	op = PAIR;
+	MEM();
+op_slt_branch:	SLT_BRANCH((int32_t)RS1 < (int32_t)RS2);
+op_sltu_branch:	SLT_BRANCH(RS1 < RS2);
+op_slti_branch:	SLT_BRANCH((int32_t)RS1 < IMM);
+op_sltiu_branch: SLT_BRANCH(RS1 < (uint32_t)IMM);
+op_addi_bne:	RD = RS1 + IMM; FUSED(VM_FUSE_ADDI_BNE); op = PAIR; BRANCH(RS1 != RS2);
+
+op_ecall:
+	/* syscalls work on vm->cpu, hand the registers over and back */
+	x[0] = 0;
+	memcpy(&vm->cpu.regs, x, sizeof(x));
+	vm->cpu.pc = OP_PC() + op->d.len;
+	op->d.handler(vm, &op->d);
+	memcpy(x, &vm->cpu.regs, sizeof(x));
+	if (vm->halted) {
+		pc = vm->cpu.pc;
+		goto out;
+	}
+	NEXT();
+
+op_unknown:
+	printf("UNKNOWN (0x%08x)\n", op->d.inst);
+	NEXT();
+
+op_halt:
+	pc = OP_PC() + op->d.len;
+	goto out;
+
+op_exit:
+	/* ran off the end of the ROM, this was not an instruction */
+	icount--;
+	pc = OP_PC();
+
+out:
+	x[0] = 0;
+	memcpy(&vm->cpu.regs, x, sizeof(x));
+	vm->cpu.pc = pc;
+	vm->icount += icount;
+	for (int i = 0; i < VM_NR_FUSIONS; i++)
+		vm->fused[i] += fused[i];
+}
@@ -0,0 +1,127 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <vm.h>
+#include <mm.h>
+#include <timer.h>
+
+static uint64_t timer_host_ticks(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * TIMER_FREQ + ts.tv_nsec / (1000000000 / TIMER_FREQ);
+}
+
+static uint64_t timer_mtime(struct timer *timer)
+{
+	return timer_host_ticks() + timer->offset;
+}
+
+static void timer_set_mtime(struct timer *timer, uint64_t mtime)
+{
+	timer->offset = mtime - timer_host_ticks();
+}
+
+static uint32_t timer_read(void *opaque, uint32_t offset, int size)
+{
+	struct timer *timer = opaque;
+
+	switch (offset) {
+	case TIMER_STATUS:
+		return timer_mtime(timer) >= timer->mtimecmp;
+	case TIMER_MTIMECMP:
+		return timer->mtimecmp;
+	case TIMER_MTIMECMP_HI:
+		return timer->mtimecmp >> 32;
+	case TIMER_MTIME:
+		return timer_mtime(timer);
+	case TIMER_MTIME_HI:
+		return timer_mtime(timer) >> 32;
+	}
+
+	return 0;
+}
+
+static void timer_write(void *opaque, uint32_t offset, uint32_t value, int size)
+{
+	struct timer *timer = opaque;
+	uint64_t mtime;
+
+	switch (offset) {
+	case TIMER_MTIMECMP:
+		timer->mtimecmp = (timer->mtimecmp & ~0xFFFFFFFFULL) | value;
+		break;
+	case TIMER_MTIMECMP_HI:
+		timer->mtimecmp = (timer->mtimecmp & 0xFFFFFFFFULL) | ((uint64_t)value << 32);
+		break;
+	case TIMER_MTIME:
+		mtime = timer_mtime(timer);
+		timer_set_mtime(timer, (mtime & ~0xFFFFFFFFULL) | value);
+		break;
+	case TIMER_MTIME_HI:
+		mtime = timer_mtime(timer);
+		timer_set_mtime(timer, (mtime & 0xFFFFFFFFULL) | ((uint64_t)value << 32));
+		break;
+	}
+}
+
+static void timer_release(void *opaque)
+{
+	free(opaque);
+}
+
+/* mtime is saved rather than the offset, so it resumes where it was */
+struct timer_state {
+	uint64_t mtime;
+	uint64_t mtimecmp;
+};
+
+static void timer_save(void *opaque, void *state)
+{
+	struct timer *timer = opaque;
+	struct timer_state *ts = state;
+
+	ts->mtime = timer_mtime(timer);
+	ts->mtimecmp = timer->mtimecmp;
+}
+
+static void timer_restore(void *opaque, const void *state)
+{
+	struct timer *timer = opaque;
+	const struct timer_state *ts = state;
+
+	timer_set_mtime(timer, ts->mtime);
+	timer->mtimecmp = ts->mtimecmp;
+}
+
+static const struct bus_mmio_ops timer_ops = {
+	.read = timer_read,
+	.write = timer_write,
+	.release = timer_release,
+	.state_size = sizeof(struct timer_state),
+	.save = timer_save,
+	.restore = timer_restore,
+};
+
+int timer_attach(struct vm *vm, uint32_t base)
+{
+	struct timer *timer;
+	int ret;
+
+	timer = calloc(1, sizeof(*timer));
+	if (!timer)
+		return -ENOMEM;
+
+	/* mtime starts at zero with the vm, mtimecmp out of reach */
+	timer_set_mtime(timer, 0);
+	timer->mtimecmp = ~0ULL;
+
+	ret = mm_bus_map_mmio(&vm->bus, base, TIMER_SIZE, &timer_ops, timer);
+	if (ret < 0)
+		free(timer);
+
+	return ret;
+}
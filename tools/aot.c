@@ -0,0 +1,655 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vm.h>
+#include <inst.h>
+#include <mm.h>
+#include <aot.h>
+#include <cache.h>
+
+/*
+ * Ahead-of-time translator: loads a guest binary the way rnv does, finds
+ * its code by following control flow from the entry point, and writes it
+ * out as C built into a shared object for "rnv -e aot -a". Code is found
+ * from the entry, static jump and branch targets, return sites, any ROM
+ * address a register is loaded with and any word of the image holding one
+ * (function pointers, jump tables). Whatever is not found is left to the
+ * interpreter at run time.
+ */
+
+#ifndef AOT_INCLUDE_DIR
+#define AOT_INCLUDE_DIR		"include"
+#endif
+
+enum {
+	AOT_CODE = (1 << 0),	/* an instruction starts here */
+	AOT_LABEL = (1 << 1),	/* entered from elsewhere, through the dispatch */
+};
+
+struct aot {
+	struct vm *vm;
+	uint32_t base;
+	uint32_t size;
+	uint8_t *flags;		/* per ROM halfword */
+	uint32_t *work;		/* PCs left to walk */
+	int nr_work;
+	int nr_labels;
+};
+
+/* a and b are rs1 and rs2, or the immediate: same as the handlers in inst.c */
+static const char *aot_alu_ops[RV_NR_OPCODES] = {
+	[RV32I_ADDI] = "a + b",
+	[RV32I_SLTI] = "((int32_t)a < (int32_t)b) ? 1 : 0",
+	[RV32I_SLTIU] = "(a < b) ? 1 : 0",
+	[RV32I_XORI] = "a ^ b",
+	[RV32I_ORI] = "a | b",
+	[RV32I_ANDI] = "a & b",
+	[RV32I_SLLI] = "a << b",
+	[RV32I_SRLI_SRAI] = "a >> b",
+	[RV32I_SRAI] = "(int32_t)a >> b",
+	[RV32I_ADD_SUB] = "a + b",
+	[RV32I_SUB] = "a - b",
+	[RV32I_SLL] = "a << (b & 0x1F)",
+	[RV32I_SLT] = "((int32_t)a < (int32_t)b) ? 1 : 0",
+	[RV32I_SLTU] = "(a < b) ? 1 : 0",
+	[RV32I_XOR] = "a ^ b",
+	[RV32I_SRL_SRA] = "a >> (b & 0x1F)",
+	[RV32I_SRA] = "(int32_t)a >> (b & 0x1F)",
+	[RV32I_OR] = "a | b",
+	[RV32I_AND] = "a & b",
+	[RV32M_MUL] = "a * b",
+	[RV32M_MULH] = "rv32m_mulh(a, b)",
+	[RV32M_MULHSU] = "rv32m_mulhsu(a, b)",
+	[RV32M_MULHU] = "rv32m_mulhu(a, b)",
+	[RV32M_DIV] = "rv32m_div(a, b)",
+	[RV32M_DIVU] = "rv32m_divu(a, b)",
+	[RV32M_REM] = "rv32m_rem(a, b)",
+	[RV32M_REMU] = "rv32m_remu(a, b)",
+};
+
+static const char *aot_branch_ops[RV_NR_OPCODES] = {
+	[RV32I_BEQ] = "a == b",
+	[RV32I_BNE] = "a != b",
+	[RV32I_BLT] = "(int32_t)a < (int32_t)b",
+	[RV32I_BGE] = "(int32_t)a >= (int32_t)b",
+	[RV32I_BLTU] = "a < b",
+	[RV32I_BGEU] = "a >= b",
+};
+
+static const char *aot_load_ops[RV_NR_OPCODES] = {
+	[RV32I_LB] = "bus_read_s8",
+	[RV32I_LH] = "bus_read_s16",
+	[RV32I_LW] = "bus_read_u32",
+	[RV32I_LBU] = "bus_read_u8",
+	[RV32I_LHU] = "bus_read_u16",
+};
+
+static const char *aot_store_ops[RV_NR_OPCODES] = {
+	[RV32I_SB] = "bus_write_u8",
+	[RV32I_SH] = "bus_write_u16",
+	[RV32I_SW] = "bus_write_u32",
+};
+
+static int aot_in_rom(struct aot *a, uint32_t pc)
+{
+	return pc - a->base < a->size && !(pc & 1);
+}
+
+static void aot_decode(struct aot *a, struct inst_decoded *d, uint32_t pc)
+{
+	inst_decode_fetched(d, bus_fetch(&a->vm->bus, pc), pc);
+}
+
+/* The opcode index of what d can be translated as, -1 to leave it to the interpreter. */
+static int aot_index(const struct inst_decoded *d)
+{
+	int index;
+
+	/* zero words and reserved compressed encodings keep their raw bits */
+	if ((d->inst & 0x3) != 0x3)
+		return -1;
+
+	index = inst_opcode_index(d->inst);
+	if (index < 0)
+		return -1;
+
+	if (aot_alu_ops[index] || aot_branch_ops[index] || aot_load_ops[index] ||
+	    aot_store_ops[index])
+		return index;
+
+	switch (index) {
+	case RV32I_LUI:
+	case RV32I_AUIPC:
+	case RV32I_JAL:
+	case RV32I_JALR:
+	case RV32I_FENCE:
+		return index;
+	}
+
+	return -1;
+}
+
+/* pc is entered from elsewhere, walk it if it is new */
+static void aot_push(struct aot *a, uint32_t pc)
+{
+	uint8_t *flags;
+
+	if (!aot_in_rom(a, pc))
+		return;
+
+	flags = &a->flags[(pc - a->base) >> 1];
+	if (*flags & AOT_LABEL)
+		return;
+
+	*flags |= AOT_LABEL;
+	a->nr_labels++;
+
+	if (!(*flags & AOT_CODE))
+		a->work[a->nr_work++] = pc;
+}
+
+/*
+ * Follow the code from pc up to the first jump or the first instruction
+ * for the interpreter, collecting targets on the way. Constants built by
+ * lui/auipc/addi are tracked within the run to resolve auipc+jalr calls
+ * and to pick up function pointers.
+ */
+static void aot_walk(struct aot *a, uint32_t pc)
+{
+	uint32_t known[32] = { 0 };
+	uint32_t valid = 1;		/* x0 is always known */
+
+	while (aot_in_rom(a, pc)) {
+		uint8_t *flags = &a->flags[(pc - a->base) >> 1];
+		struct inst_decoded d;
+		uint32_t next;
+		int index;
+
+		if (*flags & AOT_CODE)
+			return;
+		*flags |= AOT_CODE;
+
+		aot_decode(a, &d, pc);
+		next = pc + d.len;
+
+		index = aot_index(&d);
+		if (index < 0) {
+			/* the interpreter carries on after an ecall */
+			if (inst_opcode_index(d.inst) == RV32I_ECALL_EBREAK)
+				aot_push(a, next);
+			return;
+		}
+
+		switch (index) {
+		case RV32I_JAL:
+			aot_push(a, d.target);
+			if (d.rd)
+				aot_push(a, next);
+			return;
+		case RV32I_JALR:
+			if (valid & (1u << d.rs1))
+				aot_push(a, (known[d.rs1] + d.imm) & ~1u);
+			if (d.rd)
+				aot_push(a, next);
+			return;
+		}
+
+		if (aot_branch_ops[index])
+			aot_push(a, d.target);
+
+		/* what this leaves in rd, if it is a constant */
+		if (!aot_branch_ops[index] && !aot_store_ops[index] && index != RV32I_FENCE && d.rd) {
+			valid &= ~(1u << d.rd);
+
+			if (index == RV32I_LUI || index == RV32I_AUIPC) {
+				known[d.rd] = d.imm;
+				valid |= 1u << d.rd;
+			} else if (index == RV32I_ADDI && (valid & (1u << d.rs1))) {
+				known[d.rd] = known[d.rs1] + d.imm;
+				valid |= 1u << d.rd;
+			}
+
+			if ((valid & (1u << d.rd)) && aot_in_rom(a, known[d.rd]))
+				aot_push(a, known[d.rd]);
+		}
+
+		pc = next;
+	}
+}
+
+/*
+ * Jump tables and function pointer tables: any word in the image that is
+ * a ROM address may be jumped to. Translating something that turns out to
+ * be data costs nothing but build time.
+ */
+static void aot_scan_pointers(struct aot *a, struct memory *mem)
+{
+	const uint32_t *p = mem->mem;
+
+	for (uint32_t i = 0; i < mem->size / 4; i++)
+		aot_push(a, p[i]);
+}
+
+static void aot_jump(struct aot *a, FILE *out, uint32_t target)
+{
+	if (aot_in_rom(a, target) && (a->flags[(target - a->base) >> 1] & AOT_LABEL))
+		fprintf(out, "\tGOTO(0x%08xu, L_%08x);\n", target, target);
+	else
+		fprintf(out, "\tpc = 0x%08xu;\n\tgoto dispatch;\n", target);
+}
+
+/*
+ * After a load or store: counted like on the interpreter, and an access that
+ * faulted halts the vm there, with pc left on it.
+ */
+static void aot_emit_access_check(FILE *out, uint32_t pc)
+{
+	fprintf(out, "\ticount++;\n");
+	fprintf(out, "\tif (*halted) {\n\t\tpc = 0x%08xu;\n\t\tgoto out;\n\t}\n", pc);
+}
+
+/* Returns whether execution can fall through to pc + d->len. */
+static int aot_emit_inst(struct aot *a, FILE *out, uint32_t pc, struct inst_decoded *d)
+{
+	int index = aot_index(d);
+	uint32_t next = pc + d->len;
+
+	if (index < 0) {
+		fprintf(out, "\tpc = 0x%08xu;\n\tgoto out;\n", pc);
+		return 0;
+	}
+
+	if (aot_load_ops[index]) {
+		fprintf(out, "\tt = %s(bus, x[%d] + 0x%08xu);\n", aot_load_ops[index], d->rs1, d->imm);
+		if (d->rd)
+			fprintf(out, "\tx[%d] = t;\n", d->rd);
+		aot_emit_access_check(out, pc);
+		return 1;
+	}
+
+	if (aot_store_ops[index]) {
+		fprintf(out, "\t%s(bus, x[%d] + 0x%08xu, x[%d]);\n", aot_store_ops[index], d->rs1,
+			d->imm, d->rs2);
+		aot_emit_access_check(out, pc);
+		return 1;
+	}
+
+	fprintf(out, "\ticount++;\n");
+
+	if (aot_alu_ops[index]) {
+		if (!d->rd)
+			return 1;
+		if ((d->inst & RV_OPCODE_MASK) == RV32_LOGIC_I_TYPE)
+			fprintf(out, "\t{ uint32_t a = x[%d], b = 0x%08xu; x[%d] = %s; }\n",
+				d->rs1, d->imm, d->rd, aot_alu_ops[index]);
+		else
+			fprintf(out, "\t{ uint32_t a = x[%d], b = x[%d]; x[%d] = %s; }\n",
+				d->rs1, d->rs2, d->rd, aot_alu_ops[index]);
+		return 1;
+	}
+
+	if (aot_branch_ops[index]) {
+		fprintf(out, "\t{ uint32_t a = x[%d], b = x[%d]; if (%s) {\n", d->rs1, d->rs2,
+			aot_branch_ops[index]);
+		aot_jump(a, out, d->target);
+		fprintf(out, "\t} }\n");
+		return 1;
+	}
+
+	switch (index) {
+	case RV32I_LUI:
+	case RV32I_AUIPC:
+		if (d->rd)
+			fprintf(out, "\tx[%d] = 0x%08xu;\n", d->rd, d->imm);
+		return 1;
+	case RV32I_JAL:
+		if (d->rd)
+			fprintf(out, "\tx[%d] = 0x%08xu;\n", d->rd, next);
+		aot_jump(a, out, d->target);
+		return 0;
+	case RV32I_JALR:
+		fprintf(out, "\tt = (x[%d] + 0x%08xu) & ~1u;\n", d->rs1, d->imm);
+		if (d->rd)
+			fprintf(out, "\tx[%d] = 0x%08xu;\n", d->rd, next);
+		fprintf(out, "\tpc = t;\n\tgoto dispatch;\n");
+		return 0;
+	}
+
+	/* fence */
+	return 1;
+}
+
+static void aot_emit(struct aot *a, FILE *out, const char *name)
+{
+	uint32_t fall = 0;
+	int falls = 0;
+
+	fprintf(out, "/* translated by rnv-aot from %s */\n", name);
+	fprintf(out, "#include <stdint.h>\n#include <vm.h>\n#include <inst.h>\n#include <mm.h>\n"
+		     "#include <aot.h>\n\n");
+	fprintf(out, "#define GOTO(target, label) do { pc = (target); if (*halted) goto out; "
+		     "goto label; } while (0)\n\n");
+	fprintf(out, "static uint32_t aot_run(struct vm *vm, uint32_t pc)\n{\n"
+		     "\tuint32_t *x = (uint32_t *)&vm->cpu.regs;\n"
+		     "\tstruct bus *bus = &vm->bus;\n"
+		     "\tvolatile int *halted = &vm->halted;\n"
+		     "\tuint64_t icount = 0;\n"
+		     "\tuint32_t t;\n\n");
+
+	fprintf(out, "dispatch:\n\tif (*halted)\n\t\tgoto out;\n\tswitch (pc) {\n");
+	for (uint32_t off = 0; off < a->size / 2; off++)
+		if (a->flags[off] & AOT_LABEL)
+			fprintf(out, "\tcase 0x%08xu: goto L_%08x;\n", a->base + off * 2,
+				a->base + off * 2);
+	fprintf(out, "\tdefault: goto out;\n\t}\n\n");
+
+	for (uint32_t off = 0; off < a->size / 2; off++) {
+		uint32_t pc = a->base + off * 2;
+		struct inst_decoded d;
+
+		if (!(a->flags[off] & AOT_CODE))
+			continue;
+
+		/* the code laid out before this does not run into it */
+		if (falls && fall != pc)
+			aot_jump(a, out, fall);
+
+		if (a->flags[off] & AOT_LABEL)
+			fprintf(out, "L_%08x:\n", pc);
+
+		aot_decode(a, &d, pc);
+		falls = aot_emit_inst(a, out, pc, &d);
+		fall = pc + d.len;
+	}
+
+	if (falls)
+		aot_jump(a, out, fall);
+
+	fprintf(out, "\nout:\n\tvm->icount += icount;\n\treturn pc;\n}\n\n");
+
+	fprintf(out, "const struct aot_image rnv_aot_image = {\n"
+		     "\t.abi = AOT_ABI_VERSION,\n"
+		     "\t.flat = AOT_FLAT,\n"
+		     "\t.vm_size = sizeof(struct vm),\n"
+		     "\t.rom_base = 0x%08xu,\n"
+		     "\t.rom_size = 0x%08xu,\n"
+		     "\t.nr_blocks = %d,\n"
+		     "\t.rom_hash = 0x%016llxull,\n"
+		     "\t.run = aot_run,\n"
+		     "};\n", a->base, a->size, a->nr_labels,
+		     (unsigned long long)vm_rom_hash(a->vm));
+}
+
+/*
+ * Fall-through targets that are not laid out right after their code are
+ * reached with a goto, they need a label too.
+ */
+static void aot_label_fallthroughs(struct aot *a)
+{
+	uint32_t fall = 0;
+	int falls = 0;
+
+	for (uint32_t off = 0; off < a->size / 2; off++) {
+		uint32_t pc = a->base + off * 2;
+		struct inst_decoded d;
+
+		if (!(a->flags[off] & AOT_CODE))
+			continue;
+
+		if (falls && fall != pc)
+			aot_push(a, fall);
+
+		aot_decode(a, &d, pc);
+		falls = aot_index(&d) >= 0 && aot_index(&d) != RV32I_JAL &&
+			aot_index(&d) != RV32I_JALR;
+		fall = pc + d.len;
+	}
+
+	if (falls)
+		aot_push(a, fall);
+}
+
+static int aot_compile(const char *src, const char *so)
+{
+	const char *cc = getenv("CC") ? getenv("CC") : "cc";
+	const char *argv[] = {
+		cc, "-O2", "-shared", "-fPIC", "-I", AOT_INCLUDE_DIR,
+#ifdef CONFIG_NO_FLAT_BUS
+		"-DCONFIG_NO_FLAT_BUS",
+#endif
+#ifdef CONFIG_TRACE
+		"-DCONFIG_TRACE",
+#endif
+		"-o", so, src, NULL,
+	};
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+
+	if (!pid) {
+		execvp(cc, (char **)argv);
+		printf("cannot run %s: %s\n", cc, strerror(errno));
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		return -errno;
+
+	return WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -EIO;
+}
+
+static int parse_size(const char *arg, uint32_t *size)
+{
+	unsigned long long val;
+	char *end;
+
+	val = strtoull(arg, &end, 0);
+	switch (*end) {
+	case 'M':
+		val <<= 10;
+		/* fallthrough */
+	case 'K':
+		val <<= 10;
+		end++;
+		break;
+	}
+
+	if (end == arg || *end || !val || val > 0xFFFFF000ULL)
+		return -EINVAL;
+
+	*size = (val + 0xFFF) & ~0xFFFULL;
+
+	return 0;
+}
+
+/* "size" or "base:size", as rnv -R takes it */
+static int parse_region(const char *arg, uint32_t *base, uint32_t *size)
+{
+	const char *colon = strchr(arg, ':');
+	unsigned long long val;
+	char *end;
+
+	if (!colon)
+		return parse_size(arg, size);
+
+	val = strtoull(arg, &end, 0);
+	if (end != colon || val > 0xFFFFFFFFULL || (val & 0xFFF))
+		return -EINVAL;
+
+	*base = val;
+
+	return parse_size(colon + 1, size);
+}
+
+int main(int argc, char **argv)
+{
+	struct vm_layout layout = VM_LAYOUT_DEFAULT;
+	const char *so = NULL;
+	const char *cache_dir = NULL;
+	char path[PATH_MAX];
+	char src[PATH_MAX + 10];
+	char tmp[PATH_MAX + 8];
+	char kept[PATH_MAX + 2];
+	struct aot a = { 0 };
+	int keep = 0;
+	struct stat sb;
+	mode_t mask;
+	FILE *out;
+	void *bin;
+	int ret;
+	int opt;
+	int fd;
+
+	while ((opt = getopt(argc, argv, "o:C:R:k")) != -1) {
+		switch (opt) {
+		case 'o':
+			so = optarg;
+			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
+		case 'R':
+			if (parse_region(optarg, &layout.rom_base, &layout.rom_size) < 0) {
+				printf("invalid ROM region: %s\n", optarg);
+				return -EINVAL;
+			}
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind >= argc || !so == !cache_dir)
+		goto usage;
+
+	if (cache_dir && cache_init(cache_dir) < 0)
+		return -EINVAL;
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) < 0) {
+		printf("cannot open file: %s\n", argv[optind]);
+		return -ENOENT;
+	}
+
+	bin = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (bin == MAP_FAILED) {
+		printf("failed to map file in memory.\n");
+		return -EIO;
+	}
+
+	a.vm = vm_load_image(bin, sb.st_size, fd, &layout);
+	if (!a.vm) {
+		printf("cannot create vm.\n");
+		return -ENOMEM;
+	}
+
+	a.base = a.vm->rom.base_addr;
+	a.size = a.vm->rom.size;
+	a.flags = calloc(a.size / 2, 1);
+	a.work = calloc(a.size / 2, sizeof(*a.work));
+	if (!a.flags || !a.work) {
+		printf("cannot allocate %u bytes of ROM state.\n", a.size);
+		return -ENOMEM;
+	}
+
+	/* where rnv -C looks for it */
+	if (cache_dir) {
+		if (cache_path(path, sizeof(path), vm_rom_hash(a.vm), AOT_CACHE_VERSION, "so") < 0) {
+			printf("cache directory name too long: %s\n", cache_dir);
+			return -ENAMETOOLONG;
+		}
+		so = path;
+	}
+
+	aot_push(&a, a.vm->cpu.pc);
+	aot_scan_pointers(&a, &a.vm->rom);
+	for (int i = 0; i < a.vm->nr_segments; i++)
+		aot_scan_pointers(&a, &a.vm->segments[i]);
+	while (a.nr_work)
+		aot_walk(&a, a.work[--a.nr_work]);
+	aot_label_fallthroughs(&a);
+
+	/*
+	 * Built under temporary names next to so, which it then replaces, so
+	 * that an rnv -C sharing the directory never loads a partial object.
+	 */
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", so);
+	snprintf(src, sizeof(src), "%s.XXXXXX.c", so);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		printf("cannot create %s: %s\n", tmp, strerror(errno));
+		return -EIO;
+	}
+	close(fd);
+
+	fd = mkstemps(src, 2);
+	out = fd < 0 ? NULL : fdopen(fd, "w");
+	if (!out) {
+		printf("cannot create %s: %s\n", src, strerror(errno));
+		unlink(tmp);
+		return -EIO;
+	}
+	aot_emit(&a, out, argv[optind]);
+	if (fclose(out)) {
+		printf("cannot write %s: %s\n", src, strerror(errno));
+		unlink(tmp);
+		unlink(src);
+		return -EIO;
+	}
+
+	/* mkstemp() leaves only the owner any rights */
+	mask = umask(0);
+	umask(mask);
+
+	ret = aot_compile(src, tmp);
+	if (!ret)
+		chmod(tmp, 0755 & ~mask);
+	if (!ret && rename(tmp, so) < 0) {
+		printf("cannot rename %s to %s: %s\n", tmp, so, strerror(errno));
+		ret = -EIO;
+	}
+
+	if (ret < 0) {
+		printf("cannot build %s from %s\n", so, src);
+		unlink(tmp);
+	} else {
+		printf("%s: %d entry points\n", so, a.nr_labels);
+	}
+
+	/* the source kept with -k goes next to the object, it stays for a failed build */
+	if (!ret && keep) {
+		snprintf(kept, sizeof(kept), "%s.c", so);
+		chmod(src, 0644 & ~mask);
+		if (rename(src, kept) < 0)
+			printf("cannot rename %s to %s: %s\n", src, kept, strerror(errno));
+	} else if (!ret) {
+		unlink(src);
+	}
+
+	vm_destroy(a.vm);
+	free(a.flags);
+	free(a.work);
+
+	return ret;
+
+usage:
+	printf("usage: %s [-R [base:]size] [-k] -o <shared object>|-C <dir> <riscv binary or ELF>\n", argv[0]);
+	printf("  -C dir\t\tbuild into the cache directory of rnv -C instead\n");
+	printf("  -R region\tROM of flat binaries, as given to rnv\n");
+	printf("  -k\t\tkeep the generated C next to the object\n");
+	return -EINVAL;
+}
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <vm.h>
+#include <mm.h>
+#include <inst.h>
+
+/*
+ * Synthetic instruction streams fed through the decoder and the handlers
+ * one piece at a time, so that a dispatch or decode change can be measured
+ * without the rest of an engine around it.
+ */
+
+#define BENCH_STREAM		4096
+#define BENCH_ROUNDS		512
+#define BENCH_ROM		0x10000
+#define BENCH_RAM		0x20000
+#define BENCH_SIZE		(32 * 1024)
+#define BENCH_BASE		(BENCH_RAM + 0x800)	/* x8-x15, load/store bases */
+
+enum bench_class {
+	BENCH_ALU_R,
+	BENCH_ALU_I,
+	BENCH_LOAD,
+	BENCH_STORE,
+	BENCH_BRANCH,
+	BENCH_JUMP,
+	BENCH_NR_CLASSES,
+};
+
+static const char *bench_class_names[] = {
+	"alu-r", "alu-i", "load", "store", "branch", "jump",
+};
+
+struct bench {
+	struct vm *vm;
+	uint32_t insts[BENCH_STREAM];
+	struct inst_decoded ops[BENCH_STREAM];
+	uint32_t addrs[BENCH_STREAM];
+	int rounds;
+	int perf_fd;
+	uint32_t seed;
+	volatile uint32_t sink;
+};
+
+static uint32_t bench_rand(struct bench *b)
+{
+	b->seed ^= b->seed << 13;
+	b->seed ^= b->seed >> 17;
+	b->seed ^= b->seed << 5;
+
+	return b->seed;
+}
+
+static uint32_t enc_r(int funct7, int rs2, int rs1, int funct3, int rd, int opcode)
+{
+	return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static uint32_t enc_i(int imm, int rs1, int funct3, int rd, int opcode)
+{
+	return ((uint32_t)imm << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static uint32_t enc_s(int imm, int rs2, int rs1, int funct3)
+{
+	return enc_r((imm >> 5) & 0x7F, rs2, rs1, funct3, imm & 0x1F, RV32_STORE_S_TYPE);
+}
+
+static uint32_t enc_b(int imm, int rs2, int rs1, int funct3)
+{
+	return enc_r(((imm >> 6) & 0x40) | ((imm >> 5) & 0x3F), rs2, rs1, funct3,
+		     ((imm & 0x1E) | ((imm >> 11) & 1)), RV32_BRANCH_B_TYPE);
+}
+
+static uint32_t enc_j(int imm, int rd)
+{
+	uint32_t bits = (((imm >> 20) & 1) << 19) | (((imm >> 1) & 0x3FF) << 9) |
+			(((imm >> 11) & 1) << 8) | ((imm >> 12) & 0xFF);
+
+	return (bits << 12) | (rd << 7) | RV32_JAL;
+}
+
+/*
+ * Loads and stores only use x8-x15 as base, and loads only write x16-x31,
+ * so every access stays inside RAM.
+ */
+static uint32_t bench_inst(struct bench *b, enum bench_class class)
+{
+	static const int loads[] = { 0, 1, 2, 4, 5 };
+	static const int branches[] = { 0, 1, 4, 5, 6, 7 };
+	uint32_t r = bench_rand(b);
+	int rd = 1 + r % 31;
+	int rs1 = (r >> 5) & 0x1F;
+	int rs2 = (r >> 10) & 0x1F;
+	int funct3 = (r >> 15) & 0x7;
+	int imm = (int)(r >> 20) - 2048;
+	int size;
+
+	switch (class) {
+	case BENCH_ALU_R:
+		return enc_r((funct3 == 0 || funct3 == 5) && (r & 0x40000000) ? 0x20 : 0,
+			     rs2, rs1, funct3, rd, RV32_LOGIC_R_TYPE);
+	case BENCH_ALU_I:
+		if (funct3 == 1 || funct3 == 5)
+			imm = ((funct3 == 5 && (r & 0x40000000)) ? 0x400 : 0) | rs2;
+		return enc_i(imm, rs1, funct3, rd, RV32_LOGIC_I_TYPE);
+	case BENCH_LOAD:
+		funct3 = loads[funct3 % 5];
+		size = 1 << (funct3 & 3);
+		return enc_i(imm & ~(size - 1), 8 + (rs1 & 7), funct3, 16 + (rd & 15),
+			     RV32_LOAD_I_TYPE);
+	case BENCH_STORE:
+		funct3 %= 3;
+		size = 1 << funct3;
+		return enc_s(imm & ~(size - 1), rs2, 8 + (rs1 & 7), funct3);
+	case BENCH_BRANCH:
+		return enc_b((imm << 1) & 0x1FFE, rs2, rs1, branches[funct3 % 6]);
+	case BENCH_JUMP:
+		if (r & 0x80000000)
+			return enc_i(imm, rs1, 0, rd, RV32_JALR);
+		return enc_j((r << 1) & 0x1FFFFE, rd);
+	default:
+		return 0;
+	}
+}
+
+static void bench_reset(struct bench *b)
+{
+	uint32_t *regs = (uint32_t *)&b->vm->cpu.regs;
+
+	for (int i = 1; i < 32; i++)
+		regs[i] = (i >= 8 && i < 16) ? BENCH_BASE : bench_rand(b);
+	b->vm->halted = 0;
+}
+
+static void bench_fill(struct bench *b, enum bench_class class)
+{
+	for (int i = 0; i < BENCH_STREAM; i++) {
+		b->insts[i] = bench_inst(b, class);
+		inst_decode(&b->ops[i], b->insts[i], BENCH_ROM + i * 4);
+		b->addrs[i] = BENCH_RAM + (bench_rand(b) & (BENCH_SIZE - 4));
+	}
+}
+
+static int perf_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void stage_decode(struct bench *b)
+{
+	struct inst_decoded d;
+
+	for (int i = 0; i < BENCH_STREAM; i++) {
+		inst_decode(&d, b->insts[i], BENCH_ROM + i * 4);
+		b->sink += d.imm;
+	}
+}
+
+/* decode and dispatch in one go, as the interpreter did before the icache */
+static void stage_execute(struct bench *b)
+{
+	struct vm *vm = b->vm;
+
+	for (int i = 0; i < BENCH_STREAM; i++) {
+		vm->cpu.pc = BENCH_ROM + i * 4 + 4;
+		inst_execute(vm, b->insts[i]);
+	}
+}
+
+/* pre-decoded ops, the indirect call into the handler and the handler itself */
+static void stage_handler(struct bench *b)
+{
+	struct vm *vm = b->vm;
+
+	for (int i = 0; i < BENCH_STREAM; i++) {
+		vm->cpu.pc = BENCH_ROM + i * 4 + 4;
+		b->ops[i].handler(vm, &b->ops[i]);
+	}
+}
+
+static void stage_mm_read(struct bench *b)
+{
+	for (int i = 0; i < BENCH_STREAM; i++)
+		b->sink += mm_read(&b->vm->ram, b->addrs[i]);
+}
+
+static void stage_mm_read_u16(struct bench *b)
+{
+	for (int i = 0; i < BENCH_STREAM; i++)
+		b->sink += mm_read_u16(&b->vm->ram, b->addrs[i]);
+}
+
+static void stage_mm_read_u8(struct bench *b)
+{
+	for (int i = 0; i < BENCH_STREAM; i++)
+		b->sink += mm_read_u8(&b->vm->ram, b->addrs[i]);
+}
+
+static void stage_bus_read_u32(struct bench *b)
+{
+	for (int i = 0; i < BENCH_STREAM; i++)
+		b->sink += bus_read_u32(&b->vm->bus, b->addrs[i]);
+}
+
+static void bench_measure(struct bench *b, const char *class, const char *stage,
+			  void (*fn)(struct bench *b))
+{
+	struct timespec start, end;
+	uint64_t misses = 0;
+	double ns, n = (double)b->rounds * BENCH_STREAM;
+
+	bench_reset(b);
+	fn(b);		/* warm up caches and predictors */
+
+	if (b->perf_fd >= 0) {
+		ioctl(b->perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(b->perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < b->rounds; i++) {
+		bench_reset(b);
+		fn(b);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (b->perf_fd >= 0) {
+		ioctl(b->perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(b->perf_fd, &misses, sizeof(misses)) != sizeof(misses))
+			misses = 0;
+	}
+
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+	if (b->perf_fd >= 0)
+		printf("%-8s %-14s %10.2f %14.4f\n", class, stage, ns / n, misses / n);
+	else
+		printf("%-8s %-14s %10.2f %14s\n", class, stage, ns / n, "-");
+}
+
+int main(int argc, char **argv)
+{
+	struct vm_layout layout = { BENCH_ROM, BENCH_SIZE, BENCH_RAM, BENCH_SIZE, 0 };
+	struct bench *b;
+	int opt;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+
+	b->rounds = BENCH_ROUNDS;
+	b->seed = 0x2545F491;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			b->rounds = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-n rounds]\n", argv[0]);
+			return -EINVAL;
+		}
+	}
+
+	if (b->rounds <= 0) {
+		printf("invalid number of rounds.\n");
+		return -EINVAL;
+	}
+
+	b->vm = vm_init(&layout);
+	if (!b->vm) {
+		printf("cannot create vm.\n");
+		return -ENOMEM;
+	}
+
+	b->perf_fd = perf_open();
+	if (b->perf_fd < 0)
+		printf("perf_event_open: %s, branch misses not counted\n", strerror(errno));
+
+	printf("%d rounds of %d instructions per row\n", b->rounds, BENCH_STREAM);
+	printf("%-8s %-14s %10s %14s\n", "class", "stage", "ns/inst", "br-miss/inst");
+
+	for (int class = 0; class < BENCH_NR_CLASSES; class++) {
+		bench_fill(b, class);
+		bench_measure(b, bench_class_names[class], "decode", stage_decode);
+		bench_measure(b, bench_class_names[class], "execute", stage_execute);
+		bench_measure(b, bench_class_names[class], "handler", stage_handler);
+	}
+
+	bench_measure(b, "mm", "mm_read", stage_mm_read);
+	bench_measure(b, "mm", "mm_read_u16", stage_mm_read_u16);
+	bench_measure(b, "mm", "mm_read_u8", stage_mm_read_u8);
+	bench_measure(b, "mm", "bus_read_u32", stage_bus_read_u32);
+
+	if (b->perf_fd >= 0)
+		close(b->perf_fd);
+	vm_destroy(b->vm);
+	free(b);
+
+	return 0;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <trace.h>
+
+static int read_varint(FILE *in, uint32_t *v)
+{
+	int c;
+	int shift = 0;
+
+	*v = 0;
+
+	do {
+		c = fgetc(in);
+		if (c == EOF || shift > 28)
+			return -EIO;
+
+		*v |= (uint32_t)(c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_file_header hdr;
+	uint32_t regs[32];
+	uint32_t pc = 0;
+	uint64_t count = 0;
+	FILE *in;
+	int flags;
+
+	if (argc < 2) {
+		printf("usage: %s <trace file>\n", argv[0]);
+		return -EINVAL;
+	}
+
+	in = fopen(argv[1], "rb");
+	if (!in) {
+		printf("cannot open file: %s\n", argv[1]);
+		return -ENOENT;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != TRACE_FILE_MAGIC) {
+		printf("%s is not an rnv trace.\n", argv[1]);
+		return -EINVAL;
+	}
+
+	if (hdr.version != TRACE_FILE_VERSION) {
+		printf("unsupported trace version %u.\n", hdr.version);
+		return -EINVAL;
+	}
+
+	memcpy(regs, hdr.regs, sizeof(regs));
+
+	for (int i = 0; i < 32; i++)
+		printf("x%d = 0x%x\n", i, regs[i]);
+
+	while ((flags = fgetc(in)) != EOF) {
+		uint32_t inst;
+		uint32_t delta;
+
+		if (flags & TRACE_F_PC) {
+			if (read_varint(in, &delta) < 0)
+				goto truncated;
+			pc += trace_unzigzag(delta);
+		} else {
+			pc += 4;
+		}
+
+		if (fread(&inst, sizeof(inst), 1, in) != 1)
+			goto truncated;
+
+		printf("PC (0x%08x) = 0x%08x", pc, inst);
+
+		if (flags & TRACE_F_RD) {
+			int rd = (inst >> 7) & 0x1F;
+
+			if (fread(&regs[rd], sizeof(regs[rd]), 1, in) != 1)
+				goto truncated;
+
+			printf("  x%d = 0x%x", rd, regs[rd]);
+		}
+
+		printf("\n");
+		count++;
+	}
+
+	fclose(in);
+	printf("%llu instructions\n", (unsigned long long)count);
+
+	return 0;
+
+truncated:
+	fclose(in);
+	printf("trace truncated after %llu instructions.\n", (unsigned long long)count);
+	return -EIO;
+}
@@ -0,0 +1,200 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <sizes.h>
+#include <trace.h>
+
+#define TRACE_STREAM_SIZE	SZ_16M
+
+static const char *trace_levels[] = {
+	[TRACE_OFF] = "off",
+	[TRACE_INST] = "inst",
+	[TRACE_REGS] = "regs",
+};
+
+int trace_parse_level(const char *name)
+{
+	for (int i = 0; i < sizeof(trace_levels) / sizeof(trace_levels[0]); i++)
+		if (!strcmp(name, trace_levels[i]))
+			return i;
+
+	return -1;
+}
+
+struct trace *trace_create(int level, int nr_records)
+{
+	struct trace *trace;
+
+	/* the ring is indexed with a mask */
+	if (nr_records & (nr_records - 1))
+		return NULL;
+
+	trace = malloc(sizeof(*trace));
+	if (!trace)
+		return NULL;
+
+	trace->ring = calloc(nr_records, sizeof(*trace->ring));
+	if (!trace->ring) {
+		free(trace);
+		return NULL;
+	}
+
+	trace->level = level;
+	trace->mask = nr_records - 1;
+	trace->head = 0;
+	trace->stream = NULL;
+
+	return trace;
+}
+
+/* called by the producer when the ring looks full */
+void trace_stream_wait(struct trace_stream *s, int len)
+{
+	uint64_t head = atomic_load_explicit(&s->head, memory_order_relaxed);
+
+	for (;;) {
+		s->cached_tail = atomic_load_explicit(&s->tail, memory_order_acquire);
+		if (head + len - s->cached_tail <= s->mask + 1)
+			return;
+
+		sched_yield();
+	}
+}
+
+static void *trace_stream_writer(void *arg)
+{
+	struct trace_stream *s = arg;
+	struct timespec idle = { .tv_sec = 0, .tv_nsec = 200000 };
+	uint64_t tail = 0;
+
+	for (;;) {
+		int done = atomic_load_explicit(&s->done, memory_order_acquire);
+		uint64_t head = atomic_load_explicit(&s->head, memory_order_acquire);
+		uint64_t start = tail & s->mask;
+		uint64_t len = head - tail;
+
+		if (!len) {
+			if (done)
+				break;
+
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		if (start + len > s->mask + 1) {
+			fwrite(s->buf + start, 1, s->mask + 1 - start, s->out);
+			fwrite(s->buf, 1, start + len - (s->mask + 1), s->out);
+		} else {
+			fwrite(s->buf + start, 1, len, s->out);
+		}
+
+		tail = head;
+		atomic_store_explicit(&s->tail, tail, memory_order_release);
+	}
+
+	return NULL;
+}
+
+struct trace *trace_create_stream(struct vm *vm, const char *path)
+{
+	struct trace_file_header hdr;
+	struct trace_stream *s;
+	struct trace *trace;
+
+	trace = trace_create(TRACE_REGS, 1);
+	if (!trace)
+		return NULL;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		goto err_trace;
+
+	s->buf = malloc(TRACE_STREAM_SIZE);
+	if (!s->buf)
+		goto err_stream;
+
+	s->out = fopen(path, "wb");
+	if (!s->out) {
+		printf("cannot open trace file: %s\n", path);
+		goto err_buf;
+	}
+
+	s->mask = TRACE_STREAM_SIZE - 1;
+	memcpy(s->regs, &vm->cpu.regs, sizeof(s->regs));
+
+	hdr.magic = TRACE_FILE_MAGIC;
+	hdr.version = TRACE_FILE_VERSION;
+	memcpy(hdr.regs, s->regs, sizeof(hdr.regs));
+	fwrite(&hdr, sizeof(hdr), 1, s->out);
+
+	if (pthread_create(&s->writer, NULL, trace_stream_writer, s))
+		goto err_file;
+
+	trace->stream = s;
+
+	return trace;
+
+err_file:
+	fclose(s->out);
+err_buf:
+	free(s->buf);
+err_stream:
+	free(s);
+err_trace:
+	trace_destroy(trace);
+	return NULL;
+}
+
+static void trace_stream_close(struct trace_stream *s)
+{
+	atomic_store_explicit(&s->done, 1, memory_order_release);
+	pthread_join(s->writer, NULL);
+
+	fclose(s->out);
+	free(s->buf);
+	free(s);
+}
+
+void trace_destroy(struct trace *trace)
+{
+	if (trace->stream)
+		trace_stream_close(trace->stream);
+
+	free(trace->ring);
+	free(trace);
+}
+
+static int trace_writes_rd(uint32_t inst)
+{
+	switch (inst & RV_OPCODE_MASK) {
+	case RV32_STORE_S_TYPE:
+	case RV32_BRANCH_B_TYPE:
+	case RV32_FENCE:
+	case RV32_ECALL_EBREAK:
+		return 0;
+	}
+
+	return ((inst >> 7) & 0x1F) != 0;
+}
+
+void trace_dump(struct trace *trace, FILE *out)
+{
+	uint64_t start = 0;
+
+	if (trace->head > trace->mask + 1)
+		start = trace->head - (trace->mask + 1);
+
+	for (uint64_t i = start; i < trace->head; i++) {
+		struct trace_record *r = &trace->ring[i & trace->mask];
+
+		fprintf(out, "PC (0x%08x) = 0x%08x", r->pc, r->inst);
+
+		if (trace->level >= TRACE_REGS && trace_writes_rd(r->inst))
+			fprintf(out, "  x%d = 0x%x", (r->inst >> 7) & 0x1F, r->value);
+
+		fprintf(out, "\n");
+	}
+}
@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <vm.h>
+#include <mm.h>
+#include <ecall.h>
+#include <uart.h>
+
+static void uart_poll(struct uart *uart)
+{
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	unsigned char c;
+
+	if (uart->rx >= 0 || uart->rx_eof)
+		return;
+
+	if (uart->polls-- > 0)
+		return;
+	uart->polls = UART_POLL_INTERVAL;
+
+	/* whatever prompt the guest printed has to show first */
+	ecall_flush(uart->vm);
+
+	if (poll(&pfd, 1, 0) <= 0)
+		return;
+
+	if (read(STDIN_FILENO, &c, 1) == 1)
+		uart->rx = c;
+	else
+		uart->rx_eof = 1;
+}
+
+static uint32_t uart_read(void *opaque, uint32_t offset, int size)
+{
+	struct uart *uart = opaque;
+	int c;
+
+	switch (offset) {
+	case UART_RBR:
+		/* reading a line, the next byte is likely there already */
+		uart->polls = 0;
+		uart_poll(uart);
+		c = uart->rx;
+		uart->rx = -1;
+		uart->polls = 0;
+		return c < 0 ? 0 : c;
+	case UART_LSR:
+		uart_poll(uart);
+		return UART_LSR_THRE | UART_LSR_TEMT | (uart->rx >= 0 ? UART_LSR_DR : 0);
+	}
+
+	return 0;
+}
+
+static void uart_write(void *opaque, uint32_t offset, uint32_t value, int size)
+{
+	struct uart *uart = opaque;
+	char c = value;
+
+	if (offset == UART_THR)
+		ecall_stdout(uart->vm, &c, 1);
+}
+
+static void uart_release(void *opaque)
+{
+	free(opaque);
+}
+
+static const struct bus_mmio_ops uart_ops = {
+	.read = uart_read,
+	.write = uart_write,
+	.release = uart_release,
+};
+
+int uart_attach(struct vm *vm, uint32_t base)
+{
+	struct uart *uart;
+	int ret;
+
+	uart = calloc(1, sizeof(*uart));
+	if (!uart)
+		return -ENOMEM;
+
+	uart->vm = vm;
+	uart->rx = -1;
+
+	ret = mm_bus_map_mmio(&vm->bus, base, UART_SIZE, &uart_ops, uart);
+	if (ret < 0)
+		free(uart);
+
+	return ret;
+}
@@ -1,20 +1,17 @@
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <sizes.h>
 #include <vm.h>
 #include <inst.h>
-
-static uint32_t vm_fetch_inst(struct vm *vm)
-{
-	uint32_t inst;
-
-	inst = mm_read(&vm->rom, vm->cpu.pc);
-
-	vm->cpu.pc += 4;
-
-	return inst;
-}
+#include <icache.h>
+#include <trace.h>
+#include <ecall.h>
+#include <uart.h>
+#include <timer.h>
 
 int vm_read_pc(struct vm *vm)
 {
@@ -37,100 +34,164 @@ void vm_write_register(struct vm *vm, int reg, int value)
 {
 	uint32_t *r = (void *)&vm->cpu.regs + (reg * sizeof(uint32_t));
 
-	*r = value;
+	/* x0 is hard-wired to zero, "j" and "ret" target it all the time */
+	if (reg)
+		*r = value;
 }
 
 void vm_load(struct vm *vm, int addr, int reg)
 {
-	uint32_t *r = (void *)&vm->cpu.regs + (reg * sizeof(uint32_t));
-
-	 *r = mm_read(&vm->rom, addr);
+	vm_write_register(vm, reg, bus_read_u32(&vm->bus, addr));
 }
 
 void vm_store(struct vm *vm, int addr, int reg)
 {
-	uint32_t *r = (void *)&vm->cpu.regs + (reg * sizeof(uint32_t));
-
-	mm_write(&vm->rom, addr, *r);
+	bus_write_u32(&vm->bus, addr, vm_read_register(vm, reg));
 }
 
 void vm_load_u16(struct vm *vm, int addr, int reg)
 {
-	uint32_t *r = (void *)&vm->cpu.regs + (reg * sizeof(uint32_t));
-
-	 *r = mm_read_u16(&vm->rom, addr);
+	vm_write_register(vm, reg, bus_read_u16(&vm->bus, addr));
 }
 
 void vm_store_u16(struct vm *vm, int addr, int reg)
 {
-	uint32_t *r = (void *)&vm->cpu.regs + (reg * sizeof(uint32_t));
-
-	mm_write_u16(&vm->rom, addr, *r);
+	bus_write_u16(&vm->bus, addr, vm_read_register(vm, reg));
 }
 
 void vm_load_u8(struct vm *vm, int addr, int reg)
 {
-	uint32_t *r = (void *)&vm->cpu.regs + (reg * sizeof(uint32_t));
-
-	 *r = mm_read_u8(&vm->rom, addr);
+	vm_write_register(vm, reg, bus_read_u8(&vm->bus, addr));
 }
 
 void vm_store_u8(struct vm *vm, int addr, int reg)
 {
-	uint32_t *r = (void *)&vm->cpu.regs + (reg * sizeof(uint32_t));
-
-	mm_write_u8(&vm->rom, addr, *r);
+	bus_write_u8(&vm->bus, addr, vm_read_register(vm, reg));
 }
 
 void vm_load_s8(struct vm *vm, int addr, int reg)
 {
-	uint32_t *r = (void *)&vm->cpu.regs + (reg * sizeof(uint32_t));
-
-	 *r = mm_read_s8(&vm->rom, addr);
+	vm_write_register(vm, reg, bus_read_s8(&vm->bus, addr));
 }
 
 void vm_load_s16(struct vm *vm, int addr, int reg)
 {
-	uint32_t *r = (void *)&vm->cpu.regs + (reg * sizeof(uint32_t));
-
-	 *r = mm_read_s16(&vm->rom, addr);
+	vm_write_register(vm, reg, bus_read_s16(&vm->bus, addr));
 }
 
 void vm_load_s32(struct vm *vm, int addr, int reg)
 {
-	uint32_t *r = (void *)&vm->cpu.regs + (reg * sizeof(uint32_t));
+	vm_write_register(vm, reg, bus_read_u32(&vm->bus, addr));
+}
+
+static void vm_bus_fault(struct bus *bus, uint32_t addr, int access)
+{
+	struct vm *vm = container_of(bus, struct vm, bus);
+	const char *type = "load";
+
+	if (access == BUS_WRITE)
+		type = "store";
+	else if (access == BUS_EXEC)
+		type = "instruction";
+
+	printf("%s access fault at 0x%08x\n", type, addr);
+
+	vm->halted = 1;
+}
+
+struct vm *vm_create(void)
+{
+	int ret;
+	struct vm *vm = NULL;
+
+	vm = calloc(1, sizeof(*vm));
+	if (!vm)
+		return NULL;
+
+	ret = mm_bus_init(&vm->bus);
+	if (ret < 0) {
+		goto err_free;
+	}
+
+	vm->bus.fault = vm_bus_fault;
+
+	inst_init(vm);
+
+	return vm;
+
+err_free:
+	free(vm);
+	return NULL;
+}
+
+int vm_map_ram(struct vm *vm, uint32_t base_addr, uint32_t ram_size, int attr)
+{
+	int ret;
+
+	ret = mm_create_mapping(&vm->ram, &vm->bus, base_addr, ram_size, RAM, RW | XN | attr);
+	if (ret < 0)
+		return ret;
+
+	ret = mm_bus_map(&vm->bus, &vm->ram);
+	if (ret < 0)
+		return ret;
+
+	vm->cpu.regs.sp = vm->ram.base_addr + ram_size;
 
-	 *r = mm_read_s32(&vm->rom, addr);
+	return 0;
 }
 
-struct vm *vm_init(uint32_t entry_point, int rom_size, int ram_size)
+/* RAM above the flat ROM, at VM_RAM_BASE unless the ROM reaches past it */
+static uint32_t vm_flat_ram_base(const struct vm_layout *layout)
+{
+	uint64_t rom_end = ((uint64_t)layout->rom_base + layout->rom_size + SZ_4K - 1) & ~(SZ_4K - 1);
+
+	if (layout->ram_base)
+		return layout->ram_base;
+
+	return layout->rom_base < VM_RAM_BASE && rom_end <= VM_RAM_BASE ? VM_RAM_BASE : rom_end;
+}
+
+/* A vm for flat binaries: an empty ROM and RAM placed as layout says. */
+struct vm *vm_init(const struct vm_layout *layout)
 {
 	int ret;
+	int attr = layout->huge ? HUGE : 0;
 	struct vm *vm = NULL;
 
-	vm = malloc(sizeof(*vm));
+	vm = vm_create();
+	if (!vm)
+		return NULL;
 
-	memset(&vm->cpu.regs, 0x0, sizeof(vm->cpu.regs));
+	ret = mm_create_mapping(&vm->rom, &vm->bus, layout->rom_base, layout->rom_size, ROM,
+				RO | attr);
+	if (ret < 0) {
+		goto err_free;
+	}
 
-	ret = mm_create_mapping(&vm->rom, entry_point, rom_size, ROM, RO);
+	ret = mm_bus_map(&vm->bus, &vm->rom);
 	if (ret < 0) {
 		goto err_free;
 	}
 
-	ret = mm_create_mapping(&vm->ram, 0x20000, ram_size, RAM, RW | XN);
+	ret = vm_map_ram(vm, vm_flat_ram_base(layout), layout->ram_size, attr);
 	if (ret < 0) {
+		printf("cannot map %u bytes of RAM at 0x%08x.\n", layout->ram_size,
+		       vm_flat_ram_base(layout));
 		goto err_free;
 	}
 
-	vm->cpu.regs.sp = vm->ram.base_addr + ram_size;
-	vm->cpu.pc = 0x0;
+	vm->icache = icache_create(&vm->bus, &vm->rom);
+	if (!vm->icache) {
+		goto err_free;
+	}
 
-	inst_init(vm);
+	vm->cpu.pc = layout->rom_base;
 
 	return vm;
 
 err_free:
-	free(vm);
+	vm_destroy(vm);
 	return NULL;
 }
 
@@ -138,26 +199,150 @@ int vm_load_bin(struct vm *vm, void *bin, int size)
 {
 	int ret = 0;
 
-	memcpy((void *)vm->rom.mem, bin, size);
+	if (size > vm->rom.size)
+		return -EINVAL;
+
+	mm_fill(&vm->rom, bin, size);
+	vm->cpu.pc = vm->rom.base_addr;
+	vm->image_end = vm->rom.base_addr + size;
+	icache_flush(vm->icache);
+	vm_flush_fast(vm);
+	vm_flush_jit(vm);
 
 	return ret;	
 }
 
+/*
+ * The board around the cpu. An image that already uses a device's address
+ * keeps its memory there and runs without that device.
+ */
+static void vm_attach_devices(struct vm *vm)
+{
+	if (uart_attach(vm, UART_BASE) < 0)
+		printf("no uart at 0x%08x.\n", UART_BASE);
+	if (timer_attach(vm, TIMER_BASE) < 0)
+		printf("no timer at 0x%08x.\n", TIMER_BASE);
+}
+
+/*
+ * Create a vm for a flat binary, copied to the ROM, or for an ELF executable
+ * mapped from fd, with memories placed as layout says (NULL for defaults).
+ */
+struct vm *vm_load_image(void *image, int size, int fd, const struct vm_layout *layout)
+{
+	static const struct vm_layout defaults = VM_LAYOUT_DEFAULT;
+	uint32_t ram_base;
+	struct vm *vm;
+
+	if (!layout)
+		layout = &defaults;
+
+	if (!vm_is_elf(image, size)) {
+		vm = vm_init(layout);
+		if (!vm)
+			return NULL;
+
+		if (vm_load_bin(vm, image, size) < 0) {
+			printf("binary does not fit in ROM.\n");
+			goto err_destroy;
+		}
+
+		vm_attach_devices(vm);
+
+		return vm;
+	}
+
+	vm = vm_create();
+	if (!vm)
+		return NULL;
+
+	if (vm_load_elf(vm, image, size, fd) < 0)
+		goto err_destroy;
+
+	ram_base = layout->ram_base ? layout->ram_base : (vm->image_end + SZ_4K - 1) & ~(SZ_4K - 1);
+	if (vm_map_ram(vm, ram_base, layout->ram_size, layout->huge ? HUGE : 0) < 0) {
+		printf("cannot map %u bytes of RAM at 0x%08x.\n", layout->ram_size, ram_base);
+		goto err_destroy;
+	}
+
+	vm_attach_devices(vm);
+
+	return vm;
+
+err_destroy:
+	vm_destroy(vm);
+	return NULL;
+}
+
+/*
+ * Run vm on the decoded code of tmpl, which must have been loaded from the
+ * same image and fully decoded with icache_prefill().
+ */
+void vm_share_code(struct vm *vm, struct vm *tmpl)
+{
+	icache_destroy(vm->icache);
+	vm->icache = icache_get(tmpl->icache);
+}
+
+/*
+ * Identify the code of vm: FNV-1a over where the ROM sits and its contents,
+ * a word at a time. Keys what is built from the ROM alone, translated code
+ * and the decode cache.
+ */
+uint64_t vm_rom_hash(struct vm *vm)
+{
+	const uint8_t *p = vm->rom.mem;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	uint32_t i;
+
+	hash = (hash ^ vm->rom.base_addr) * 0x100000001b3ull;
+	hash = (hash ^ vm->rom.size) * 0x100000001b3ull;
+	for (i = 0; i + 8 <= vm->rom.size; i += 8) {
+		uint64_t word;
+
+		memcpy(&word, p + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ull;
+	}
+	for (; i < vm->rom.size; i++)
+		hash = (hash ^ p[i]) * 0x100000001b3ull;
+
+	return hash;
+}
+
+void vm_destroy(struct vm *vm)
+{
+	vm_flush_fast(vm);
+	vm_flush_jit(vm);
+	ecall_destroy(vm);
+
+	if (vm->icache)
+		icache_destroy(vm->icache);
+
+	mm_destroy_mapping(&vm->rom);
+	mm_destroy_mapping(&vm->ram);
+	for (int i = 0; i < vm->nr_segments; i++)
+		mm_destroy_mapping(&vm->segments[i]);
+
+	mm_bus_exit(&vm->bus);
+	free(vm);
+}
+
 void vm_run(struct vm *vm)
 {
-	uint32_t inst;
+	struct inst_decoded *d;
+	uint32_t pc;
 
-	vm->cpu.pc = vm->rom.base_addr;
-		
 	do {
-		vm_dump_registers(vm);
+		pc = vm->cpu.pc;
+		d = icache_lookup(vm->icache, pc);
 
-		inst = vm_fetch_inst(vm);
+		vm->cpu.pc = pc + d->len;
+		d->handler(vm, d);
 
-		printf("PC (0x%08x) = 0x%08x\n", (uint32_t)vm->cpu.pc - 4, inst);
+		trace_exec(vm, pc, d);
 
-		inst_execute(vm, inst);
-	} while(inst && ((vm->cpu.pc > vm->rom.base_addr) && (vm->cpu.pc < (vm->rom.base_addr + vm->rom.size))));
+		vm->icount++;
+	} while(d->inst && !vm->halted && ((vm->cpu.pc >= vm->rom.base_addr) && (vm->cpu.pc < (vm->rom.base_addr + vm->rom.size))));
 }
 
 void vm_dump_registers(struct vm *vm)
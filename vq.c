@@ -0,0 +1,319 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <vm.h>
+#include <mm.h>
+#include <ecall.h>
+#include <vq.h>
+
+static uint32_t vq_ring_size(uint32_t num)
+{
+	return num * sizeof(struct vq_desc) + 4 + num * 4 + 4 + num * sizeof(struct vq_used);
+}
+
+/* Map the ring of q into the host, it has to sit in one writable mapping. */
+static int vq_setup(struct vq_dev *dev, struct vq *q)
+{
+	uint8_t *ring;
+
+	if (!q->num || q->num > VQ_MAX_NUM || (q->num & (q->num - 1)) || (q->ring & 3))
+		return -EINVAL;
+
+	ring = bus_host_range(&dev->vm->bus, q->ring, vq_ring_size(q->num), BUS_READ | BUS_WRITE);
+	if (!ring)
+		return -EFAULT;
+
+	q->desc = (struct vq_desc *)ring;
+	q->avail_idx = (uint32_t *)(ring + q->num * sizeof(struct vq_desc));
+	q->avail = q->avail_idx + 1;
+	q->used_idx = q->avail + q->num;
+	q->used = (struct vq_used *)(q->used_idx + 1);
+	q->last_avail = 0;
+
+	return 0;
+}
+
+static void vq_push(struct vq *q, uint32_t id, uint32_t len)
+{
+	struct vq_used *used = &q->used[*q->used_idx & (q->num - 1)];
+
+	used->id = id;
+	used->len = len;
+	(*q->used_idx)++;
+}
+
+/*
+ * Gather the buffers posted since the last notify, up to VQ_BATCH of them
+ * and stopping short of a bad descriptor, which is handed back empty once
+ * the buffers before it are done. Returns the number gathered.
+ */
+static int vq_gather(struct vq_dev *dev, struct vq *q, struct iovec *iov, uint32_t *ids,
+		     int access)
+{
+	uint32_t avail = *q->avail_idx;
+	int nr = 0;
+
+	while (nr < VQ_BATCH && q->last_avail + nr != avail) {
+		uint32_t id = q->avail[(q->last_avail + nr) & (q->num - 1)];
+		struct vq_desc *desc;
+		void *buf;
+
+		if (id >= q->num)
+			break;
+
+		desc = &q->desc[id];
+		buf = bus_host_range(&dev->vm->bus, desc->addr, desc->len, access);
+		if (!buf)
+			break;
+
+		iov[nr].iov_base = buf;
+		iov[nr].iov_len = desc->len;
+		ids[nr++] = id;
+	}
+
+	if (!nr && q->last_avail != avail) {
+		dev->status |= VQ_STATUS_ERROR;
+		vq_push(q, q->avail[q->last_avail & (q->num - 1)], 0);
+		q->last_avail++;
+	}
+
+	return nr;
+}
+
+/*
+ * The guest cannot have more buffers posted than the ring holds, an avail
+ * index further ahead is a broken ring and nothing of it is processed.
+ */
+static int vq_avail_bad(struct vq_dev *dev, struct vq *q)
+{
+	if (*q->avail_idx - q->last_avail <= q->num)
+		return 0;
+
+	dev->status |= VQ_STATUS_ERROR;
+	return 1;
+}
+
+static ssize_t vq_writev_all(int fd, struct iovec *iov, int nr)
+{
+	ssize_t total = 0;
+
+	while (nr) {
+		ssize_t ret = writev(fd, iov, nr);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		total += ret;
+
+		/* skip what went out, resume in the middle of a buffer if need be */
+		while (nr && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			nr--;
+		}
+		if (nr) {
+			iov->iov_base = (uint8_t *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return total;
+}
+
+static void vq_tx(struct vq_dev *dev, struct vq *q)
+{
+	struct iovec iov[VQ_BATCH];
+	uint32_t ids[VQ_BATCH];
+	uint32_t lens[VQ_BATCH];
+	int nr;
+
+	if (vq_avail_bad(dev, q))
+		return;
+
+	/* after whatever the guest printed through write() */
+	if (q->fd == STDOUT_FILENO) {
+		ecall_flush(dev->vm);
+		fflush(stdout);
+	}
+
+	while (*q->avail_idx != q->last_avail) {
+		nr = vq_gather(dev, q, iov, ids, BUS_READ);
+		if (!nr)
+			continue;
+
+		for (int i = 0; i < nr; i++)
+			lens[i] = iov[i].iov_len;
+
+		if (vq_writev_all(q->fd, iov, nr) < 0) {
+			dev->status |= VQ_STATUS_ERROR;
+			for (int i = 0; i < nr; i++)
+				lens[i] = 0;
+		}
+
+		for (int i = 0; i < nr; i++)
+			vq_push(q, ids[i], lens[i]);
+		q->last_avail += nr;
+	}
+}
+
+/*
+ * Fill the posted buffers in order. A short read means the file has no
+ * more for now, the buffers left stay posted until the next notify.
+ */
+static void vq_rx(struct vq_dev *dev, struct vq *q)
+{
+	struct iovec iov[VQ_BATCH];
+	uint32_t ids[VQ_BATCH];
+
+	if (vq_avail_bad(dev, q))
+		return;
+
+	while (!(dev->status & VQ_STATUS_EOF) && *q->avail_idx != q->last_avail) {
+		size_t want = 0;
+		ssize_t ret;
+		int nr;
+
+		nr = vq_gather(dev, q, iov, ids, BUS_WRITE);
+		if (!nr)
+			continue;
+
+		for (int i = 0; i < nr; i++)
+			want += iov[i].iov_len;
+
+		ret = readv(q->fd, iov, nr);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			dev->status |= VQ_STATUS_ERROR | VQ_STATUS_EOF;
+			return;
+		}
+
+		if (!ret) {
+			dev->status |= VQ_STATUS_EOF;
+			return;
+		}
+
+		for (int i = 0, left = ret; i < nr && left; i++) {
+			uint32_t len = left < iov[i].iov_len ? left : iov[i].iov_len;
+
+			vq_push(q, ids[i], len);
+			q->last_avail++;
+			left -= len;
+		}
+
+		if (ret < want)
+			return;
+	}
+}
+
+static uint32_t vq_read(void *opaque, uint32_t offset, int size)
+{
+	struct vq_dev *dev = opaque;
+	struct vq *q = &dev->queues[dev->sel];
+
+	switch (offset) {
+	case VQ_REG_SEL:
+		return dev->sel;
+	case VQ_REG_NUM:
+		return q->num;
+	case VQ_REG_RING:
+		return q->ring;
+	case VQ_REG_READY:
+		return q->ready;
+	case VQ_REG_STATUS:
+		return dev->status;
+	}
+
+	return 0;
+}
+
+static void vq_write(void *opaque, uint32_t offset, uint32_t value, int size)
+{
+	struct vq_dev *dev = opaque;
+	struct vq *q = &dev->queues[dev->sel];
+
+	switch (offset) {
+	case VQ_REG_SEL:
+		if (value < VQ_NR_QUEUES)
+			dev->sel = value;
+		break;
+	case VQ_REG_NUM:
+		if (!q->ready)
+			q->num = value;
+		break;
+	case VQ_REG_RING:
+		if (!q->ready)
+			q->ring = value;
+		break;
+	case VQ_REG_READY:
+		q->ready = 0;
+		if (!value)
+			break;
+		if (vq_setup(dev, q) < 0) {
+			dev->status |= VQ_STATUS_ERROR;
+			break;
+		}
+		q->ready = 1;
+		break;
+	case VQ_REG_NOTIFY:
+		if (value >= VQ_NR_QUEUES || !dev->queues[value].ready)
+			break;
+		/* a queue without a host file has nothing to talk to */
+		if (dev->queues[value].fd < 0)
+			break;
+		if (value == VQ_TX)
+			vq_tx(dev, &dev->queues[value]);
+		else
+			vq_rx(dev, &dev->queues[value]);
+		break;
+	}
+}
+
+static void vq_release(void *opaque)
+{
+	struct vq_dev *dev = opaque;
+
+	for (int i = 0; i < VQ_NR_QUEUES; i++)
+		if (dev->queues[i].fd > STDERR_FILENO)
+			close(dev->queues[i].fd);
+
+	free(dev);
+}
+
+static const struct bus_mmio_ops vq_ops = {
+	.read = vq_read,
+	.write = vq_write,
+	.release = vq_release,
+};
+
+/*
+ * Attach a queue device to vm, receiving from rx_fd and sending to tx_fd,
+ * either of which may be -1. Once attached the device owns both files and
+ * goes away with the vm.
+ */
+struct vq_dev *vq_create(struct vm *vm, int rx_fd, int tx_fd)
+{
+	struct vq_dev *dev;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	dev->vm = vm;
+	dev->queues[VQ_RX].fd = rx_fd;
+	dev->queues[VQ_TX].fd = tx_fd;
+	if (rx_fd < 0)
+		dev->status |= VQ_STATUS_EOF;
+
+	if (mm_bus_map_mmio(&vm->bus, VQ_MMIO_BASE, VQ_MMIO_SIZE, &vq_ops, dev) < 0) {
+		free(dev);
+		return NULL;
+	}
+
+	return dev;
+}